@@ -0,0 +1,771 @@
+// Lookup benchmark over every index type.
+//
+//   vecidx_bench [--size N] [--dist uniform|zipf|clustered|sequential]
+//                [--miss RATIO] [--order random|sorted|zipf]
+//                [--key u32|u64|i32|i64|f32|f64] [--queries N] [--reps N]
+//                [--warmup N] [--batch] [--stats] [--latency N] [--zipf S]
+//                [--seed N] [--index NAME[,NAME...]] [--out FILE] [--list]
+//
+// Builds every index (or the --index ones) over the same keys, runs the
+// same query stream through find(), or find_batch() with --batch, reps
+// times after warmup untimed runs, and writes ns per lookup of every run
+// and their statistics as JSON. Every index must find as many keys as the
+// container_only baseline, a mismatch fails the run.
+//
+// Next to the times go the hardware counters of the timed runs per lookup,
+// null where perf_event_open is not allowed. With --stats the indexes that
+// take a stats policy run the queries once more, instrumented, for the
+// comparisons, levels and final search window per lookup.
+//
+// --latency N times every group of N queries on its own with the fenced
+// time stamp counter, into a log bucketed histogram over all timed runs,
+// and adds the percentiles of the group latency. With 1 that is every
+// find(), larger groups amortise the ~20 ns the timer itself costs, which
+// the ns per lookup of those runs include too.
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+#include <type_traits>
+
+#include "../vecidx/vector_index.h"
+#include "../vecidx/search_index.h"
+#include "../vecidx/tree_index.h"
+#include "../vecidx/stree_index.h"
+#include "../vecidx/smart_step.h"
+#include "../vecidx/learned_index.h"
+#include "../vecidx/stats.h"
+#include "../vecidx/hash_index.h"
+
+#include "latency.h"
+
+namespace {
+
+// Plain binary search over the sorted keys, what every index has to beat.
+template< class Cont_T >
+struct container_only
+{
+    using container_type = Cont_T;
+    using value_type     = typename container_type::value_type;
+    using const_iterator = typename container_type::const_iterator;
+
+    container_only( const container_type& ref ) : ref_( ref ){}
+
+    void build_index(){}
+
+    const_iterator find( const value_type& key ) const
+    {
+        auto first = std::lower_bound( ref_.begin(), ref_.end(), key );
+        return (first!=ref_.end() && !(key<*first)) ? first : ref_.end();
+    }
+
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return std::transform( first, last, out, [&]( const value_type& key ){ return find( key ); } );
+    }
+
+    size_t memory_usage() const
+    {
+        return 0;
+    }
+
+private:
+    const container_type& ref_;
+};
+
+struct options
+{
+    size_t size = size_t( 1 ) << 24;
+    std::string dist = "uniform";
+    double miss = 0;
+    std::string order = "random";
+    std::string key = "u32";
+    size_t queries = size_t( 1 ) << 22;
+    size_t reps = 5;
+    size_t warmup = 1;
+    bool batch = false;
+    bool stats = false;
+    size_t latency = 0;
+    double zipf = 0.99;
+    uint64_t seed = 1;
+    std::vector< std::string > indexes;
+    std::string out;
+    bool list = false;
+};
+
+struct result
+{
+    std::string index;
+    double build_ms;
+    size_t memory;
+    size_t found;
+    std::vector< double > ns;
+    // Per lookup, negative when not available.
+    double counters[ vecidx::perf_counters::event_count ];
+    bool stats = false;
+    double compares;
+    double levels;
+    double window;
+    // Of the --latency groups, in ns.
+    vecidx::bench::log_histogram<> latency;
+    double ns_per_tick;
+    uint64_t overhead;
+};
+
+// Zipf distributed integers in [1, n], P( k ) ~ 1 / k^s, by rejection
+// inversion (Hoermann & Derflinger): constant time per sample at any n.
+class zipf_distribution
+{
+public:
+    zipf_distribution( double n, double s ) : n_( n ), s_( s )
+    {
+        h_x1_ = h_integral( 1.5 ) - 1;
+        h_n_ = h_integral( n_ + 0.5 );
+        cut_ = 2 - h_integral_inverse( h_integral( 2.5 ) - h( 2 ) );
+    }
+
+    template< typename Rng_T >
+    double operator()( Rng_T& rng )
+    {
+        std::uniform_real_distribution< double > unit;
+        for( ;; )
+        {
+            double u = h_n_ + unit( rng ) * ( h_x1_ - h_n_ );
+            double x = h_integral_inverse( u );
+            double k = std::min( std::max( std::floor( x + 0.5 ), 1.0 ), n_ );
+            if( k - x <= cut_ || u >= h_integral( k + 0.5 ) - h( k ) )
+            {
+                return k;
+            }
+        }
+    }
+
+private:
+    double n_;
+    double s_;
+    double h_x1_;
+    double h_n_;
+    double cut_;
+
+    double h( double x ) const
+    {
+        return std::exp( -s_ * std::log( x ) );
+    }
+
+    double h_integral( double x ) const
+    {
+        double log_x = std::log( x );
+        return helper2( ( 1 - s_ ) * log_x ) * log_x;
+    }
+
+    double h_integral_inverse( double x ) const
+    {
+        double t = std::max( x * ( 1 - s_ ), -1.0 );
+        return std::exp( helper1( t ) * x );
+    }
+
+    // log1p( x ) / x and expm1( x ) / x, continuous at 0.
+    static double helper1( double x )
+    {
+        return std::abs( x ) > 1e-8 ? std::log1p( x ) / x : 1 - x * ( 0.5 - x * ( 1.0 / 3 - 0.25 * x ) );
+    }
+
+    static double helper2( double x )
+    {
+        return std::abs( x ) > 1e-8 ? std::expm1( x ) / x : 1 + x * 0.5 * ( 1 + x / 3 * ( 1 + 0.25 * x ) );
+    }
+};
+
+// Keys of the workload: the data in random order for the indexes that
+// permute it themselves, sorted for the ones that search it in place, and
+// the queries.
+template< typename Key_T >
+struct workload
+{
+    std::vector< Key_T > data;
+    std::vector< Key_T > sorted;
+    std::vector< Key_T > queries;
+};
+
+// Largest key the generators use, leaving room above for misses.
+template< typename Key_T >
+double key_domain()
+{
+    return std::is_floating_point< Key_T >::value ? 1e15 :
+           std::min( static_cast< double >( std::numeric_limits< Key_T >::max() ) / 2, 1e18 );
+}
+
+template< typename Key_T >
+Key_T to_key( double val )
+{
+    return static_cast< Key_T >( val );
+}
+
+// Next key after key, for the misses.
+template< typename Key_T >
+Key_T next_key( Key_T key, std::true_type )
+{
+    return std::nextafter( key, std::numeric_limits< Key_T >::max() );
+}
+
+template< typename Key_T >
+Key_T next_key( Key_T key, std::false_type )
+{
+    return key + 1;
+}
+
+template< typename Key_T >
+std::vector< Key_T > make_data( const options& opt, std::mt19937_64& rng )
+{
+    double domain = key_domain< Key_T >();
+    std::vector< Key_T > ret( opt.size );
+    if( "sequential" == opt.dist )
+    {
+        // Every other key, so there are gaps to miss.
+        for( size_t i = 0; i < opt.size; ++i )
+        {
+            ret[ i ] = to_key< Key_T >( 2.0 * i );
+        }
+    }
+    else if( "uniform" == opt.dist )
+    {
+        std::uniform_real_distribution< double > dist( 0, domain );
+        for( auto& key : ret )
+        {
+            key = to_key< Key_T >( std::floor( dist( rng ) ) );
+        }
+    }
+    else if( "zipf" == opt.dist )
+    {
+        // Skewed values, with long runs of duplicates at the low end.
+        zipf_distribution dist( domain, opt.zipf );
+        for( auto& key : ret )
+        {
+            key = to_key< Key_T >( dist( rng ) );
+        }
+    }
+    else if( "clustered" == opt.dist )
+    {
+        // Dense runs of 1024 keys, 1 to 8 apart, at uniform random starts.
+        std::uniform_real_distribution< double > start( 0, std::max( domain - 8.0 * opt.size, 1.0 ) );
+        std::uniform_int_distribution< int > gap( 1, 8 );
+        double key = 0;
+        for( size_t i = 0; i < opt.size; ++i )
+        {
+            key = 0 == i % 1024 ? std::floor( start( rng ) ) : key + gap( rng );
+            ret[ i ] = to_key< Key_T >( key );
+        }
+    }
+    else
+    {
+        throw std::invalid_argument( "unknown --dist " + opt.dist );
+    }
+    std::shuffle( ret.begin(), ret.end(), rng );
+    return ret;
+}
+
+template< typename Key_T >
+workload< Key_T > make_workload( const options& opt )
+{
+    std::mt19937_64 rng( opt.seed );
+    workload< Key_T > ret;
+    ret.data = make_data< Key_T >( opt, rng );
+    ret.sorted = ret.data;
+    std::sort( ret.sorted.begin(), ret.sorted.end() );
+
+    // Hits are keys of the data, misses the next key after one that is not
+    // in it, so they land among the data and not past its end.
+    std::uniform_real_distribution< double > unit;
+    std::uniform_int_distribution< size_t > any( 0, opt.size - 1 );
+    std::vector< size_t > hot( opt.size );
+    std::iota( hot.begin(), hot.end(), 0 );
+    std::shuffle( hot.begin(), hot.end(), rng );
+    zipf_distribution popular( static_cast< double >( opt.size ), opt.zipf );
+    auto pick = [&]()
+                {
+                    // Zipf order makes a few keys, scattered over the data,
+                    // most of the queries.
+                    return "zipf" == opt.order ? hot[ static_cast< size_t >( popular( rng ) ) - 1 ] : any( rng );
+                };
+
+    ret.queries.resize( opt.queries );
+    for( auto& query : ret.queries )
+    {
+        Key_T key = ret.sorted[ pick() ];
+        if( unit( rng ) < opt.miss )
+        {
+            for( int tries = 0; tries < 64; ++tries )
+            {
+                key = next_key( key, std::is_floating_point< Key_T >() );
+                if( !std::binary_search( ret.sorted.begin(), ret.sorted.end(), key ) )
+                {
+                    break;
+                }
+            }
+        }
+        query = key;
+    }
+    if( "sorted" == opt.order )
+    {
+        std::sort( ret.queries.begin(), ret.queries.end() );
+    }
+    else if( "random" != opt.order && "zipf" != opt.order )
+    {
+        throw std::invalid_argument( "unknown --order " + opt.order );
+    }
+    return ret;
+}
+
+template< typename Index_T, typename Key_T >
+result run( const std::string& name, const std::vector< Key_T >& data,
+            const std::vector< Key_T >& queries, const options& opt )
+{
+    using clock = std::chrono::steady_clock;
+
+    std::cerr << name << "..." << std::endl;
+    result ret;
+    ret.index = name;
+
+    Index_T index( data );
+    auto start = clock::now();
+    index.build_index();
+    ret.build_ms = std::chrono::duration< double, std::milli >( clock::now() - start ).count();
+    ret.memory = index.memory_usage();
+
+    vecidx::perf_counters counters;
+    uint64_t events[ vecidx::perf_counters::event_count ] = {};
+
+    if( opt.latency )
+    {
+        ret.ns_per_tick = vecidx::bench::tsc_ns_per_tick();
+        ret.overhead = vecidx::bench::tsc_overhead();
+    }
+
+    std::vector< typename std::vector< Key_T >::const_iterator > found( opt.batch ? queries.size() : 0 );
+    for( size_t rep = 0; rep < opt.warmup + opt.reps; ++rep )
+    {
+        size_t count = 0;
+        counters.start();
+        start = clock::now();
+        if( opt.latency )
+        {
+            bool timed = rep >= opt.warmup;
+            for( size_t i = 0; i < queries.size(); i += opt.latency )
+            {
+                size_t end = std::min( i + opt.latency, queries.size() );
+                uint64_t tsc = vecidx::bench::tsc_start();
+                if( opt.batch )
+                {
+                    index.find_batch( queries.begin() + i, queries.begin() + end, found.begin() + i );
+                }
+                else
+                {
+                    for( size_t q = i; q < end; ++q )
+                    {
+                        count += data.end() != index.find( queries[ q ] );
+                    }
+                }
+                tsc = vecidx::bench::tsc_stop() - tsc;
+                if( timed )
+                {
+                    ret.latency.record( tsc );
+                }
+            }
+            for( const auto& it : found )
+            {
+                count += data.end() != it;
+            }
+        }
+        else if( opt.batch )
+        {
+            index.find_batch( queries.begin(), queries.end(), found.begin() );
+            for( const auto& it : found )
+            {
+                count += data.end() != it;
+            }
+        }
+        else
+        {
+            for( const Key_T& key : queries )
+            {
+                count += data.end() != index.find( key );
+            }
+        }
+        double ns = std::chrono::duration< double, std::nano >( clock::now() - start ).count();
+        counters.stop();
+        ret.found = count;
+        if( rep >= opt.warmup )
+        {
+            ret.ns.push_back( ns / std::max< size_t >( queries.size(), 1 ) );
+            for( int e = 0; e < vecidx::perf_counters::event_count; ++e )
+            {
+                events[ e ] += counters.value( static_cast< vecidx::perf_counters::event >( e ) );
+            }
+        }
+    }
+
+    double lookups = static_cast< double >( std::max< size_t >( queries.size() * opt.reps, 1 ) );
+    for( int e = 0; e < vecidx::perf_counters::event_count; ++e )
+    {
+        bool available = counters.available( static_cast< vecidx::perf_counters::event >( e ) );
+        ret.counters[ e ] = available ? events[ e ] / lookups : -1;
+    }
+    return ret;
+}
+
+// Instrumented twin of an index, for --stats.
+struct no_stats_index {};
+
+template< typename Key_T >
+void collect_stats( no_stats_index*, const std::vector< Key_T >&, const std::vector< Key_T >&, result& ) {}
+
+template< typename Index_T, typename Key_T >
+void collect_stats( Index_T*, const std::vector< Key_T >& data, const std::vector< Key_T >& queries, result& ret )
+{
+    Index_T index( data );
+    index.build_index();
+    for( const Key_T& key : queries )
+    {
+        index.find( key );
+    }
+    ret.stats = true;
+    ret.compares = index.stats().compares_per_lookup();
+    ret.levels = index.stats().levels_per_lookup();
+    ret.window = index.stats().window_per_lookup();
+}
+
+// Every index type over keys of Key_T, by name.
+template< typename Key_T >
+struct suite
+{
+    using run_fn = std::function< result( const workload< Key_T >&, const options& ) >;
+    std::vector< std::pair< std::string, run_fn > > runs;
+
+    using alloc = vecidx::aligned_allocator< Key_T >;
+    using stats = vecidx::lookup_stats;
+
+    // Index_T over the data in random order, or over the sorted data, and
+    // its lookup_stats twin if it has one.
+    template< typename Index_T, typename Stats_Index_T = no_stats_index >
+    void add( const std::string& name, bool sorted )
+    {
+        runs.emplace_back( name, [name, sorted]( const workload< Key_T >& w, const options& opt )
+                                 {
+                                     const std::vector< Key_T >& data = sorted ? w.sorted : w.data;
+                                     result ret = run< Index_T >( name, data, w.queries, opt );
+                                     if( opt.stats )
+                                     {
+                                         collect_stats( static_cast< Stats_Index_T* >( nullptr ), data, w.queries, ret );
+                                     }
+                                     return ret;
+                                 });
+    }
+
+    // The packed storage takes integer keys only.
+    void add_packed( std::true_type )
+    {
+        add< vecidx::vector_index< uint32_t, Key_T, std::less< Key_T >, vecidx::packed > >( "vector_index/packed", false );
+        add< vecidx::tree_index< uint32_t, Key_T, std::less< Key_T >, vecidx::packed >,
+             vecidx::tree_index< uint32_t, Key_T, std::less< Key_T >, vecidx::packed, alloc, stats > >( "tree_index/packed", false );
+    }
+
+    void add_packed( std::false_type ) {}
+
+    suite()
+    {
+        using vec = std::vector< Key_T >;
+        add< container_only< vec > >( "container_only", true );
+        add< vecidx::vector_index< uint32_t, Key_T > >( "vector_index", false );
+        add< vecidx::vector_index< uint32_t, Key_T, std::less< Key_T >, vecidx::key_inline > >( "vector_index/key_inline", false );
+        add< vecidx::search_index< uint32_t, Key_T > >( "search_index", false );
+        add< vecidx::search_index< uint32_t, Key_T, std::less< Key_T >, vecidx::position_only > >( "search_index/position_only", false );
+        add< vecidx::tree_index< uint32_t, Key_T >,
+             vecidx::tree_index< uint32_t, Key_T, std::less< Key_T >, vecidx::position_only, alloc, stats > >( "tree_index", false );
+        add< vecidx::tree_index< uint32_t, Key_T, std::less< Key_T >, vecidx::key_inline >,
+             vecidx::tree_index< uint32_t, Key_T, std::less< Key_T >, vecidx::key_inline, alloc, stats > >( "tree_index/key_inline", false );
+        add_packed( std::integral_constant< bool, std::is_integral< Key_T >::value >() );
+        add< vecidx::stree_index< uint32_t, Key_T > >( "stree_index", false );
+        add< vecidx::smart_step< uint32_t, Key_T >,
+             vecidx::smart_step< uint32_t, Key_T, stats > >( "smart_step", true );
+        add< vecidx::smart_step2< uint32_t, Key_T >,
+             vecidx::smart_step2< uint32_t, Key_T, alloc, stats > >( "smart_step2", true );
+        add< vecidx::smart_step_auto< uint32_t, Key_T >,
+             vecidx::smart_step_auto< uint32_t, Key_T, alloc, stats > >( "smart_stepN", true );
+        add< vecidx::any_smart_step< vec >,
+             vecidx::any_smart_step< vec, stats > >( "any_smart_step", true );
+        add< vecidx::learned_index< uint32_t, Key_T > >( "learned_index", true );
+        add< vecidx::hash_accelerated< vecidx::search_index< uint32_t, Key_T > > >( "search_index/hash", false );
+        add< vecidx::hash_accelerated< vecidx::smart_step2< uint32_t, Key_T > > >( "smart_step2/hash", true );
+    }
+};
+
+void write_stats( std::ostream& out, const std::vector< double >& ns )
+{
+    std::vector< double > sorted = ns;
+    std::sort( sorted.begin(), sorted.end() );
+    double mean = std::accumulate( ns.begin(), ns.end(), 0.0 ) / ns.size();
+    double var = 0;
+    for( double x : ns )
+    {
+        var += ( x - mean ) * ( x - mean );
+    }
+    var = ns.size() > 1 ? var / ( ns.size() - 1 ) : 0;
+    size_t mid = sorted.size() / 2;
+    double median = sorted.size() % 2 ? sorted[ mid ] : ( sorted[ mid - 1 ] + sorted[ mid ] ) / 2;
+
+    out << "{ \"mean\": " << mean << ", \"stddev\": " << std::sqrt( var )
+        << ", \"min\": " << sorted.front() << ", \"median\": " << median
+        << ", \"max\": " << sorted.back() << ", \"runs\": [";
+    for( size_t i = 0; i < ns.size(); ++i )
+    {
+        out << ( i ? ", " : " " ) << ns[ i ];
+    }
+    out << " ] }";
+}
+
+void write_latency( std::ostream& out, const result& r, size_t group )
+{
+    const auto& h = r.latency;
+    auto ns = [&]( double ticks ) { return ticks * r.ns_per_tick; };
+    out << "{ \"group\": " << group << ", \"samples\": " << h.count()
+        << ", \"overhead\": " << ns( r.overhead )
+        << ", \"min\": " << ns( h.min() ) << ", \"mean\": " << ns( h.mean() )
+        << ", \"p50\": " << ns( h.percentile( 0.5 ) ) << ", \"p90\": " << ns( h.percentile( 0.9 ) )
+        << ", \"p99\": " << ns( h.percentile( 0.99 ) ) << ", \"p999\": " << ns( h.percentile( 0.999 ) )
+        << ", \"p9999\": " << ns( h.percentile( 0.9999 ) ) << ", \"max\": " << ns( h.max() ) << " }";
+}
+
+void write_json( std::ostream& out, const options& opt, const std::vector< result >& results, size_t expected )
+{
+    out << std::fixed << std::setprecision( 3 );
+    out << "{\n"
+        << "  \"config\": {\n"
+        << "    \"size\": " << opt.size << ",\n"
+        << "    \"dist\": \"" << opt.dist << "\",\n"
+        << "    \"miss\": " << opt.miss << ",\n"
+        << "    \"order\": \"" << opt.order << "\",\n"
+        << "    \"key\": \"" << opt.key << "\",\n"
+        << "    \"queries\": " << opt.queries << ",\n"
+        << "    \"reps\": " << opt.reps << ",\n"
+        << "    \"warmup\": " << opt.warmup << ",\n"
+        << "    \"mode\": \"" << ( opt.batch ? "find_batch" : "find" ) << "\",\n"
+        << "    \"stats\": " << ( opt.stats ? "true" : "false" ) << ",\n"
+        << "    \"latency\": " << opt.latency << ",\n"
+        << "    \"zipf\": " << opt.zipf << ",\n"
+        << "    \"seed\": " << opt.seed << ",\n"
+        << "    \"isa\": \"" << vecidx::isa::name( vecidx::isa::detect() ) << "\",\n"
+        << "    \"build_threads\": " << vecidx::build_threads() << ",\n"
+#if defined( __VERSION__ )
+        << "    \"compiler\": \"" << __VERSION__ << "\",\n"
+#endif
+        << "    \"found\": " << expected << "\n"
+        << "  },\n"
+        << "  \"results\": [";
+    for( size_t i = 0; i < results.size(); ++i )
+    {
+        const result& r = results[ i ];
+        out << ( i ? "," : "" ) << "\n    { \"index\": \"" << r.index << "\""
+            << ", \"build_ms\": " << r.build_ms
+            << ", \"memory_bytes\": " << r.memory
+            << ", \"found\": " << r.found
+            << ",\n      \"ns_per_lookup\": ";
+        write_stats( out, r.ns );
+        out << ",\n      \"counters\": {";
+        for( int e = 0; e < vecidx::perf_counters::event_count; ++e )
+        {
+            out << ( e ? ", \"" : " \"" ) << vecidx::perf_counters::name( static_cast< vecidx::perf_counters::event >( e ) )
+                << "\": ";
+            if( r.counters[ e ] < 0 )
+            {
+                out << "null";
+            }
+            else
+            {
+                out << r.counters[ e ];
+            }
+        }
+        out << " }";
+        if( r.stats )
+        {
+            out << ",\n      \"stats\": { \"compares\": " << r.compares << ", \"levels\": " << r.levels
+                << ", \"window\": " << r.window << " }";
+        }
+        if( opt.latency )
+        {
+            out << ",\n      \"latency_ns\": ";
+            write_latency( out, r, opt.latency );
+        }
+        out << " }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+template< typename Key_T >
+int bench( const options& opt )
+{
+    suite< Key_T > all;
+    if( opt.list )
+    {
+        for( const auto& entry : all.runs )
+        {
+            std::cout << entry.first << "\n";
+        }
+        return 0;
+    }
+
+    workload< Key_T > w = make_workload< Key_T >( opt );
+    std::vector< result > results;
+    for( const auto& entry : all.runs )
+    {
+        if( opt.indexes.empty() ||
+            opt.indexes.end() != std::find( opt.indexes.begin(), opt.indexes.end(), entry.first ) )
+        {
+            results.push_back( entry.second( w, opt ) );
+        }
+    }
+
+    // Everything has to agree with the plain binary search.
+    size_t expected = std::count_if( w.queries.begin(), w.queries.end(), [&]( const Key_T& key )
+                                     {
+                                         return std::binary_search( w.sorted.begin(), w.sorted.end(), key );
+                                     });
+    int ret = 0;
+    for( const result& r : results )
+    {
+        if( expected != r.found )
+        {
+            std::cerr << r.index << " found " << r.found << " keys, expected " << expected << std::endl;
+            ret = 1;
+        }
+    }
+
+    if( opt.out.empty() )
+    {
+        write_json( std::cout, opt, results, expected );
+    }
+    else
+    {
+        std::ofstream file( opt.out );
+        write_json( file, opt, results, expected );
+        if( !file )
+        {
+            std::cerr << "can not write " << opt.out << std::endl;
+            return 1;
+        }
+    }
+    return ret;
+}
+
+void usage()
+{
+    std::cerr << "usage: vecidx_bench [--size N] [--dist uniform|zipf|clustered|sequential]\n"
+                 "                    [--miss RATIO] [--order random|sorted|zipf]\n"
+                 "                    [--key u32|u64|i32|i64|f32|f64] [--queries N] [--reps N]\n"
+                 "                    [--warmup N] [--batch] [--stats] [--latency N] [--zipf S]\n"
+                 "                    [--seed N] [--index NAME[,NAME...]] [--out FILE] [--list]\n";
+}
+
+options parse( int argc, char* argv[] )
+{
+    options opt;
+    for( int i = 1; i < argc; ++i )
+    {
+        std::string arg = argv[ i ];
+        std::string val;
+        size_t eq = arg.find( '=' );
+        if( std::string::npos != eq )
+        {
+            val = arg.substr( eq + 1 );
+            arg = arg.substr( 0, eq );
+        }
+        auto value = [&]() -> const std::string&
+                     {
+                         if( std::string::npos == eq )
+                         {
+                             if( i + 1 >= argc )
+                             {
+                                 throw std::invalid_argument( arg + " needs a value" );
+                             }
+                             val = argv[ ++i ];
+                         }
+                         return val;
+                     };
+
+        if( "--size" == arg )         opt.size = std::stoull( value() );
+        else if( "--dist" == arg )    opt.dist = value();
+        else if( "--miss" == arg )    opt.miss = std::stod( value() );
+        else if( "--order" == arg )   opt.order = value();
+        else if( "--key" == arg )     opt.key = value();
+        else if( "--queries" == arg ) opt.queries = std::stoull( value() );
+        else if( "--reps" == arg )    opt.reps = std::stoull( value() );
+        else if( "--warmup" == arg )  opt.warmup = std::stoull( value() );
+        else if( "--latency" == arg ) opt.latency = std::stoull( value() );
+        else if( "--zipf" == arg )    opt.zipf = std::stod( value() );
+        else if( "--seed" == arg )    opt.seed = std::stoull( value() );
+        else if( "--out" == arg )     opt.out = value();
+        else if( "--batch" == arg )   opt.batch = true;
+        else if( "--stats" == arg )   opt.stats = true;
+        else if( "--list" == arg )    opt.list = true;
+        else if( "--index" == arg )
+        {
+            std::stringstream names( value() );
+            std::string name;
+            while( std::getline( names, name, ',' ) )
+            {
+                opt.indexes.push_back( name );
+            }
+        }
+        else
+        {
+            throw std::invalid_argument( "unknown option " + arg );
+        }
+    }
+
+    // Positions are 32 bits wide.
+    if( 0 == opt.size || opt.size >= std::numeric_limits< uint32_t >::max() )
+    {
+        throw std::invalid_argument( "--size must be in [1, 2^32 - 1)" );
+    }
+    if( 0 == opt.reps || opt.miss < 0 || opt.miss > 1 || opt.zipf <= 0 )
+    {
+        throw std::invalid_argument( "--reps must be positive, --miss in [0, 1] and --zipf positive" );
+    }
+    return opt;
+}
+
+} // namespace
+
+int main( int argc, char* argv[] )
+{
+    try
+    {
+        options opt = parse( argc, argv );
+        if( "u32" == opt.key ) return bench< uint32_t >( opt );
+        if( "u64" == opt.key ) return bench< uint64_t >( opt );
+        if( "i32" == opt.key ) return bench< int32_t >( opt );
+        if( "i64" == opt.key ) return bench< int64_t >( opt );
+        if( "f32" == opt.key ) return bench< float >( opt );
+        if( "f64" == opt.key ) return bench< double >( opt );
+        throw std::invalid_argument( "unknown --key " + opt.key );
+    }
+    catch( const std::invalid_argument& e )
+    {
+        std::cerr << e.what() << "\n";
+        usage();
+        return 2;
+    }
+}
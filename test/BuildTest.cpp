@@ -0,0 +1,98 @@
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "../vecidx/build.h"
+#include "check.h"
+
+namespace {
+
+// sorted_permutation() against std::stable_sort of the positions: sorted,
+// a permutation, and stable, so equal keys keep their vector order.
+template< typename VecType_T >
+void check_permutation( const std::vector< VecType_T >& vec )
+{
+    std::vector< uint32_t > perm = vecidx::detail::sorted_permutation< uint32_t >( vec, std::less< VecType_T >() );
+
+    std::vector< uint32_t > expect( vec.size() );
+    std::iota( expect.begin(), expect.end(), 0 );
+    std::stable_sort( expect.begin(), expect.end(),
+                      [&]( uint32_t lhs, uint32_t rhs ){ return vec[ lhs ] < vec[ rhs ]; } );
+
+    VECIDX_CHECK( vec.size() == perm.size() );
+    bool sorted = true;
+    for( size_t i = 1; i < perm.size(); ++i )
+    {
+        sorted &= !( vec[ perm[ i ] ] < vec[ perm[ i - 1 ] ] );
+    }
+    VECIDX_CHECK( sorted );
+    std::vector< uint32_t > seen( perm );
+    std::sort( seen.begin(), seen.end() );
+    std::vector< uint32_t > all( vec.size() );
+    std::iota( all.begin(), all.end(), 0 );
+    VECIDX_CHECK( all == seen );
+    VECIDX_CHECK( expect == perm );
+}
+
+void check_size( size_t size, std::mt19937_64& rng )
+{
+    // Every byte value, the sign bit flipped.
+    std::vector< int8_t > small( size );
+    for( auto& key : small )
+    {
+        key = static_cast< int8_t >( rng() );
+    }
+    check_permutation( small );
+
+    // Full range, and near zero on both sides, where the high bytes are all
+    // 0x00 or 0xff and a pass has two digits.
+    std::vector< int64_t > wide( size );
+    std::vector< int64_t > near( size );
+    for( size_t i = 0; i < size; ++i )
+    {
+        wide[ i ] = static_cast< int64_t >( rng() );
+        near[ i ] = static_cast< int64_t >( rng() % 2001 ) - 1000;
+    }
+    check_permutation( wide );
+    check_permutation( near );
+
+    // Heavy duplicates, every pass but the first skipped.
+    std::vector< uint32_t > dups( size );
+    for( auto& key : dups )
+    {
+        key = static_cast< uint32_t >( rng() % 16 );
+    }
+    check_permutation( dups );
+
+    // Keys sharing their low bytes, so the first pass is the one skipped.
+    std::vector< uint32_t > high( size );
+    for( auto& key : high )
+    {
+        key = static_cast< uint32_t >( rng() % 64 ) << 24 | 0x5a5a;
+    }
+    check_permutation( high );
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937_64 rng( 7 );
+    // Both sides of the cutoff where the build goes parallel.
+    const size_t cutoff = vecidx::parallel_build_cutoff;
+    const size_t sizes[] = { 0, 1, 2, 255, 1000, cutoff - 1, cutoff, cutoff + 4097 };
+    const int threads[] = { 1, 4 };
+    for( int t : threads )
+    {
+        vecidx::set_build_threads( t );
+        for( size_t size : sizes )
+        {
+            check_size( size, rng );
+        }
+    }
+    vecidx::set_build_threads( 0 );
+    return vecidx::test::result( "BuildTest" );
+}
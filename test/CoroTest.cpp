@@ -0,0 +1,112 @@
+#include <cstdint>
+#include <functional>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "../vecidx/search_index.h"
+#include "../vecidx/tree_index.h"
+#include "../vecidx/smart_step.h"
+#include "check.h"
+
+#if defined( VECIDX_COROUTINES )
+
+namespace {
+
+// Every key through a lookup_scheduler, each result against find(): the
+// tags come back in whatever order the lookups end.
+template< typename Index_T >
+void interleaved( const std::vector< uint32_t >& keys, const std::vector< uint32_t >& probes, size_t width )
+{
+    Index_T index( keys );
+    index.build_index();
+
+    using const_iterator = typename Index_T::const_iterator;
+    std::vector< const_iterator > results( probes.size(), keys.cend() );
+    std::vector< int > delivered( probes.size(), 0 );
+    {
+        vecidx::lookup_scheduler< Index_T, std::function< void( size_t, const_iterator ) > > sched( index,
+            [&]( size_t tag, const_iterator it )
+            {
+                results[ tag ] = it;
+                ++delivered[ tag ];
+            }, width );
+        for( size_t i = 0; i < probes.size(); ++i )
+        {
+            sched.submit( probes[ i ], i );
+            VECIDX_CHECK( sched.in_flight() <= std::max< size_t >( width, 1 ) );
+            if( 0 == i % 1000 )
+            {
+                sched.step();
+            }
+        }
+        // Drained here or by the destructor.
+        if( width % 2 )
+        {
+            sched.drain();
+            VECIDX_CHECK( 0 == sched.in_flight() );
+        }
+    }
+
+    for( size_t i = 0; i < probes.size(); ++i )
+    {
+        VECIDX_CHECK( 1 == delivered[ i ] );
+        // Duplicates: found or not as find(), and the same key.
+        const_iterator expect = index.find( probes[ i ] );
+        VECIDX_CHECK( ( keys.cend() == expect ) == ( keys.cend() == results[ i ] ) );
+        VECIDX_CHECK( keys.cend() == results[ i ] || probes[ i ] == *results[ i ] );
+        VECIDX_CHECK( expect == index.find_coro( probes[ i ] ).get() );
+    }
+}
+
+template< typename Index_T >
+void all_widths( const std::vector< uint32_t >& keys, const std::vector< uint32_t >& probes )
+{
+    for( size_t width : { 0, 1, 3, 16, 64 } )
+    {
+        interleaved< Index_T >( keys, probes, width );
+    }
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng( 13 );
+    for( size_t size : { 0, 1, 5, 1000, 200000 } )
+    {
+        std::vector< uint32_t > keys( size );
+        for( auto& k : keys )
+        {
+            k = rng() % ( 3 * size + 1 );
+        }
+        std::sort( keys.begin(), keys.end() );
+        std::vector< uint32_t > probes( 5001 );
+        for( auto& p : probes )
+        {
+            p = rng() % ( 3 * size + 3 );
+        }
+
+        all_widths< vecidx::search_index< uint32_t, uint32_t > >( keys, probes );
+        all_widths< vecidx::search_index< uint32_t, uint32_t, std::less< uint32_t >, vecidx::position_only > >( keys, probes );
+        all_widths< vecidx::tree_index< uint32_t, uint32_t > >( keys, probes );
+        all_widths< vecidx::tree_index< uint32_t, uint32_t, std::less< uint32_t >, vecidx::key_inline > >( keys, probes );
+        // smart_step2 needs a few keys per bucket.
+        if( size >= 1000 )
+        {
+            all_widths< vecidx::smart_step2< uint32_t, uint32_t > >( keys, probes );
+        }
+    }
+    return vecidx::test::result( "CoroTest" );
+}
+
+#else
+
+int main()
+{
+    std::cout << "CoroTest: built without coroutines, nothing to test" << std::endl;
+    return 0;
+}
+
+#endif
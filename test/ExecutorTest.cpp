@@ -0,0 +1,105 @@
+#include <cstdint>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../vecidx/executor.h"
+#include "../vecidx/tree_index.h"
+#include "check.h"
+
+namespace {
+
+using index_type = vecidx::tree_index< uint32_t, uint32_t >;
+using executor_type = vecidx::query_executor< index_type >;
+
+// find_batch() from several callers at once, every answer checked against
+// std::lower_bound over the keys.
+void concurrent_batches( const std::vector< uint32_t >& keys, executor_type& exec )
+{
+    std::vector< std::thread > callers;
+    for( unsigned t = 0; t < 3; ++t )
+    {
+        callers.emplace_back( [&, t]
+        {
+            std::mt19937 rng( t + 1 );
+            for( int round = 0; round < 5; ++round )
+            {
+                std::vector< uint32_t > queries( 1000 + rng() % 10000 );
+                for( auto& q : queries )
+                {
+                    q = rng() % ( 2 * keys.size() );
+                }
+                std::vector< executor_type::const_iterator > out( queries.size() );
+                VECIDX_CHECK( out.end() == exec.find_batch( queries.begin(), queries.end(), out.begin() ) );
+                for( size_t i = 0; i < queries.size(); ++i )
+                {
+                    auto lower = std::lower_bound( keys.begin(), keys.end(), queries[ i ] );
+                    bool hit = keys.end() != lower && queries[ i ] == *lower;
+                    VECIDX_CHECK( hit == ( keys.end() != out[ i ] ) );
+                    VECIDX_CHECK( !hit || queries[ i ] == *out[ i ] );
+                }
+            }
+        });
+    }
+    for( auto& c : callers )
+    {
+        c.join();
+    }
+}
+
+// A throwing chunk reaches the caller, and the executor goes on working.
+void chunk_exception( const std::vector< uint32_t >& keys, executor_type& exec )
+{
+    bool threw = false;
+    try
+    {
+        exec.for_each_chunk( 10000, []( const index_type&, size_t begin, size_t end )
+        {
+            if( begin <= 5000 && 5000 < end )
+            {
+                throw std::runtime_error( "chunk" );
+            }
+        });
+    }
+    catch( const std::runtime_error& )
+    {
+        threw = true;
+    }
+    VECIDX_CHECK( threw );
+
+    std::vector< uint32_t > queries( keys.begin(), keys.begin() + 3000 );
+    std::vector< executor_type::const_iterator > out( queries.size() );
+    exec.find_batch( queries.begin(), queries.end(), out.begin() );
+    for( size_t i = 0; i < queries.size(); ++i )
+    {
+        VECIDX_CHECK( keys.end() != out[ i ] && queries[ i ] == *out[ i ] );
+    }
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng( 7 );
+    std::vector< uint32_t > keys( 50000 );
+    for( auto& k : keys )
+    {
+        k = rng() % 100000;
+    }
+    std::sort( keys.begin(), keys.end() );
+
+    for( bool replicate : { true, false } )
+    {
+        executor_type::options opt;
+        opt.threads = 4;
+        opt.replicate = replicate;
+        opt.grain = 500;
+        executor_type exec( keys, opt );
+        VECIDX_CHECK( 4 == exec.threads() );
+        concurrent_batches( keys, exec );
+        chunk_exception( keys, exec );
+    }
+    return vecidx::test::result( "ExecutorTest" );
+}
@@ -0,0 +1,198 @@
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "../vecidx/hash_index.h"
+#include "../vecidx/tree_index.h"
+#include "../vecidx/stree_index.h"
+#include "check.h"
+
+namespace {
+
+// Keys the table takes for one: equal, or both NaN.
+template< typename VecType_T >
+bool same_key( VecType_T lhs, VecType_T rhs )
+{
+    return vecidx::detail::hash_equal( lhs, rhs, std::is_floating_point< VecType_T >() );
+}
+
+// find() with a table is the first position of the key in ref, and
+// find_batch() is find() of every key.
+template< typename Hash_T, typename VecType_T >
+void check_table( const Hash_T& hash, const std::vector< VecType_T >& vec, const std::vector< VecType_T >& probes )
+{
+    VECIDX_CHECK( hash.accelerated() );
+    for( const VecType_T& key : probes )
+    {
+        auto expect = std::find_if( vec.begin(), vec.end(), [&]( const VecType_T& val ){ return same_key( val, key ); } );
+        VECIDX_CHECK( expect == hash.find( key ) );
+    }
+
+    std::vector< typename Hash_T::const_iterator > found( probes.size() );
+    VECIDX_CHECK( found.end() == hash.find_batch( probes.begin(), probes.end(), found.begin() ) );
+    for( size_t i = 0; i < probes.size(); ++i )
+    {
+        VECIDX_CHECK( hash.find( probes[ i ] ) == found[ i ] );
+    }
+}
+
+// Duplicates in vector order, find() returns the first.
+void duplicates( std::mt19937_64& rng )
+{
+    std::vector< uint32_t > vec( 3000 );
+    for( auto& key : vec )
+    {
+        key = static_cast< uint32_t >( rng() % 500 );
+    }
+    std::vector< uint32_t > probes;
+    for( uint32_t key = 0; key < 600; ++key )
+    {
+        probes.push_back( key );
+    }
+
+    vecidx::hash_accelerated< vecidx::tree_index< uint32_t, uint32_t > > hash( vec );
+    hash.build_index();
+    check_table( hash, vec, probes );
+    for( uint32_t key : probes )
+    {
+        auto r = hash.equal_range( key );
+        VECIDX_CHECK( static_cast< ptrdiff_t >( std::count( vec.begin(), vec.end(), key ) ) == r.second - r.first );
+    }
+}
+
+// 0.0 and -0.0 are one key and every NaN is one key, as in key_less.
+template< typename Float_T >
+void floats( std::mt19937_64& rng )
+{
+    const Float_T nan = std::numeric_limits< Float_T >::quiet_NaN();
+    const Float_T inf = std::numeric_limits< Float_T >::infinity();
+    std::vector< Float_T > vec;
+    for( int i = 0; i < 1000; ++i )
+    {
+        vec.push_back( static_cast< Float_T >( rng() % 200 ) - 100 );
+    }
+    vec.insert( vec.begin() + 100, Float_T( -0.0 ) );
+    vec.insert( vec.begin() + 200, -nan );
+    vec.push_back( nan );
+    vec.push_back( inf );
+
+    const Float_T probe_keys[] = { Float_T( 0.0 ), Float_T( -0.0 ), nan, -nan, inf, -inf, Float_T( 0.5 ), Float_T( -100 ),
+                                   Float_T( 99 ), Float_T( 100 ) };
+    std::vector< Float_T > probes( std::begin( probe_keys ), std::end( probe_keys ) );
+
+    vecidx::hash_accelerated< vecidx::stree_index< uint32_t, Float_T > > hash( vec );
+    hash.build_index();
+    check_table( hash, vec, probes );
+    VECIDX_CHECK( hash.find( Float_T( 0.0 ) ) == hash.find( Float_T( -0.0 ) ) );
+
+    // A table of zeros and NaNs only: the slot of the first one holds -0.0.
+    std::vector< Float_T > signs = { Float_T( -0.0 ), nan, Float_T( 0.0 ), -nan };
+    vecidx::hash_accelerated< vecidx::stree_index< uint32_t, Float_T > > small( signs );
+    small.build_index();
+    check_table( small, signs, probes );
+    VECIDX_CHECK( signs.begin() == small.find( Float_T( 0.0 ) ) );
+    VECIDX_CHECK( signs.begin() + 1 == small.find( -nan ) );
+}
+
+// Misses whose first group is full, so the probe goes on to the next ones.
+// Group of a key and the table size as build_index() computes them.
+void full_groups( std::mt19937_64& rng )
+{
+    const size_t group_size = 16;
+    const size_t groups = 256;
+    // The most keys the table takes at this size, a load of 7/8.
+    std::set< uint64_t > keys;
+    while( keys.size() < groups * group_size * 7 / 8 )
+    {
+        keys.insert( rng() );
+    }
+    std::vector< uint64_t > vec( keys.begin(), keys.end() );
+    std::shuffle( vec.begin(), vec.end(), rng );
+
+    auto group_of = [&]( uint64_t key ){ return ( vecidx::detail::hash_key( key ) >> 7 ) & ( groups - 1 ); };
+    std::vector< size_t > home( groups, 0 );
+    for( uint64_t key : vec )
+    {
+        ++home[ group_of( key ) ];
+    }
+    size_t full = std::max_element( home.begin(), home.end() ) - home.begin();
+    VECIDX_CHECK( home[ full ] >= group_size );
+
+    // Every key, the last ones in were displaced from their full groups.
+    std::vector< uint64_t > probes( vec );
+    while( probes.size() < vec.size() + 50 )
+    {
+        uint64_t key = rng();
+        if( full == group_of( key ) && 0 == keys.count( key ) )
+        {
+            probes.push_back( key );
+        }
+    }
+
+    vecidx::hash_accelerated< vecidx::tree_index< uint32_t, uint64_t > > hash( vec );
+    hash.build_index();
+    // The table has the groups group_of() assumes.
+    struct slot
+    {
+        uint64_t key;
+        uint32_t pos;
+    };
+    VECIDX_CHECK( groups * group_size * ( 1 + sizeof( slot ) ) == hash.table_bytes() );
+    check_table( hash, vec, probes );
+}
+
+// Past max_table_bytes there is no table and find() and find_batch() are
+// the index's.
+void no_table( std::mt19937_64& rng )
+{
+    std::vector< uint32_t > vec( 3000 );
+    for( auto& key : vec )
+    {
+        key = static_cast< uint32_t >( rng() % 500 );
+    }
+    std::vector< uint32_t > probes;
+    for( uint32_t key = 0; key < 600; key += 3 )
+    {
+        probes.push_back( key );
+    }
+
+    const size_t limits[] = { 0, 1000 };
+    for( size_t limit : limits )
+    {
+        vecidx::hash_accelerated< vecidx::tree_index< uint32_t, uint32_t > > hash( vec, limit );
+        hash.build_index();
+        VECIDX_CHECK( !hash.accelerated() );
+        VECIDX_CHECK( 0 == hash.table_bytes() );
+
+        std::vector< std::vector< uint32_t >::const_iterator > found( probes.size() );
+        hash.find_batch( probes.begin(), probes.end(), found.begin() );
+        for( size_t i = 0; i < probes.size(); ++i )
+        {
+            VECIDX_CHECK( hash.index().find( probes[ i ] ) == hash.find( probes[ i ] ) );
+            VECIDX_CHECK( hash.index().find( probes[ i ] ) == found[ i ] );
+        }
+    }
+
+    // Nothing to find, with a table or not.
+    std::vector< uint32_t > none;
+    vecidx::hash_accelerated< vecidx::tree_index< uint32_t, uint32_t > > empty( none );
+    empty.build_index();
+    VECIDX_CHECK( empty.accelerated() );
+    VECIDX_CHECK( none.end() == empty.find( 7 ) );
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937_64 rng( 11 );
+    duplicates( rng );
+    floats< float >( rng );
+    floats< double >( rng );
+    full_groups( rng );
+    no_table( rng );
+    return vecidx::test::result( "HashIndexTest" );
+}
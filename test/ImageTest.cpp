@@ -0,0 +1,112 @@
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "../vecidx/vector_index.h"
+#include "../vecidx/search_index.h"
+#include "../vecidx/tree_index.h"
+#include "../vecidx/stree_index.h"
+#include "../vecidx/smart_step.h"
+#include "../vecidx/learned_index.h"
+#include "check.h"
+
+namespace {
+
+const char* const image_path = "ImageTest.img";
+const char* const corrupt_path = "ImageTest.corrupt.img";
+
+template< typename Func_T >
+bool rejects( Func_T load )
+{
+    try
+    {
+        load();
+    }
+    catch( const vecidx::image_error& )
+    {
+        return true;
+    }
+    return false;
+}
+
+// The last byte of the image flipped, in the last section.
+void corrupt_copy()
+{
+    std::ifstream in( image_path, std::ios::binary );
+    std::vector< char > bytes( ( std::istreambuf_iterator< char >( in ) ), std::istreambuf_iterator< char >() );
+    if( !bytes.empty() )
+    {
+        bytes.back() ^= 0x5a;
+    }
+    std::ofstream out( corrupt_path, std::ios::binary );
+    out.write( bytes.data(), bytes.size() );
+}
+
+// save() of a built index, load() into a fresh one that must find what the
+// built one finds, and the loads that must fail.
+template< typename Index_T >
+void round_trip( const std::vector< uint32_t >& vec )
+{
+    Index_T built( vec );
+    built.build_index();
+    built.save( image_path );
+
+    Index_T loaded( vec );
+    loaded.load( image_path );
+    for( uint32_t key = 0; key <= vec.back() + 2; ++key )
+    {
+        VECIDX_CHECK( built.find( key ) == loaded.find( key ) );
+    }
+
+    // One key changed, same size: only the fingerprint tells.
+    std::vector< uint32_t > other( vec );
+    other[ other.size() / 2 ] += 1;
+    Index_T stale( other );
+    VECIDX_CHECK( rejects( [&]{ stale.load( image_path ); } ) );
+
+    std::vector< uint32_t > shorter( vec.begin(), vec.end() - 1 );
+    Index_T truncated( shorter );
+    VECIDX_CHECK( rejects( [&]{ truncated.load( image_path ); } ) );
+
+    corrupt_copy();
+    Index_T corrupt( vec );
+    VECIDX_CHECK( rejects( [&]{ corrupt.load( corrupt_path ); } ) );
+}
+
+} // namespace
+
+int main()
+{
+    // Sorted, with duplicates: every index here takes that.
+    std::vector< uint32_t > vec( 5000 );
+    for( size_t i = 0; i < vec.size(); ++i )
+    {
+        vec[ i ] = static_cast< uint32_t >( i * 3 / 2 );
+    }
+
+    round_trip< vecidx::vector_index< uint32_t, uint32_t > >( vec );
+    round_trip< vecidx::vector_index< uint32_t, uint32_t, std::less< uint32_t >, vecidx::packed > >( vec );
+    round_trip< vecidx::search_index< uint32_t, uint32_t > >( vec );
+    round_trip< vecidx::search_index< uint32_t, uint32_t, std::less< uint32_t >, vecidx::position_only > >( vec );
+    round_trip< vecidx::tree_index< uint32_t, uint32_t > >( vec );
+    round_trip< vecidx::tree_index< uint32_t, uint32_t, std::less< uint32_t >, vecidx::key_inline > >( vec );
+    round_trip< vecidx::stree_index< uint32_t, uint32_t > >( vec );
+    round_trip< vecidx::smart_step< uint32_t, uint32_t > >( vec );
+    round_trip< vecidx::smart_step2< uint32_t, uint32_t > >( vec );
+    round_trip< vecidx::smart_stepN< 0, uint32_t > >( vec );
+    round_trip< vecidx::learned_index< uint32_t, uint32_t > >( vec );
+
+    // An image of one index type is no image of another.
+    vecidx::search_index< uint32_t, uint32_t > search( vec );
+    search.build_index();
+    search.save( image_path );
+    vecidx::tree_index< uint32_t, uint32_t > tree( vec );
+    VECIDX_CHECK( rejects( [&]{ tree.load( image_path ); } ) );
+
+    std::remove( image_path );
+    std::remove( corrupt_path );
+    return vecidx::test::result( "ImageTest" );
+}
@@ -0,0 +1,171 @@
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "../vecidx/smart_step.h"
+#include "check.h"
+
+namespace {
+
+using vecidx::key_less;
+
+// Keys where a kernel that compares signed, or treats NaN and -0.0 like
+// other numbers, would put them in the wrong bucket.
+void edge_keys( std::vector< uint32_t >& keys )
+{
+    const uint32_t half = uint32_t( 1 ) << 31;
+    keys = { 0, 1, 2, 1000, half - 2, half - 1, half, half + 1, half + 2, 0xfffffffe, 0xffffffff };
+}
+
+void edge_keys( std::vector< uint64_t >& keys )
+{
+    const uint64_t half = uint64_t( 1 ) << 63;
+    keys = { 0, 1, 2, 0x7fffffff, 0x80000000, 0xffffffff, half - 2, half - 1, half, half + 1, half + 2,
+             ~uint64_t( 1 ), ~uint64_t( 0 ) };
+}
+
+void edge_keys( std::vector< int8_t >& keys )
+{
+    keys = { -128, -127, -100, -2, -1, 0, 1, 2, 100, 126, 127 };
+}
+
+void edge_keys( std::vector< int64_t >& keys )
+{
+    const int64_t min = std::numeric_limits< int64_t >::min();
+    const int64_t max = std::numeric_limits< int64_t >::max();
+    keys = { min, min + 1, -0x80000001LL, -0x80000000LL, -2, -1, 0, 1, 2, 0x7fffffff, 0x80000000LL, max - 1, max };
+}
+
+template< typename Float_T >
+void float_edge_keys( std::vector< Float_T >& keys )
+{
+    const Float_T inf = std::numeric_limits< Float_T >::infinity();
+    const Float_T nan = std::numeric_limits< Float_T >::quiet_NaN();
+    const Float_T max = std::numeric_limits< Float_T >::max();
+    const Float_T tiny = std::numeric_limits< Float_T >::denorm_min();
+    keys = { -inf, -max, Float_T( -1.5 ), -tiny, Float_T( -0.0 ), Float_T( 0.0 ), tiny, Float_T( 1.5 ), max, inf, nan, -nan };
+}
+
+void edge_keys( std::vector< float >& keys )
+{
+    float_edge_keys( keys );
+}
+
+void edge_keys( std::vector< double >& keys )
+{
+    float_edge_keys( keys );
+}
+
+template< typename VecType_T >
+VecType_T random_key( std::mt19937_64& rng, std::true_type )
+{
+    return static_cast< VecType_T >( rng() );
+}
+
+template< typename VecType_T >
+VecType_T random_key( std::mt19937_64& rng, std::false_type )
+{
+    return static_cast< VecType_T >( std::uniform_real_distribution< double >( -1e6, 1e6 )( rng ) );
+}
+
+template< typename VecType_T >
+bool equivalent( const VecType_T& lhs, const VecType_T& rhs )
+{
+    key_less< VecType_T > less;
+    return !less( lhs, rhs ) && !less( rhs, lhs );
+}
+
+// find() and equal_range() of the index against std::equal_range by
+// key_less, for every probe.
+template< typename Index_T, typename VecType_T >
+void check_lookups( const Index_T& index, const std::vector< VecType_T >& vec, const std::vector< VecType_T >& probes )
+{
+    key_less< VecType_T > less;
+    for( const VecType_T& key : probes )
+    {
+        auto expect = std::equal_range( vec.begin(), vec.end(), key, less );
+        auto found = index.find( key );
+        if( expect.first == expect.second )
+        {
+            VECIDX_CHECK( vec.end() == found );
+        }
+        else
+        {
+            VECIDX_CHECK( vec.end() != found && equivalent( key, *found ) );
+        }
+        auto range = index.equal_range( key );
+        VECIDX_CHECK( expect.first == range.first && expect.second == range.second );
+    }
+}
+
+// Sorted vectors of the edge keys and random ones, with duplicates, at each
+// instruction set level the CPU has.
+template< typename VecType_T >
+void check_type( std::mt19937_64& rng )
+{
+    std::vector< VecType_T > edges;
+    edge_keys( edges );
+    std::vector< VecType_T > pool( edges );
+    for( int i = 0; i < 200; ++i )
+    {
+        pool.push_back( random_key< VecType_T >( rng, std::is_integral< VecType_T >() ) );
+    }
+
+    // Every key of the pool, hit or miss, and the edges always.
+    std::vector< VecType_T > probes( pool );
+    for( int i = 0; i < 200; ++i )
+    {
+        probes.push_back( random_key< VecType_T >( rng, std::is_integral< VecType_T >() ) );
+    }
+
+    const size_t sizes[] = { 1, 2, 3, 16, 17, 100, 1000, 5000 };
+    for( size_t size : sizes )
+    {
+        std::vector< VecType_T > vec( edges );
+        while( vec.size() < size )
+        {
+            vec.push_back( pool[ rng() % pool.size() ] );
+        }
+        if( vec.size() > size )
+        {
+            // Small sizes keep a random few of the edges.
+            std::shuffle( vec.begin(), vec.end(), rng );
+            vec.resize( size );
+        }
+        std::sort( vec.begin(), vec.end(), key_less< VecType_T >() );
+
+        for( int l = 0; l <= static_cast< int >( vecidx::isa::detect() ); ++l )
+        {
+            vecidx::isa::level lvl = static_cast< vecidx::isa::level >( l );
+
+            vecidx::smart_step< void, VecType_T > step( vec, lvl );
+            step.build_index();
+            VECIDX_CHECK( lvl == step.simd_level() );
+            check_lookups( step, vec, probes );
+
+            vecidx::smart_step2< void, VecType_T > step2( vec, lvl );
+            step2.build_index();
+            check_lookups( step2, vec, probes );
+
+            vecidx::any_smart_step< std::vector< VecType_T > > ladder( vec, lvl );
+            ladder.build_index();
+            check_lookups( ladder, vec, probes );
+        }
+    }
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937_64 rng( 3 );
+    check_type< uint32_t >( rng );
+    check_type< uint64_t >( rng );
+    check_type< int8_t >( rng );
+    check_type< int64_t >( rng );
+    check_type< float >( rng );
+    check_type< double >( rng );
+    return vecidx::test::result( "KernelTest" );
+}
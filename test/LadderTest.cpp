@@ -0,0 +1,90 @@
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "../vecidx/smart_step.h"
+#include "check.h"
+
+namespace {
+
+// find() and equal_range() of the ladder over cont against expect, the
+// std::equal_range of each probe.
+template< typename Cont_T >
+void check_ladder( const Cont_T& cont, size_t leaf_width, vecidx::isa::level lvl,
+                   const std::vector< typename Cont_T::value_type >& probes,
+                   const std::vector< std::pair< typename Cont_T::const_iterator, typename Cont_T::const_iterator > >& expect )
+{
+    vecidx::any_smart_step< Cont_T > ladder( cont, lvl, leaf_width );
+    ladder.build_index();
+    VECIDX_CHECK( leaf_width == ladder.leaf_width() );
+    VECIDX_CHECK( cont.empty() == ( 0 == ladder.rungs() ) );
+
+    for( size_t i = 0; i < probes.size(); ++i )
+    {
+        auto found = ladder.find( probes[ i ] );
+        VECIDX_CHECK( ( expect[ i ].first == expect[ i ].second ? cont.end() : expect[ i ].first ) == found );
+        auto r = ladder.equal_range( probes[ i ] );
+        VECIDX_CHECK( expect[ i ].first == r.first && expect[ i ].second == r.second );
+    }
+}
+
+template< typename Cont_T >
+void check_sizes( std::mt19937& rng )
+{
+    using value_type = typename Cont_T::value_type;
+    // Rungs end on a partial node unless the leaf count is a multiple of the
+    // kernel width, 4 to 16 keys; 0 is the empty container.
+    const size_t sizes[] = { 0, 1, 2, 3, 4, 5, 7, 9, 15, 16, 17, 24, 63, 65, 129, 257, 1000, 4097 };
+    const size_t widths[] = { 1, 3, vecidx::any_smart_step< Cont_T >::default_leaf_width };
+    for( size_t size : sizes )
+    {
+        // Odd keys with duplicates, so key + 1 misses.
+        std::vector< value_type > keys( size );
+        for( auto& key : keys )
+        {
+            key = static_cast< value_type >( 2 * ( rng() % ( size / 2 + 1 ) ) + 1 );
+        }
+        std::sort( keys.begin(), keys.end() );
+        Cont_T cont( keys.begin(), keys.end() );
+
+        // Every key, the ones between them and past both ends. Without
+        // random access std::equal_range walks, so once per container.
+        std::vector< value_type > probes;
+        for( const value_type& key : keys )
+        {
+            probes.push_back( key );
+            probes.push_back( key + 1 );
+        }
+        probes.push_back( 0 );
+        probes.push_back( 2 * size + 100 );
+        std::vector< std::pair< typename Cont_T::const_iterator, typename Cont_T::const_iterator > > expect;
+        for( const value_type& key : probes )
+        {
+            expect.push_back( std::equal_range( cont.cbegin(), cont.cend(), key ) );
+        }
+
+        for( size_t width : widths )
+        {
+            for( int l = 0; l <= static_cast< int >( vecidx::isa::detect() ); ++l )
+            {
+                check_ladder( cont, width, static_cast< vecidx::isa::level >( l ), probes, expect );
+            }
+        }
+    }
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng( 13 );
+    check_sizes< std::list< uint32_t > >( rng );
+    check_sizes< std::list< int64_t > >( rng );
+    check_sizes< std::deque< uint32_t > >( rng );
+    check_sizes< std::deque< double > >( rng );
+    return vecidx::test::result( "LadderTest" );
+}
@@ -0,0 +1,168 @@
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "../vecidx/bitpack.h"
+#include "../vecidx/vector_index.h"
+#include "../vecidx/tree_index.h"
+#include "check.h"
+
+// The packed storage unpacks with the kernels of isa::detect(), so ctest
+// runs this once per level with VECIDX_ISA capping it; the unpack kernels
+// themselves are checked at every level in each run.
+namespace {
+
+// A block of values at every width from 0 to 64, unpacked at each level.
+void unpack_widths( std::mt19937_64& rng )
+{
+    const size_t count = 128;
+    for( unsigned width = 0; width <= 64; ++width )
+    {
+        std::vector< uint64_t > values( count );
+        std::vector< uint64_t > words( vecidx::detail::packed_words( count, width ) + 1, 0 );
+        for( size_t i = 0; i < count; ++i )
+        {
+            values[ i ] = rng() & vecidx::detail::low_mask( width );
+            vecidx::detail::pack_bits( words.data(), i, width, values[ i ] );
+        }
+        // The extremes too.
+        if( width > 0 )
+        {
+            values[ count - 1 ] = vecidx::detail::low_mask( width );
+            vecidx::detail::pack_bits( words.data(), count - 1, width, values[ count - 1 ] );
+        }
+
+        for( int l = 0; l <= static_cast< int >( vecidx::isa::detect() ); ++l )
+        {
+            std::vector< uint64_t > out( count, 0x5a5a5a5a );
+            vecidx::isa::dispatch( static_cast< vecidx::isa::level >( l ), [&]( auto tag )
+            {
+                vecidx::detail::bit_unpacker< decltype( tag ) >::unpack( words.data(), width, count, out.data() );
+            });
+            VECIDX_CHECK( values == out );
+        }
+    }
+}
+
+// find(), equal_range() and the sorted walk of an index over vec against
+// std::equal_range over vec sorted.
+template< typename Index_T, typename VecType_T >
+void check_index( const std::vector< VecType_T >& vec, const std::vector< VecType_T >& probes )
+{
+    Index_T index( vec );
+    index.build_index();
+
+    std::vector< VecType_T > sorted( vec );
+    std::sort( sorted.begin(), sorted.end() );
+    VECIDX_CHECK( std::equal( sorted.begin(), sorted.end(), index.sorted_begin(), index.sorted_end() ) );
+
+    for( const VecType_T& key : probes )
+    {
+        auto expect = std::equal_range( sorted.begin(), sorted.end(), key );
+        auto found = index.find( key );
+        if( expect.first == expect.second )
+        {
+            VECIDX_CHECK( vec.end() == found );
+        }
+        else
+        {
+            VECIDX_CHECK( vec.end() != found && key == *found );
+        }
+        auto r = index.equal_range( key );
+        VECIDX_CHECK( expect.first - sorted.begin() == r.first - index.sorted_begin() &&
+                      expect.second - sorted.begin() == r.second - index.sorted_begin() );
+    }
+}
+
+template< typename VecType_T >
+void check_keys( const std::vector< VecType_T >& vec, std::mt19937_64& rng )
+{
+    // The neighbours wrap around in the unsigned type, signed overflow
+    // being undefined.
+    using bits_type = typename std::make_unsigned< VecType_T >::type;
+    std::vector< VecType_T > probes( vec );
+    for( const VecType_T& key : vec )
+    {
+        probes.push_back( static_cast< VecType_T >( static_cast< bits_type >( key ) + 1 ) );
+        probes.push_back( static_cast< VecType_T >( static_cast< bits_type >( key ) - 1 ) );
+    }
+    probes.push_back( std::numeric_limits< VecType_T >::min() );
+    probes.push_back( std::numeric_limits< VecType_T >::max() );
+    for( int i = 0; i < 100; ++i )
+    {
+        probes.push_back( static_cast< VecType_T >( rng() ) );
+    }
+
+    using std::less;
+    using vecidx::packed;
+    check_index< vecidx::vector_index< uint32_t, VecType_T, less< VecType_T >, packed > >( vec, probes );
+    check_index< vecidx::tree_index< uint32_t, VecType_T, less< VecType_T >, packed > >( vec, probes );
+}
+
+// Key sets of the given size, in vector order: the positions are packed
+// too, so most are not sorted.
+void check_size( size_t size, std::mt19937_64& rng )
+{
+    // One key, every block at width 0.
+    std::vector< uint32_t > same( size, 42 );
+    check_keys( same, rng );
+
+    // Long runs, so whole blocks in the middle are one key.
+    std::vector< uint32_t > runs( size );
+    for( size_t i = 0; i < size; ++i )
+    {
+        runs[ i ] = static_cast< uint32_t >( i / 150 * 7 );
+    }
+    check_keys( runs, rng );
+
+    // Few distinct keys, shuffled.
+    std::vector< uint32_t > dups( size );
+    for( auto& key : dups )
+    {
+        key = static_cast< uint32_t >( rng() % ( size / 4 + 1 ) );
+    }
+    check_keys( dups, rng );
+
+    // The whole 64-bit range in a block, width 64.
+    std::vector< uint64_t > spread( size );
+    for( auto& key : spread )
+    {
+        key = rng();
+    }
+    spread[ 0 ] = ~uint64_t( 0 );
+    spread[ size / 2 ] = 0;
+    check_keys( spread, rng );
+
+    // Signed, negatives and the limits, so the distances wrap.
+    std::vector< int64_t > sign( size );
+    for( auto& key : sign )
+    {
+        key = static_cast< int64_t >( rng() );
+    }
+    sign[ size - 1 ] = std::numeric_limits< int64_t >::min();
+    sign[ size / 3 ] = std::numeric_limits< int64_t >::max();
+    sign[ size / 2 ] = -1;
+    check_keys( sign, rng );
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937_64 rng( 5 );
+    unpack_widths( rng );
+
+    // Around the block size, 128.
+    const size_t sizes[] = { 1, 2, 127, 128, 129, 255, 256, 257, 1000 };
+    for( size_t size : sizes )
+    {
+        check_size( size, rng );
+    }
+
+    std::string name = std::string( "PackedTest " ) + vecidx::isa::name( vecidx::isa::detect() );
+    return vecidx::test::result( name.c_str() );
+}
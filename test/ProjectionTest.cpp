@@ -0,0 +1,89 @@
+#include <cstdint>
+#include <algorithm>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "../vecidx/projection.h"
+#include "check.h"
+
+namespace {
+
+struct trade
+{
+    uint64_t time;
+    uint32_t id;
+    double price;
+};
+
+using by_time = vecidx::member< trade, uint64_t, &trade::time >;
+using by_time_id = vecidx::members< vecidx::member< trade, uint64_t, &trade::time >,
+                                    vecidx::member< trade, uint32_t, &trade::id > >;
+
+// A record or a key, as the projection sees it.
+template< typename Proj_T >
+auto value( const Proj_T& proj, const trade& t ) -> decltype( proj( t ) )
+{
+    return proj( t );
+}
+
+template< typename Proj_T, typename Key_T >
+const Key_T& value( const Proj_T&, const Key_T& key )
+{
+    return key;
+}
+
+// equal_range() and count() of the index against std::equal_range over the
+// records by the same projection.
+template< typename Proj_T, typename Key_T >
+void check_key( const std::vector< trade >& trades, const vecidx::projected_index< trade, Proj_T >& index, const Key_T& key )
+{
+    Proj_T proj;
+    auto expect = std::equal_range( trades.begin(), trades.end(), key,
+                                    [&]( const auto& lhs, const auto& rhs ){ return value( proj, lhs ) < value( proj, rhs ); } );
+    auto r = index.equal_range( key );
+    VECIDX_CHECK( expect.first == r.first && expect.second == r.second );
+    VECIDX_CHECK( static_cast< size_t >( expect.second - expect.first ) == index.count( key ) );
+    VECIDX_CHECK( ( expect.first == expect.second ? trades.end() : expect.first ) == index.find( key ) );
+}
+
+void trades_of_size( size_t size, std::mt19937& rng )
+{
+    // Few times, so leading keys repeat, and repeated ids within a time.
+    std::vector< trade > trades( size );
+    for( auto& t : trades )
+    {
+        t.time = 1000 + rng() % ( size / 8 + 1 );
+        t.id = rng() % 4;
+        t.price = rng() % 100;
+    }
+    std::sort( trades.begin(), trades.end(),
+               []( const trade& lhs, const trade& rhs ){ return std::tie( lhs.time, lhs.id ) < std::tie( rhs.time, rhs.id ); } );
+
+    vecidx::projected_index< trade, by_time > time_index( trades );
+    time_index.build_index();
+    vecidx::projected_index< trade, by_time_id > time_id_index( trades );
+    time_id_index.build_index();
+    VECIDX_CHECK( trades.size() == time_index.column().size() );
+
+    for( uint64_t time = 998; time < 1000 + size / 8 + 3; ++time )
+    {
+        check_key( trades, time_index, time );
+        for( uint32_t id = 0; id < 6; ++id )
+        {
+            check_key( trades, time_id_index, std::make_tuple( time, id ) );
+        }
+    }
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng( 11 );
+    for( size_t size : { 0, 1, 2, 7, 64, 3000 } )
+    {
+        trades_of_size( size, rng );
+    }
+    return vecidx::test::result( "ProjectionTest" );
+}
@@ -0,0 +1,258 @@
+#include <cstdint>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "../vecidx/smart_step.h"
+#include "../vecidx/stree_index.h"
+#include "../vecidx/search_index.h"
+#include "../vecidx/tree_index.h"
+#include "../vecidx/learned_index.h"
+#include "check.h"
+
+// The lookups and ranges of every index over a sorted vector against
+// std::lower_bound and std::upper_bound on the vector itself.
+namespace {
+
+// The reference answers for each probe, computed once per vector.
+template< typename VecType_T >
+struct reference
+{
+    const std::vector< VecType_T >& vec;
+    std::vector< VecType_T > probes;
+    std::vector< size_t > lower;    // std::lower_bound
+    std::vector< size_t > upper;    // std::upper_bound
+
+    reference( const std::vector< VecType_T >& v, std::vector< VecType_T > p ) : vec( v ), probes( std::move( p ) )
+    {
+        for( const VecType_T& key : probes )
+        {
+            lower.push_back( std::lower_bound( vec.begin(), vec.end(), key ) - vec.begin() );
+            upper.push_back( std::upper_bound( vec.begin(), vec.end(), key ) - vec.begin() );
+        }
+    }
+};
+
+// Indexes with a lower_bound() of their own.
+template< typename Index_T, typename VecType_T >
+auto check_lower_bound( const Index_T& index, const reference< VecType_T >& ref, size_t i, int )
+    -> decltype( index.lower_bound( ref.probes[ i ] ), void() )
+{
+    auto it = index.lower_bound( ref.probes[ i ] );
+    if( ref.vec.size() == ref.lower[ i ] )
+    {
+        VECIDX_CHECK( ref.vec.end() == it );
+    }
+    else
+    {
+        VECIDX_CHECK( ref.vec.end() != it && ref.vec[ ref.lower[ i ] ] == *it );
+    }
+}
+
+template< typename Index_T, typename VecType_T >
+void check_lower_bound( const Index_T&, const reference< VecType_T >&, size_t, long )
+{
+}
+
+// A batch result against lower_bound() of the key, where the index has it.
+template< typename Index_T, typename VecType_T, typename Iter_T >
+auto check_batch_lower_bound( const Index_T& index, const VecType_T& key, Iter_T it, int )
+    -> decltype( index.lower_bound( key ), void() )
+{
+    VECIDX_CHECK( index.lower_bound( key ) == it );
+}
+
+template< typename Index_T, typename VecType_T, typename Iter_T >
+void check_batch_lower_bound( const Index_T&, const VecType_T&, Iter_T, long )
+{
+}
+
+// Indexes that sort positions may return any of equal keys, so results are
+// compared by key.
+template< typename Index_T, typename VecType_T >
+void check_lookups( const Index_T& index, const reference< VecType_T >& ref )
+{
+    for( size_t i = 0; i < ref.probes.size(); ++i )
+    {
+        auto found = index.find( ref.probes[ i ] );
+        if( ref.lower[ i ] == ref.upper[ i ] )
+        {
+            VECIDX_CHECK( ref.vec.end() == found );
+        }
+        else
+        {
+            VECIDX_CHECK( ref.vec.end() != found && ref.probes[ i ] == *found );
+        }
+        check_lower_bound( index, ref, i, 0 );
+    }
+}
+
+// lower_bound_batch() against lower_bound() where the index has both, by
+// key against the reference where it has only the batch.
+template< typename Index_T, typename VecType_T >
+auto check_lower_bound_batch( const Index_T& index, const reference< VecType_T >& ref,
+                              const std::vector< size_t >& batch, const std::vector< VecType_T >& keys, int )
+    -> decltype( index.lower_bound_batch( keys.begin(), keys.end(), std::vector< typename Index_T::const_iterator >().begin() ),
+                 void() )
+{
+    std::vector< typename Index_T::const_iterator > out( keys.size() );
+    VECIDX_CHECK( out.end() == index.lower_bound_batch( keys.begin(), keys.end(), out.begin() ) );
+    for( size_t k = 0; k < keys.size(); ++k )
+    {
+        size_t i = batch[ k ];
+        if( ref.vec.size() == ref.lower[ i ] )
+        {
+            VECIDX_CHECK( ref.vec.end() == out[ k ] );
+        }
+        else
+        {
+            VECIDX_CHECK( ref.vec.end() != out[ k ] && ref.vec[ ref.lower[ i ] ] == *out[ k ] );
+        }
+        check_batch_lower_bound( index, keys[ k ], out[ k ], 0 );
+    }
+}
+
+template< typename Index_T, typename VecType_T >
+void check_lower_bound_batch( const Index_T&, const reference< VecType_T >&,
+                              const std::vector< size_t >&, const std::vector< VecType_T >&, long )
+{
+}
+
+// Batches of lengths that are no multiple of batch_group_size, from every
+// part of the probes: each result is the one of the single lookup.
+template< typename Index_T, typename VecType_T >
+void check_batches( const Index_T& index, const reference< VecType_T >& ref )
+{
+    const size_t lengths[] = { 0, 1, 15, 17, 1000 };
+    size_t start = 0;
+    for( size_t length : lengths )
+    {
+        std::vector< size_t > batch( length );
+        std::vector< VecType_T > keys( length );
+        for( size_t k = 0; k < length; ++k )
+        {
+            batch[ k ] = ( start + k * 5 ) % ref.probes.size();
+            keys[ k ] = ref.probes[ batch[ k ] ];
+        }
+        start += 3;
+
+        std::vector< typename Index_T::const_iterator > out( length );
+        VECIDX_CHECK( out.end() == index.find_batch( keys.begin(), keys.end(), out.begin() ) );
+        for( size_t k = 0; k < length; ++k )
+        {
+            VECIDX_CHECK( index.find( keys[ k ] ) == out[ k ] );
+        }
+        check_lower_bound_batch( index, ref, batch, keys, 0 );
+    }
+}
+
+// The sorted walk, equal_range() and count( lo, hi ) against the same
+// bounds, with hi below lo too.
+template< typename Index_T, typename VecType_T >
+void check_ranges( const Index_T& index, const reference< VecType_T >& ref )
+{
+    VECIDX_CHECK( std::equal( ref.vec.begin(), ref.vec.end(), index.sorted_begin(), index.sorted_end() ) );
+    for( size_t i = 0; i < ref.probes.size(); ++i )
+    {
+        auto r = index.equal_range( ref.probes[ i ] );
+        VECIDX_CHECK( static_cast< ptrdiff_t >( ref.lower[ i ] ) == r.first - index.sorted_begin() &&
+                      static_cast< ptrdiff_t >( ref.upper[ i ] ) == r.second - index.sorted_begin() );
+
+        size_t j = ( i * 7 + 3 ) % ref.probes.size();
+        const VecType_T& lo = ref.probes[ i ];
+        const VecType_T& hi = ref.probes[ j ];
+        size_t expect = hi < lo ? 0 : ref.lower[ j ] - ref.lower[ i ];
+        VECIDX_CHECK( expect == index.count( lo, hi ) );
+        VECIDX_CHECK( 0 == index.count( lo, lo ) );
+    }
+}
+
+template< typename Index_T, typename VecType_T, typename... Args_T >
+void check( const reference< VecType_T >& ref, Args_T... args )
+{
+    Index_T index( ref.vec, args... );
+    index.build_index();
+    check_lookups( index, ref );
+    check_ranges( index, ref );
+    check_batches( index, ref );
+}
+
+template< typename VecType_T >
+void check_all( const reference< VecType_T >& ref )
+{
+    using namespace vecidx;
+    for( int l = 0; l <= static_cast< int >( isa::detect() ); ++l )
+    {
+        isa::level lvl = static_cast< isa::level >( l );
+        // The one and two level splitters take a key from the vector.
+        if( !ref.vec.empty() )
+        {
+            check< smart_step< void, VecType_T > >( ref, lvl );
+            check< smart_step2< void, VecType_T > >( ref, lvl );
+        }
+        check< smart_stepN< 0, VecType_T > >( ref, lvl );
+        check< smart_stepN< 1, VecType_T > >( ref, lvl );
+        check< smart_stepN< 2, VecType_T > >( ref, lvl );
+        check< smart_stepN< 3, VecType_T > >( ref, lvl );
+        check< stree_index< uint32_t, VecType_T > >( ref, lvl );
+        // Small windows, so keys land on their edges and past them.
+        check< learned_index< void, VecType_T > >( ref, 1, lvl );
+        check< learned_index< void, VecType_T > >( ref, 4, lvl );
+        check< learned_index< void, VecType_T > >( ref, 32, lvl );
+    }
+    check< search_index< uint32_t, VecType_T > >( ref );
+    check< search_index< uint32_t, VecType_T, std::less< VecType_T >, position_only > >( ref );
+    check< tree_index< uint32_t, VecType_T > >( ref );
+    check< tree_index< uint32_t, VecType_T, std::less< VecType_T >, key_inline > >( ref );
+}
+
+// Even keys from base with runs of duplicates and gaps, probed at every key,
+// between them and past both ends.
+template< typename VecType_T >
+void check_size( size_t size, VecType_T base, std::mt19937& rng )
+{
+    std::vector< VecType_T > vec;
+    VecType_T key = base;
+    while( vec.size() < size )
+    {
+        vec.push_back( key );
+        // A third repeat, a few skip a key.
+        switch( rng() % 6 )
+        {
+        case 0: case 1: break;
+        case 2: key += 4; break;
+        default: key += 2; break;
+        }
+    }
+
+    std::vector< VecType_T > probes;
+    probes.push_back( base - 5 );
+    probes.push_back( base - 1 );
+    for( VecType_T k = base; k <= key + 3; ++k )
+    {
+        probes.push_back( k );
+    }
+    probes.push_back( key + 1000 );
+    check_all( reference< VecType_T >( vec, probes ) );
+
+    // All one key.
+    std::vector< VecType_T > same( size, base );
+    std::vector< VecType_T > around = { VecType_T( base - 1 ), base, VecType_T( base + 1 ) };
+    check_all( reference< VecType_T >( same, around ) );
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng( 17 );
+    // Around the 16 key nodes of stree_index and the 32 key leaves of
+    // smart_stepN at uint32, and their fanouts of 17 and 5 to 17.
+    const size_t sizes[] = { 0, 1, 2, 15, 16, 17, 31, 32, 33, 64, 65, 271, 272, 273, 1000, 4095, 4096, 4097, 4624, 4625 };
+    for( size_t size : sizes )
+    {
+        check_size< uint32_t >( size, 10, rng );
+        check_size< int64_t >( size, -static_cast< int64_t >( size ), rng );
+    }
+    return vecidx::test::result( "ReferenceTest" );
+}
@@ -12,7 +12,9 @@
 #include "../vecidx/vector_index.h"
 #include "../vecidx/search_index.h"
 #include "../vecidx/tree_index.h"
+#include "../vecidx/stree_index.h"
 #include "../vecidx/smart_step.h"
+#include "../vecidx/learned_index.h"
 
 template< class Cont_T >
 struct container_only
@@ -78,6 +80,40 @@ size_t bench( const std::string& name, size_t size, size_t loop )
     return timer.elapsed().wall;
 }
 
+template< template < typename... > class Index_T, typename Index_Size_T >
+size_t bench_batch( const std::string& name, size_t size, size_t loop )
+{
+    boost::timer::cpu_timer timer;
+    std::vector<uint32_t> org( size );
+
+    std::iota( org.begin(), org.end(), 0 );
+    Index_T< Index_Size_T, uint32_t > index( org );
+
+    timer.start();
+    index.build_index();
+    timer.stop();
+    std::cout << name << "_index build...: " << timer.format();
+
+    std::vector< std::vector<uint32_t>::const_iterator > ret( size );
+    timer.start();
+    for( size_t j = 0; j < loop; ++j )
+    {
+        index.find_batch( org.begin(), org.end(), ret.begin() );
+        for( size_t i = 0; i < size; ++i )
+        {
+            if( ret[ i ] == org.end() || *ret[ i ] != org[ i ] )
+            {
+                std::cout << "end- " << std::hex << org[ i ] << std::endl;
+                break;
+            }
+        }
+    }
+    timer.stop();
+    std::cout << name << "_index find batch: " << timer.format();
+
+    return timer.elapsed().wall;
+}
+
 template< class Cont_T, template < typename... > class Index_T >
 size_t bench_any( const std::string& name, size_t size, size_t loop )
 {
@@ -206,15 +242,19 @@ int main(int /*argc*/, char* /*argv*/[])
 //        bench<vecidx::smart_step2, uint32_t>( "vecidx::smart_step2, uint32", 0x03ffffff, 1 );
 //    }
 
+    // One pass as a smoke test, bench/ has the real measurements.
     std::cout << "\nsize: 0x00ff'ffff\n\n";
-    while( 1 )
     {
         size_t base = bench_any< std::vector< uint32_t >, container_only >( "vector_only, uint32", 0x00ffffff, 10 );
 //        bench<vecidx::vector_index, uint32_t>( "vecidx::vector_index, uint32", 0x00ffffff, 10 );
 //        bench<vecidx::search_index, uint32_t>( "vecidx::search_index, uint32", 0x00ffffff, 10 );
 //        bench<vecidx::tree_index, uint32_t>( "vecidx::tree_index, uint32", 0x00ffffff, 10 );
+        bench<vecidx::stree_index, uint32_t>( "vecidx::stree_index, uint32", 0x00ffffff, 10 );
         size_t smart2 = bench<vecidx::smart_step2, uint32_t>( "vecidx::smart_step2,  uint32", 0x00ffffff, 10 );
         size_t smart1 = bench<vecidx::smart_step, uint32_t>( "vecidx::smart_step,  uint32", 0x00ffffff, 10 );
+        size_t smartN = bench<vecidx::smart_step_auto, uint32_t>( "vecidx::smart_stepN,  uint32", 0x00ffffff, 10 );
+        size_t smartB = bench_batch<vecidx::smart_step_auto, uint32_t>( "vecidx::smart_stepN,  uint32", 0x00ffffff, 10 );
+        size_t learned = bench<vecidx::learned_index, uint32_t>( "vecidx::learned_index, uint32", 0x00ffffff, 10 );
         size_t smart3 = bench_any< std::vector< uint32_t >,
                                    vecidx::any_smart_step >( "vecidx::any_smart_step, uint32", 0x00ffffff, 10 );
 
@@ -226,6 +266,12 @@ int main(int /*argc*/, char* /*argv*/[])
                   << 100.0f * (((float) smart1)/((float) base) - 1.0f) << "%"
                   << std::endl << "Smart2 Step Diff: " << std::fixed << std::setprecision(2)
                   << 100.0f * (((float) smart2)/((float) base) - 1.0f) << "%"
+                  << std::endl << "SmartN Step Diff: " << std::fixed << std::setprecision(2)
+                  << 100.0f * (((float) smartN)/((float) base) - 1.0f) << "%"
+                  << std::endl << "SmartN Batch Diff: " << std::fixed << std::setprecision(2)
+                  << 100.0f * (((float) smartB)/((float) base) - 1.0f) << "%"
+                  << std::endl << "Learned Diff: " << std::fixed << std::setprecision(2)
+                  << 100.0f * (((float) learned)/((float) base) - 1.0f) << "%"
                   << std::endl << "Smart3 Step Diff: " << std::fixed << std::setprecision(2)
                   << 100.0f * (((float) smart3)/((float) base) - 1.0f) << "%"
                   << std::endl << "Smart2/Smart1 Diff: " << std::fixed << std::setprecision(2)
@@ -0,0 +1,155 @@
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../vecidx/snapshot.h"
+#include "../vecidx/tree_index.h"
+#include "check.h"
+
+namespace {
+
+using index_type = vecidx::snapshot_index< vecidx::tree_index< uint32_t, uint32_t > >;
+
+const uint32_t key_count = 2000;
+
+// Version n holds 0..key_count-1 and the marker key_count + n, so a reader
+// can tell a whole version from a torn one.
+std::vector< uint32_t > version_keys( uint64_t n )
+{
+    std::vector< uint32_t > keys( key_count + 1 );
+    for( uint32_t k = 0; k < key_count; ++k )
+    {
+        keys[ k ] = k;
+    }
+    keys[ key_count ] = static_cast< uint32_t >( key_count + n );
+    return keys;
+}
+
+void check_version( const index_type::snapshot& snap )
+{
+    VECIDX_CHECK( key_count + 1 == snap.data().size() );
+    uint32_t marker = static_cast< uint32_t >( key_count + snap.version() );
+    auto it = snap.find( marker );
+    VECIDX_CHECK( snap.end() != it && marker == *it );
+    for( uint32_t k = 0; k < key_count; k += 97 )
+    {
+        it = snap.find( k );
+        VECIDX_CHECK( snap.end() != it && k == *it );
+    }
+    // The markers of the other versions are not there.
+    VECIDX_CHECK( snap.end() == snap.find( marker + 1 ) );
+}
+
+// Readers pin and search while a writer rebuilds.
+void concurrent_rebuilds()
+{
+    index_type index( version_keys( 0 ) );
+    std::atomic< bool > stop{ false };
+    std::atomic< uint64_t > lookups{ 0 };
+
+    std::vector< std::thread > readers;
+    for( int t = 0; t < 3; ++t )
+    {
+        readers.emplace_back( [&]
+        {
+            index_type::reader reader( index );
+            uint64_t last = 0;
+            while( !stop.load() )
+            {
+                auto snap = reader.pin();
+                check_version( snap );
+                // Versions only go forward.
+                VECIDX_CHECK( snap.version() >= last );
+                last = snap.version();
+                {
+                    // Nested pins see a version at least as new.
+                    auto inner = reader.pin();
+                    VECIDX_CHECK( inner.version() >= snap.version() );
+                }
+                VECIDX_CHECK( reader.contains( 7 ) );
+                lookups.fetch_add( 1 );
+            }
+        });
+    }
+
+    const uint64_t rebuilds = 200;
+    for( uint64_t n = 1; n <= rebuilds; ++n )
+    {
+        VECIDX_CHECK( n == index.rebuild( version_keys( n ) ) );
+    }
+    // Some lookups on the last version too.
+    uint64_t seen = lookups.load();
+    while( lookups.load() < seen + 100 )
+    {
+        std::this_thread::yield();
+    }
+    stop.store( true );
+    for( auto& r : readers )
+    {
+        r.join();
+    }
+
+    VECIDX_CHECK( rebuilds == index.version() );
+    index.collect();
+    VECIDX_CHECK( 0 == index.retired() );
+}
+
+// A pinned version outlives its replacement until it is unpinned.
+void pinned_version()
+{
+    index_type index( version_keys( 0 ) );
+    index_type::reader reader( index );
+    {
+        auto snap = reader.pin();
+        index.rebuild( version_keys( 1 ) );
+        index.collect();
+        VECIDX_CHECK( 1 == index.retired() );
+        VECIDX_CHECK( 0 == snap.version() );
+        check_version( snap );
+        // A new pin while the old one lives still announces the old epoch.
+        auto inner = reader.pin();
+        VECIDX_CHECK( 1 == inner.version() );
+        check_version( inner );
+    }
+    index.collect();
+    VECIDX_CHECK( 0 == index.retired() );
+    VECIDX_CHECK( 1 == reader.pin().version() );
+}
+
+// claim() hands out max_readers slots and throws past them.
+void reader_limit()
+{
+    index_type index( version_keys( 0 ), 2 );
+    VECIDX_CHECK( 2 == index.max_readers() );
+    std::unique_ptr< index_type::reader > first( new index_type::reader( index ) );
+    index_type::reader second( index );
+
+    bool threw = false;
+    try
+    {
+        index_type::reader third( index );
+    }
+    catch( const std::runtime_error& )
+    {
+        threw = true;
+    }
+    VECIDX_CHECK( threw );
+
+    // A released slot is claimed again.
+    first.reset();
+    index_type::reader again( index );
+    VECIDX_CHECK( again.contains( 0 ) );
+}
+
+} // namespace
+
+int main()
+{
+    concurrent_rebuilds();
+    pinned_version();
+    reader_limit();
+    return vecidx::test::result( "SnapshotTest" );
+}
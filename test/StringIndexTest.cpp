@@ -0,0 +1,96 @@
+#include <cstdint>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+#include "../vecidx/string_index.h"
+#include "check.h"
+
+namespace {
+
+// equal_range() and count() against std::equal_range, whose std::string
+// order is the byte order string_index needs.
+template< typename String_T >
+void check_keys( const std::vector< std::string >& strings, const std::vector< std::string >& probes )
+{
+    std::vector< String_T > ref( strings.begin(), strings.end() );
+    vecidx::string_index< String_T > index( ref );
+    index.build_index();
+    for( const std::string& probe : probes )
+    {
+        String_T key( probe );
+        auto expect = std::equal_range( ref.begin(), ref.end(), key );
+        auto r = index.equal_range( key );
+        VECIDX_CHECK( expect.first == r.first && expect.second == r.second );
+        VECIDX_CHECK( static_cast< size_t >( expect.second - expect.first ) == index.count( key ) );
+        VECIDX_CHECK( ( expect.first == expect.second ? ref.end() : expect.first ) == index.find( key ) );
+    }
+    // A default string_view has no data() at all.
+    auto empty = std::equal_range( ref.cbegin(), ref.cend(), String_T() );
+    VECIDX_CHECK( empty == index.equal_range( String_T() ) );
+}
+
+void check_both( std::vector< std::string > strings, const std::vector< std::string >& probes )
+{
+    std::sort( strings.begin(), strings.end() );
+    check_keys< std::string >( strings, probes );
+#if __cplusplus >= 201703L
+    check_keys< std::string_view >( strings, probes );
+#endif
+}
+
+// Bytes that zero padding and signed chars get wrong.
+std::string random_tail( std::mt19937& rng, size_t max_size )
+{
+    static const char bytes[] = { '\0', '\x01', 'a', 'b', '\x7f', '\x80', '\xff' };
+    std::string ret( rng() % ( max_size + 1 ), '\0' );
+    for( char& c : ret )
+    {
+        c = bytes[ rng() % sizeof( bytes ) ];
+    }
+    return ret;
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng( 5 );
+    const std::string shared = "https://";
+
+    // Keys off the shared bytes: shorter, diverging inside them, before and
+    // after every string, and the empty string.
+    std::vector< std::string > edges = {
+        "", "h", "https:/", "https:/\xff", "http://x", "https;", "https://", "a", "\xff",
+        shared + std::string( 1, '\0' ), shared + std::string( 8, '\0' ), shared + std::string( 12, '\0' ),
+        shared + std::string( 8, '\xff' ), shared + std::string( 9, '\xff' ), shared + "a", shared + "a" + std::string( 1, '\0' ),
+    };
+
+    for( size_t size : { 0, 1, 2, 5, 100, 2000 } )
+    {
+        std::vector< std::string > strings;
+        for( size_t i = 0; i < size; ++i )
+        {
+            strings.push_back( shared + random_tail( rng, 12 ) );
+        }
+        std::vector< std::string > probes( edges );
+        probes.insert( probes.end(), strings.begin(), strings.end() );
+        for( int i = 0; i < 200; ++i )
+        {
+            probes.push_back( shared + random_tail( rng, 12 ) );
+        }
+        check_both( strings, probes );
+    }
+
+    // A single string, every byte of it shared.
+    check_both( { shared + "a" }, { "", shared, shared + "a", shared + "a" + std::string( 1, '\0' ), shared + "b" } );
+    // Strings that are prefixes of each other, and equal ones.
+    check_both( { "ab", "ab", "ab" + std::string( 1, '\0' ), "abc", "abc", "ab" + std::string( 10, '\0' ) },
+                { "", "a", "ab", "abc", "ab" + std::string( 1, '\0' ), "ab" + std::string( 10, '\0' ), "ab" + std::string( 11, '\0' ) } );
+    return vecidx::test::result( "StringIndexTest" );
+}
@@ -0,0 +1,129 @@
+#include <cstdint>
+#include <vector>
+#include <set>
+#include <random>
+#include <iterator>
+#include <algorithm>
+
+#include "../vecidx/vector_index.h"
+#include "check.h"
+
+// vector_index insert() and erase() against a std::multiset of the live
+// keys, with lookups in between and merges along the way.
+template< typename Storage_T >
+void random_updates( unsigned seed )
+{
+    using index_type = vecidx::vector_index< uint32_t, uint32_t, std::less< uint32_t >, Storage_T >;
+    const uint32_t range = 2000;
+    const size_t threshold = 64;
+
+    std::mt19937 rng( seed );
+    std::vector< uint32_t > vec( 500 );
+    for( auto& key : vec )
+    {
+        key = rng() % range;
+    }
+
+    index_type index( vec );
+    index.build_index();
+    index.set_merge_threshold( threshold );
+
+    std::multiset< uint32_t > keys( vec.begin(), vec.end() );
+    std::vector< bool > live( vec.size(), true );
+    size_t merges = 0;
+
+    for( int op = 0; op < 20000; ++op )
+    {
+        size_t pending = index.pending();
+        switch( rng() % 4 )
+        {
+        case 0:
+        {
+            vec.push_back( rng() % range );
+            live.push_back( true );
+            keys.insert( vec.back() );
+            index.insert( vec.size() - 1 );
+            break;
+        }
+        case 1:
+        {
+            size_t pos = rng() % vec.size();
+            bool erased = index.erase( pos );
+            VECIDX_CHECK( erased == live[ pos ] );
+            if( erased )
+            {
+                keys.erase( keys.find( vec[ pos ] ) );
+                live[ pos ] = false;
+                // Twice is once too many, merged in between or not.
+                VECIDX_CHECK( !index.erase( pos ) );
+            }
+            break;
+        }
+        default:
+        {
+            uint32_t key = rng() % ( range + 10 );
+            auto found = index.find( key );
+            if( keys.count( key ) )
+            {
+                VECIDX_CHECK( vec.cend() != found && key == *found && live[ found - vec.cbegin() ] );
+            }
+            else
+            {
+                VECIDX_CHECK( vec.cend() == found );
+            }
+
+            auto lower = index.lower_bound( key );
+            auto expect = keys.lower_bound( key );
+            if( keys.end() == expect )
+            {
+                VECIDX_CHECK( vec.cend() == lower );
+            }
+            else
+            {
+                VECIDX_CHECK( vec.cend() != lower && *expect == *lower && live[ lower - vec.cbegin() ] );
+            }
+
+            uint32_t hi = key + rng() % 100;
+            VECIDX_CHECK( index.count( key, hi ) ==
+                          static_cast< size_t >( std::distance( keys.lower_bound( key ), keys.lower_bound( hi ) ) ) );
+            VECIDX_CHECK( 0 == index.count( hi + 1, key ) );
+
+            // The batches resolve pending changes like the single lookups.
+            uint32_t batch[ 40 ];
+            for( auto& k : batch )
+            {
+                k = rng() % ( range + 10 );
+            }
+            std::vector< typename index_type::const_iterator > finds( 40 ), lowers( 40 );
+            index.find_batch( std::begin( batch ), std::end( batch ), finds.begin() );
+            index.lower_bound_batch( std::begin( batch ), std::end( batch ), lowers.begin() );
+            for( size_t i = 0; i < 40; ++i )
+            {
+                VECIDX_CHECK( ( vec.cend() == finds[ i ] ) == ( 0 == keys.count( batch[ i ] ) ) );
+                VECIDX_CHECK( vec.cend() == finds[ i ] || ( batch[ i ] == *finds[ i ] && live[ finds[ i ] - vec.cbegin() ] ) );
+                VECIDX_CHECK( ( vec.cend() == lowers[ i ] ) == ( keys.end() == keys.lower_bound( batch[ i ] ) ) );
+                VECIDX_CHECK( vec.cend() == lowers[ i ] || *keys.lower_bound( batch[ i ] ) == *lowers[ i ] );
+            }
+            break;
+        }
+        }
+        VECIDX_CHECK( index.pending() <= threshold );
+        merges += index.pending() + 1 < pending;
+    }
+    VECIDX_CHECK( merges > 10 );
+
+    // Merged, the sorted order is the multiset's.
+    index.merge();
+    VECIDX_CHECK( 0 == index.pending() );
+    VECIDX_CHECK( std::equal( keys.begin(), keys.end(), index.sorted_begin(), index.sorted_end() ) );
+}
+
+int main()
+{
+    for( unsigned seed = 1; seed <= 3; ++seed )
+    {
+        random_updates< vecidx::position_only >( seed );
+        random_updates< vecidx::key_inline >( seed );
+    }
+    return vecidx::test::result( "VectorIndexTest" );
+}
@@ -0,0 +1,44 @@
+#ifndef VECIDX_TEST_CHECK_H
+#define VECIDX_TEST_CHECK_H
+
+#include <atomic>
+#include <iostream>
+
+// Checks for the ctest targets: a failed VECIDX_CHECK reports itself and the
+// test goes on, main() returns vecidx::test::result(). Safe from several
+// threads.
+namespace vecidx {
+namespace test {
+
+inline std::atomic< int >& failures()
+{
+    static std::atomic< int > count{ 0 };
+    return count;
+}
+
+inline void check( bool ok, const char* what, const char* file, int line )
+{
+    // The first few are enough to go on.
+    if( !ok && failures().fetch_add( 1 ) < 20 )
+    {
+        std::cerr << file << ":" << line << ": check failed: " << what << std::endl;
+    }
+}
+
+inline int result( const char* name )
+{
+    if( 0 != failures() )
+    {
+        std::cerr << name << ": " << failures() << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << name << ": ok" << std::endl;
+    return 0;
+}
+
+} // namespace test
+} // namespace vecidx
+
+#define VECIDX_CHECK( cond ) ::vecidx::test::check( ( cond ), #cond, __FILE__, __LINE__ )
+
+#endif // VECIDX_TEST_CHECK_H
@@ -0,0 +1,370 @@
+#ifndef VECIDX_ALLOCATOR_H
+#define VECIDX_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+#if defined( _MSC_VER )
+#include <malloc.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined( __linux__ )
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace vecidx {
+
+static const size_t cache_line_size = 64;
+
+// std::allocator that returns Align_V aligned storage, so SIMD nodes never
+// straddle a cache line.
+template< typename T, size_t Align_V = cache_line_size >
+class aligned_allocator
+{
+public:
+    using value_type = T;
+
+    template< typename U > struct rebind { using other = aligned_allocator< U, Align_V >; };
+
+    aligned_allocator() = default;
+    template< typename U >
+    aligned_allocator( const aligned_allocator< U, Align_V >& ) {}
+
+    T* allocate( size_t count )
+    {
+        size_t bytes = ( ( count * sizeof( T ) + Align_V - 1 ) / Align_V ) * Align_V;
+        if( 0 == bytes )
+        {
+            bytes = Align_V;
+        }
+#if defined( _MSC_VER )
+        void* ptr = _aligned_malloc( bytes, Align_V );
+#else
+        void* ptr = nullptr;
+        if( 0 != posix_memalign( &ptr, Align_V, bytes ) )
+        {
+            ptr = nullptr;
+        }
+#endif
+        if( nullptr == ptr )
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast< T* >( ptr );
+    }
+
+    void deallocate( T* ptr, size_t )
+    {
+#if defined( _MSC_VER )
+        _aligned_free( ptr );
+#else
+        free( ptr );
+#endif
+    }
+
+    template< typename U >
+    bool operator==( const aligned_allocator< U, Align_V >& ) const { return true; }
+    template< typename U >
+    bool operator!=( const aligned_allocator< U, Align_V >& ) const { return false; }
+};
+
+namespace detail {
+
+template< typename Alloc_T, typename T >
+using rebind_alloc = typename std::allocator_traits< Alloc_T >::template rebind_alloc< T >;
+
+} // namespace detail
+
+// Contiguous memory for the layouts of one or more indexes, in huge pages:
+// a probe into a large index then costs a TLB miss per 2 MB instead of per
+// 4 KB. Memory comes in chunks mapped with MAP_HUGETLB when the system has
+// a huge page pool, else in 2 MB aligned mappings marked for transparent
+// huge pages (madvise). Small blocks are carved cache line aligned out of
+// shared chunks, so the small arrays of an index end up next to each
+// other; blocks of half a chunk or more get a mapping of their own, which
+// is unmapped when they are freed.
+//
+// With a node, every chunk is bound to that NUMA node before it is first
+// touched (mbind, or VirtualAllocExNuma on Windows).
+class arena
+{
+public:
+    static const size_t chunk_size = size_t( 2 ) << 20;
+
+    explicit arena( int node = -1 ) : node_( node ) {}
+
+    arena( const arena& ) = delete;
+    arena& operator=( const arena& ) = delete;
+
+    ~arena()
+    {
+        for( const chunk& c : chunks_ )
+        {
+            unmap( c );
+        }
+    }
+
+    void* allocate( size_t bytes )
+    {
+        bytes = round_up( std::max< size_t >( bytes, 1 ), cache_line_size );
+        std::lock_guard< std::mutex > lock( mutex_ );
+        used_ += bytes;
+        if( bytes >= chunk_size / 2 )
+        {
+            chunks_.push_back( map( round_up( bytes, chunk_size ), true ) );
+            chunks_.back().top = bytes;
+            chunks_.back().live = 1;
+            return chunks_.back().data;
+        }
+        for( chunk& c : chunks_ )
+        {
+            if( !c.own && c.top + bytes <= c.bytes )
+            {
+                return carve( c, bytes );
+            }
+        }
+        chunks_.push_back( map( chunk_size, false ) );
+        return carve( chunks_.back(), bytes );
+    }
+
+    // A freed block is reused once it is the last of its chunk, or once
+    // its chunk is empty.
+    void deallocate( void* ptr, size_t bytes )
+    {
+        bytes = round_up( std::max< size_t >( bytes, 1 ), cache_line_size );
+        char* at = static_cast< char* >( ptr );
+        std::lock_guard< std::mutex > lock( mutex_ );
+        used_ -= bytes;
+        for( auto it = chunks_.begin(); chunks_.end() != it; ++it )
+        {
+            if( at < it->data || at >= it->data + it->bytes )
+            {
+                continue;
+            }
+            if( it->own )
+            {
+                unmap( *it );
+                chunks_.erase( it );
+            }
+            else if( 0 == --it->live )
+            {
+                it->top = 0;
+            }
+            else if( at + bytes == it->data + it->top )
+            {
+                it->top -= bytes;
+            }
+            return;
+        }
+    }
+
+    int node() const
+    {
+        return node_;
+    }
+
+    // Bytes mapped, and those of them in the explicit huge page pool.
+    size_t reserved() const
+    {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        size_t ret = 0;
+        for( const chunk& c : chunks_ )
+        {
+            ret += c.bytes;
+        }
+        return ret;
+    }
+
+    size_t reserved_huge() const
+    {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        size_t ret = 0;
+        for( const chunk& c : chunks_ )
+        {
+            ret += c.huge ? c.bytes : 0;
+        }
+        return ret;
+    }
+
+    // Bytes allocated and not freed.
+    size_t used() const
+    {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return used_;
+    }
+
+private:
+    struct chunk
+    {
+        char* data;
+        size_t bytes;
+        size_t top;   // bytes handed out from the start
+        size_t live;  // blocks not freed
+        bool own;     // one block with a mapping of its own
+        bool huge;    // explicit huge pages
+    };
+
+    int node_;
+    size_t used_ = 0;
+    std::vector< chunk > chunks_;
+    mutable std::mutex mutex_;
+
+    static size_t round_up( size_t bytes, size_t align )
+    {
+        return ( bytes + align - 1 ) / align * align;
+    }
+
+    static void* carve( chunk& c, size_t bytes )
+    {
+        void* ret = c.data + c.top;
+        c.top += bytes;
+        ++c.live;
+        return ret;
+    }
+
+    chunk map( size_t bytes, bool own ) const
+    {
+        chunk ret = { nullptr, bytes, 0, 0, own, false };
+#if defined( _MSC_VER )
+        DWORD node = node_ < 0 ? NUMA_NO_PREFERRED_NODE : static_cast< DWORD >( node_ );
+        SIZE_T large = GetLargePageMinimum();
+        if( 0 != large && 0 == bytes % large )
+        {
+            ret.data = static_cast< char* >( VirtualAllocExNuma( GetCurrentProcess(), nullptr, bytes,
+                                                                 MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                                                 PAGE_READWRITE, node ) );
+            ret.huge = nullptr != ret.data;
+        }
+        if( nullptr == ret.data )
+        {
+            ret.data = static_cast< char* >( VirtualAllocExNuma( GetCurrentProcess(), nullptr, bytes,
+                                                                 MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node ) );
+        }
+        if( nullptr == ret.data )
+        {
+            throw std::bad_alloc();
+        }
+#else
+        void* ptr = MAP_FAILED;
+#if defined( MAP_HUGETLB )
+        ptr = mmap( nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+        ret.huge = MAP_FAILED != ptr;
+#endif
+        if( MAP_FAILED == ptr )
+        {
+            // Transparent huge pages need a 2 MB aligned range: map a
+            // chunk more and trim both ends.
+            size_t span = bytes + chunk_size;
+            ptr = mmap( nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if( MAP_FAILED == ptr )
+            {
+                throw std::bad_alloc();
+            }
+            char* raw = static_cast< char* >( ptr );
+            char* start = raw + ( chunk_size - reinterpret_cast< uintptr_t >( raw ) % chunk_size ) % chunk_size;
+            if( start != raw )
+            {
+                munmap( raw, start - raw );
+            }
+            if( start + bytes != raw + span )
+            {
+                munmap( start + bytes, raw + span - ( start + bytes ) );
+            }
+            ptr = start;
+#if defined( MADV_HUGEPAGE )
+            madvise( ptr, bytes, MADV_HUGEPAGE );
+#endif
+        }
+        ret.data = static_cast< char* >( ptr );
+        bind( ret );
+#endif
+        return ret;
+    }
+
+#if !defined( _MSC_VER )
+    // Best effort: without the NUMA policy syscall, or on a node that is
+    // not there, the chunk stays wherever the kernel puts it.
+    void bind( const chunk& c ) const
+    {
+#if defined( __linux__ ) && defined( SYS_mbind )
+        const size_t bits = 8 * sizeof( unsigned long );
+        const int mpol_bind = 2;
+        unsigned long mask[ 1024 / bits ] = {};
+        if( node_ >= 0 && static_cast< size_t >( node_ ) < 1024 )
+        {
+            mask[ node_ / bits ] |= 1UL << ( node_ % bits );
+            syscall( SYS_mbind, c.data, c.bytes, mpol_bind, mask, 1024 + 1, 0 );
+        }
+#else
+        (void)c;
+#endif
+    }
+#endif
+
+    static void unmap( const chunk& c )
+    {
+#if defined( _MSC_VER )
+        VirtualFree( c.data, 0, MEM_RELEASE );
+#else
+        munmap( c.data, c.bytes );
+#endif
+    }
+};
+
+// Allocator handing out memory of an arena. Copies, rebound ones included,
+// share the arena, so the buffers of an index built with one all land in
+// it; a default constructed one makes a new arena on no particular node.
+template< typename T >
+class arena_allocator
+{
+    static_assert( alignof( T ) <= cache_line_size, "arena blocks are cache line aligned" );
+
+public:
+    using value_type = T;
+
+    template< typename U > struct rebind { using other = arena_allocator< U >; };
+
+    arena_allocator() : arena_( std::make_shared< vecidx::arena >() ) {}
+    explicit arena_allocator( std::shared_ptr< vecidx::arena > a ) : arena_( std::move( a ) ) {}
+    template< typename U >
+    arena_allocator( const arena_allocator< U >& other ) : arena_( other.get_arena() ) {}
+
+    T* allocate( size_t count )
+    {
+        return static_cast< T* >( arena_->allocate( count * sizeof( T ) ) );
+    }
+
+    void deallocate( T* ptr, size_t count )
+    {
+        arena_->deallocate( ptr, count * sizeof( T ) );
+    }
+
+    const std::shared_ptr< vecidx::arena >& get_arena() const
+    {
+        return arena_;
+    }
+
+    template< typename U >
+    bool operator==( const arena_allocator< U >& other ) const { return arena_ == other.get_arena(); }
+    template< typename U >
+    bool operator!=( const arena_allocator< U >& other ) const { return arena_ != other.get_arena(); }
+
+private:
+    std::shared_ptr< vecidx::arena > arena_;
+};
+
+} // namespace vecidx
+
+#endif // VECIDX_ALLOCATOR_H
@@ -0,0 +1,89 @@
+#ifndef VECIDX_BATCH_H
+#define VECIDX_BATCH_H
+
+#include <cstddef>
+#include <xmmintrin.h>
+
+namespace vecidx {
+
+// Keys walked in lock-step by the find_batch() / lower_bound_batch() members.
+// Enough in-flight misses to cover DRAM latency, few enough that the
+// per-key state stays in registers and L1.
+static const size_t batch_group_size = 16;
+
+inline void prefetch( const void* addr )
+{
+    _mm_prefetch( static_cast< const char* >( addr ), _MM_HINT_T0 );
+}
+
+namespace detail {
+
+// Feeds [first, last) to group( keys, count ) batch_group_size keys at a
+// time, so any input iterator works and the group code sees an array.
+template< typename Key_T, typename InputIt, typename Group_T >
+void for_each_group( InputIt first, InputIt last, Group_T group )
+{
+    Key_T keys[ batch_group_size ];
+    while( first != last )
+    {
+        size_t count = 0;
+        for( ; first != last && count < batch_group_size; ++first )
+        {
+            keys[ count++ ] = *first;
+        }
+        group( keys, count );
+    }
+}
+
+// Branch-free lower_bound of count keys in lock-step, one level per round.
+// Key g searches [first[g], first[g] + size[g]) and its answer is left in
+// first[g]. load( g, i ) reads element i of key g's range and touch( g, i )
+// prefetches it. The probe of the next round is prefetched as soon as it is
+// known, so every key has a whole round of the other keys' work to hide its
+// miss.
+template< typename Key_T, typename Load_T, typename Touch_T, typename Less_T >
+void lower_bound_group( const Key_T* keys, size_t count, size_t* first, size_t* size,
+                        Load_T load, Touch_T touch, Less_T less )
+{
+    bool more = false;
+    for( size_t g = 0; g < count; ++g )
+    {
+        if( size[ g ] > 1 )
+        {
+            touch( g, first[ g ] + size[ g ] / 2 );
+            more = true;
+        }
+    }
+
+    while( more )
+    {
+        more = false;
+        for( size_t g = 0; g < count; ++g )
+        {
+            if( size[ g ] > 1 )
+            {
+                size_t half = size[ g ] / 2;
+                first[ g ] = less( load( g, first[ g ] + half ), keys[ g ] ) ? first[ g ] + half : first[ g ];
+                size[ g ] -= half;
+                if( size[ g ] > 1 )
+                {
+                    touch( g, first[ g ] + size[ g ] / 2 );
+                    more = true;
+                }
+            }
+        }
+    }
+
+    for( size_t g = 0; g < count; ++g )
+    {
+        if( 1 == size[ g ] && less( load( g, first[ g ] ), keys[ g ] ) )
+        {
+            ++first[ g ];
+        }
+    }
+}
+
+} // namespace detail
+} // namespace vecidx
+
+#endif // VECIDX_BATCH_H
@@ -0,0 +1,160 @@
+#ifndef VECIDX_BITPACK_H
+#define VECIDX_BITPACK_H
+
+#include <immintrin.h>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+
+#include "isa.h"
+
+namespace vecidx {
+namespace detail {
+
+// Values are packed little endian into 64-bit words: value i of width bits
+// starts at bit i * width and may straddle two words.
+
+// Bits needed to hold every value up to max.
+inline unsigned bit_width( uint64_t max )
+{
+    if( 0 == max )
+    {
+        return 0;
+    }
+#if defined( _MSC_VER )
+    unsigned long bit;
+    _BitScanReverse64( &bit, max );
+    return bit + 1;
+#else
+    return 64 - __builtin_clzll( max );
+#endif
+}
+
+// Words holding count values of width bits.
+inline size_t packed_words( size_t count, unsigned width )
+{
+    return ( count * width + 63 ) / 64;
+}
+
+inline uint64_t low_mask( unsigned width )
+{
+    return width >= 64 ? ~uint64_t( 0 ) : ( uint64_t( 1 ) << width ) - 1;
+}
+
+// Sets value i of words, which start zeroed.
+inline void pack_bits( uint64_t* words, size_t i, unsigned width, uint64_t val )
+{
+    if( 0 == width )
+    {
+        return;
+    }
+    size_t bit = i * width;
+    size_t shift = bit % 64;
+    words[ bit / 64 ] |= val << shift;
+    if( shift + width > 64 )
+    {
+        words[ bit / 64 + 1 ] |= val >> ( 64 - shift );
+    }
+}
+
+inline uint64_t unpack_bits( const uint64_t* words, size_t i, unsigned width )
+{
+    if( 0 == width )
+    {
+        return 0;
+    }
+    size_t bit = i * width;
+    size_t shift = bit % 64;
+    uint64_t val = words[ bit / 64 ] >> shift;
+    if( shift + width > 64 )
+    {
+        val |= words[ bit / 64 + 1 ] << ( 64 - shift );
+    }
+    return val & low_mask( width );
+}
+
+// unpack( words, width, count, out ) writes values [0, count) to out, count
+// a multiple of 8. Every lane gathers the two words its value may span and
+// shifts them together, so it reads one word past the last value.
+template< typename Isa_T > struct bit_unpacker { };
+
+template<> struct bit_unpacker< isa::sse >
+{
+    static void unpack( const uint64_t* words, unsigned width, size_t count, uint64_t* out )
+    {
+        for( size_t i = 0; i < count; ++i )
+        {
+            out[ i ] = unpack_bits( words, i, width );
+        }
+    }
+};
+
+template<> struct bit_unpacker< isa::avx2 >
+{
+    VECIDX_TARGET_AVX2 static void unpack( const uint64_t* words, unsigned width, size_t count, uint64_t* out )
+    {
+        if( 0 == width )
+        {
+            std::memset( out, 0, count * sizeof( uint64_t ) );
+            return;
+        }
+        const long long* base = reinterpret_cast< const long long* >( words );
+        const __m256i mask = _mm256_set1_epi64x( static_cast< long long >( low_mask( width ) ) );
+        const __m256i step = _mm256_set1_epi64x( 4 * width );
+        const __m256i word = _mm256_set1_epi64x( 64 );
+        const __m256i low = _mm256_set1_epi64x( 63 );
+        __m256i bit = _mm256_set_epi64x( 3 * width, 2 * width, width, 0 );
+        for( size_t i = 0; i < count; i += 4 )
+        {
+            __m256i idx = _mm256_srli_epi64( bit, 6 );
+            __m256i shift = _mm256_and_si256( bit, low );
+            __m256i lo = _mm256_i64gather_epi64( base, idx, 8 );
+            __m256i hi = _mm256_i64gather_epi64( base + 1, idx, 8 );
+            __m256i val = _mm256_or_si256( _mm256_srlv_epi64( lo, shift ),
+                                           _mm256_sllv_epi64( hi, _mm256_sub_epi64( word, shift ) ) );
+            _mm256_storeu_si256( reinterpret_cast< __m256i* >( out + i ), _mm256_and_si256( val, mask ) );
+            bit = _mm256_add_epi64( bit, step );
+        }
+    }
+};
+
+template<> struct bit_unpacker< isa::avx512 >
+{
+    VECIDX_TARGET_AVX512 static void unpack( const uint64_t* words, unsigned width, size_t count, uint64_t* out )
+    {
+        if( 0 == width )
+        {
+            std::memset( out, 0, count * sizeof( uint64_t ) );
+            return;
+        }
+        const __m512i mask = _mm512_set1_epi64( static_cast< long long >( low_mask( width ) ) );
+        const __m512i step = _mm512_set1_epi64( 8 * width );
+        const __m512i word = _mm512_set1_epi64( 64 );
+        const __m512i low = _mm512_set1_epi64( 63 );
+        const __m512i zero = _mm512_setzero_si512();
+        const __mmask8 all = 0xff;
+        __m512i bit = _mm512_mullo_epi64( _mm512_set_epi64( 7, 6, 5, 4, 3, 2, 1, 0 ), _mm512_set1_epi64( width ) );
+        // The masked forms, GCC warns about the undefined source the plain
+        // ones pass.
+        for( size_t i = 0; i < count; i += 8 )
+        {
+            __m512i idx = _mm512_maskz_srli_epi64( all, bit, 6 );
+            __m512i shift = _mm512_and_si512( bit, low );
+            __m512i lo = _mm512_mask_i64gather_epi64( zero, all, idx, words, 8 );
+            __m512i hi = _mm512_mask_i64gather_epi64( zero, all, idx, words + 1, 8 );
+            __m512i val = _mm512_or_si512( _mm512_maskz_srlv_epi64( all, lo, shift ),
+                                           _mm512_maskz_sllv_epi64( all, hi, _mm512_sub_epi64( word, shift ) ) );
+            _mm512_storeu_si512( out + i, _mm512_and_si512( val, mask ) );
+            bit = _mm512_add_epi64( bit, step );
+        }
+    }
+};
+
+} // namespace detail
+} // namespace vecidx
+
+#endif // VECIDX_BITPACK_H
@@ -0,0 +1,340 @@
+#ifndef VECIDX_BUILD_H
+#define VECIDX_BUILD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+#if defined( _OPENMP )
+#include <omp.h>
+#endif
+
+#include "allocator.h"
+
+// build_index() runs its sort and layout loops on OpenMP threads when the
+// library is compiled with OpenMP (the CMake build adds the flags when it
+// finds it). Without it VECIDX_OMP expands to nothing and the build is the
+// plain serial code.
+#define VECIDX_STRINGIFY( x ) #x
+#if defined( _OPENMP ) && defined( _MSC_VER )
+#define VECIDX_OMP( ... ) __pragma( omp __VA_ARGS__ )
+#elif defined( _OPENMP )
+#define VECIDX_OMP( ... ) _Pragma( VECIDX_STRINGIFY( omp __VA_ARGS__ ) )
+#else
+#define VECIDX_OMP( ... )
+#endif
+
+// OpenMP 3.0 tasks, for the recursive layouts. MSVC only has 2.0.
+#if defined( _OPENMP ) && _OPENMP >= 200805
+#define VECIDX_OMP_TASKS 1
+#endif
+
+namespace vecidx {
+
+// Smaller builds are not worth waking the thread team.
+static const size_t parallel_build_cutoff = 1 << 16;
+
+namespace detail {
+
+inline int& build_threads_setting()
+{
+    static int threads = 0;
+    return threads;
+}
+
+} // namespace detail
+
+// Threads build_index() may use, 0 for every thread OpenMP would use.
+inline void set_build_threads( int threads )
+{
+    detail::build_threads_setting() = std::max( threads, 0 );
+}
+
+inline int build_threads()
+{
+#if defined( _OPENMP )
+    int threads = detail::build_threads_setting();
+    return 0 == threads ? omp_get_max_threads() : threads;
+#else
+    return 1;
+#endif
+}
+
+// Threads for a build step over size elements.
+inline int build_threads( size_t size )
+{
+    return size < parallel_build_cutoff ? 1 : build_threads();
+}
+
+namespace detail {
+
+// Elements of a among the first diag of std::merge( a, b ): the merge path
+// split that lets every thread merge its own slice of the output.
+template< typename RandomIt, typename Less_T >
+size_t merge_split( size_t diag, RandomIt a, size_t size_a, RandomIt b, size_t size_b, Less_T less )
+{
+    size_t lo = diag > size_b ? diag - size_b : 0;
+    size_t hi = std::min( diag, size_a );
+    while( lo < hi )
+    {
+        size_t i = ( lo + hi ) / 2;
+        if( less( b[ diag - i - 1 ], a[ i ] ) )
+        {
+            hi = i;
+        }
+        else
+        {
+            lo = i + 1;
+        }
+    }
+    return lo;
+}
+
+// std::merge of [a, a + size_a) and [b, b + size_b) into out, split in
+// equal slices of the output over threads.
+template< typename RandomIt, typename OutIt, typename Less_T >
+void parallel_merge( RandomIt a, size_t size_a, RandomIt b, size_t size_b, OutIt out,
+                     Less_T less, int threads )
+{
+    size_t size = size_a + size_b;
+    VECIDX_OMP( parallel for num_threads( threads ) schedule( static, 1 ) )
+    for( ptrdiff_t p = 0; p < threads; ++p )
+    {
+        size_t first = size * p / threads;
+        size_t last = size * ( p + 1 ) / threads;
+        size_t first_a = merge_split( first, a, size_a, b, size_b, less );
+        size_t last_a = merge_split( last, a, size_a, b, size_b, less );
+        std::merge( a + first_a, a + last_a,
+                    b + ( first - first_a ), b + ( last - last_a ),
+                    out + first, less );
+    }
+}
+
+// Comp_T orders keys with their plain <, so integer keys can be radix sorted.
+template< typename Comp_T > struct is_ascending : std::false_type {};
+template< typename VecType_T > struct is_ascending< std::less< VecType_T > > : std::true_type {};
+
+template< typename VecType_T, typename Comp_T >
+struct radix_sortable
+    : std::integral_constant< bool, std::is_integral< VecType_T >::value &&
+                                    !std::is_same< VecType_T, bool >::value &&
+                                    is_ascending< Comp_T >::value > {};
+
+// Unsigned image of an integer key with the same order: signed keys get
+// their sign bit flipped.
+template< typename VecType_T >
+typename std::make_unsigned< VecType_T >::type radix_key( VecType_T key )
+{
+    using key_type = typename std::make_unsigned< VecType_T >::type;
+    const key_type sign = std::is_signed< VecType_T >::value ?
+                              static_cast< key_type >( key_type( 1 ) << ( 8 * sizeof( key_type ) - 1 ) ) : 0;
+    return static_cast< key_type >( static_cast< key_type >( key ) ^ sign );
+}
+
+static const size_t radix_bits = 8;
+static const size_t radix_size = 1 << radix_bits;
+
+// One stable LSD pass of [first, last) on the digit at shift, to
+// out + offset[ digit ]. Entries are staged in a cache line per digit and
+// written a whole line at a time, so the 256 output streams do not thrash
+// the cache and the TLB with a scattered store per entry.
+template< typename Entry_T >
+void radix_scatter( const Entry_T* first, const Entry_T* last, Entry_T* out,
+                    size_t* offset, size_t shift )
+{
+    constexpr size_t line = cache_line_size / sizeof( Entry_T ) > 1 ?
+                                cache_line_size / sizeof( Entry_T ) : 1;
+    alignas( cache_line_size ) Entry_T stage[ radix_size ][ line ];
+    size_t fill[ radix_size ] = {};
+
+    for( ; first != last; ++first )
+    {
+        size_t digit = ( first->key >> shift ) & ( radix_size - 1 );
+        stage[ digit ][ fill[ digit ]++ ] = *first;
+        if( line == fill[ digit ] )
+        {
+            std::copy( stage[ digit ], stage[ digit ] + line, out + offset[ digit ] );
+            offset[ digit ] += line;
+            fill[ digit ] = 0;
+        }
+    }
+    for( size_t digit = 0; digit < radix_size; ++digit )
+    {
+        std::copy( stage[ digit ], stage[ digit ] + fill[ digit ], out + offset[ digit ] );
+        offset[ digit ] += fill[ digit ];
+    }
+}
+
+// Positions of integer keys in ascending order, by an LSD radix sort of
+// (key, position) pairs: linear time and sequential memory traffic. Each
+// pass counts digits per thread slice and scatters the slices in parallel;
+// a digit every key shares (the high bytes of small keys) is skipped.
+template< typename Size_T, typename VecType_T >
+std::vector< Size_T > radix_permutation( const std::vector< VecType_T >& vec )
+{
+    using key_type = typename std::make_unsigned< VecType_T >::type;
+    struct entry
+    {
+        key_type key;
+        Size_T pos;
+    };
+    const size_t passes = sizeof( key_type ) * 8 / radix_bits;
+
+    size_t size = vec.size();
+    int threads = build_threads( size );
+    auto bound = [&]( size_t t ){ return size * t / threads; };
+
+    std::vector< entry > buf( size );
+    std::vector< entry > tmp( size );
+    // Digit counts of every pass, per thread slice of the input.
+    std::vector< size_t > count( threads * passes * radix_size, 0 );
+    VECIDX_OMP( parallel for num_threads( threads ) schedule( static, 1 ) )
+    for( ptrdiff_t t = 0; t < threads; ++t )
+    {
+        size_t* hist = &count[ t * passes * radix_size ];
+        for( size_t i = bound( t ); i < bound( t + 1 ); ++i )
+        {
+            buf[ i ].key = radix_key( vec[ i ] );
+            buf[ i ].pos = static_cast< Size_T >( i );
+            for( size_t p = 0; p < passes; ++p )
+            {
+                ++hist[ p * radix_size + ( ( buf[ i ].key >> ( p * radix_bits ) ) & ( radix_size - 1 ) ) ];
+            }
+        }
+    }
+
+    std::vector< size_t > offset( threads * radix_size );
+    for( size_t p = 0; p < passes; ++p )
+    {
+        size_t shift = p * radix_bits;
+        if( p > 0 && threads > 1 )
+        {
+            // The slices hold other keys after a pass, count them again.
+            VECIDX_OMP( parallel for num_threads( threads ) schedule( static, 1 ) )
+            for( ptrdiff_t t = 0; t < threads; ++t )
+            {
+                size_t* hist = &count[ ( t * passes + p ) * radix_size ];
+                std::fill( hist, hist + radix_size, 0 );
+                for( size_t i = bound( t ); i < bound( t + 1 ); ++i )
+                {
+                    ++hist[ ( buf[ i ].key >> shift ) & ( radix_size - 1 ) ];
+                }
+            }
+        }
+
+        // Digit major, then slice: slice t writes its entries of a digit
+        // after those of the slices before it, which keeps the sort stable.
+        size_t sum = 0;
+        bool skip = false;
+        for( size_t digit = 0; digit < radix_size; ++digit )
+        {
+            size_t total = 0;
+            for( int t = 0; t < threads; ++t )
+            {
+                offset[ t * radix_size + digit ] = sum + total;
+                total += count[ ( t * passes + p ) * radix_size + digit ];
+            }
+            skip |= size == total;
+            sum += total;
+        }
+        if( skip )
+        {
+            continue;
+        }
+
+        VECIDX_OMP( parallel for num_threads( threads ) schedule( static, 1 ) )
+        for( ptrdiff_t t = 0; t < threads; ++t )
+        {
+            radix_scatter( buf.data() + bound( t ), buf.data() + bound( t + 1 ),
+                           tmp.data(), &offset[ t * radix_size ], shift );
+        }
+        buf.swap( tmp );
+    }
+
+    std::vector< Size_T > ret( size );
+    VECIDX_OMP( parallel for num_threads( threads ) )
+    for( ptrdiff_t i = 0; i < static_cast< ptrdiff_t >( size ); ++i )
+    {
+        ret[ i ] = buf[ i ].pos;
+    }
+    return ret;
+}
+
+// Positions of vec in comp order. Sorts (key, position) pairs, so the sort
+// compares keys in its own buffer instead of chasing positions into vec:
+// one slice per thread, then rounds of pairwise parallel merges.
+template< typename Size_T, typename VecType_T, typename Comp_T >
+std::vector< Size_T > sorted_permutation( const std::vector< VecType_T >& vec, Comp_T comp, std::false_type )
+{
+    using entry = std::pair< VecType_T, Size_T >;
+    auto less = [&]( const entry& lhs, const entry& rhs )
+                {
+                    return comp( lhs.first, rhs.first );
+                };
+
+    size_t size = vec.size();
+    int threads = build_threads( size );
+    std::vector< entry > buf( size );
+    VECIDX_OMP( parallel for num_threads( threads ) )
+    for( ptrdiff_t i = 0; i < static_cast< ptrdiff_t >( size ); ++i )
+    {
+        buf[ i ] = entry( vec[ i ], static_cast< Size_T >( i ) );
+    }
+
+    size_t slices = threads;
+    auto bound = [&]( size_t s ){ return size * std::min( s, slices ) / slices; };
+    VECIDX_OMP( parallel for num_threads( threads ) schedule( static, 1 ) )
+    for( ptrdiff_t s = 0; s < static_cast< ptrdiff_t >( slices ); ++s )
+    {
+        std::sort( buf.begin() + bound( s ), buf.begin() + bound( s + 1 ), less );
+    }
+
+    if( slices > 1 )
+    {
+        std::vector< entry > tmp( size );
+        for( size_t width = 1; width < slices; width *= 2 )
+        {
+            for( size_t s = 0; s < slices; s += 2 * width )
+            {
+                size_t first = bound( s );
+                size_t middle = bound( s + width );
+                size_t last = bound( s + 2 * width );
+                parallel_merge( buf.begin() + first, middle - first,
+                                buf.begin() + middle, last - middle,
+                                tmp.begin() + first, less, threads );
+            }
+            buf.swap( tmp );
+        }
+    }
+
+    std::vector< Size_T > ret( size );
+    VECIDX_OMP( parallel for num_threads( threads ) )
+    for( ptrdiff_t i = 0; i < static_cast< ptrdiff_t >( size ); ++i )
+    {
+        ret[ i ] = buf[ i ].second;
+    }
+    return ret;
+}
+
+template< typename Size_T, typename VecType_T, typename Comp_T >
+std::vector< Size_T > sorted_permutation( const std::vector< VecType_T >& vec, Comp_T, std::true_type )
+{
+    return radix_permutation< Size_T >( vec );
+}
+
+// Positions of vec in comp order: radix sorted for integer keys in plain
+// ascending order, merge sorted otherwise.
+template< typename Size_T, typename VecType_T, typename Comp_T >
+std::vector< Size_T > sorted_permutation( const std::vector< VecType_T >& vec, Comp_T comp )
+{
+    return sorted_permutation< Size_T >( vec, comp, radix_sortable< VecType_T, Comp_T >() );
+}
+
+} // namespace detail
+} // namespace vecidx
+
+#endif // VECIDX_BUILD_H
@@ -0,0 +1,330 @@
+#ifndef VECIDX_CORO_H
+#define VECIDX_CORO_H
+
+// Coroutine lookups, C++20 only. Where the compiler has coroutines this
+// defines VECIDX_COROUTINES, and search_index, tree_index and smart_step2
+// get a find_coro( key ): the find() path as a coroutine that suspends
+// after each prefetch of a node it is about to read. A lookup_scheduler
+// keeps a few dozen of them in flight and resumes them in turn, so the
+// misses of one overlap the work of the others (AMAC), for callers whose
+// keys come one by one rather than in the batches of find_batch().
+//
+// Built as C++14 none of it exists and find() is the only path.
+
+#if defined( __has_include )
+#if __has_include( <coroutine> ) && defined( __cpp_impl_coroutine )
+#define VECIDX_COROUTINES 1
+#endif
+#endif
+
+#if defined( VECIDX_COROUTINES )
+
+#include <cstddef>
+#include <coroutine>
+#include <iterator>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "batch.h"
+
+namespace vecidx {
+
+namespace detail {
+
+// Coroutine frames, recycled per thread by size: a lookup lives for a few
+// hundred nanoseconds, about what malloc and free of its frame would cost.
+class frame_pool
+{
+public:
+    static void* allocate( size_t size )
+    {
+        for( bin& b : instance().bins_ )
+        {
+            if( b.size == size && b.free )
+            {
+                void* frame = b.free;
+                b.free = *static_cast< void** >( frame );
+                return frame;
+            }
+        }
+        return ::operator new( size );
+    }
+
+    static void deallocate( void* frame, size_t size )
+    {
+        std::vector< bin >& bins = instance().bins_;
+        for( bin& b : bins )
+        {
+            if( b.size == size )
+            {
+                *static_cast< void** >( frame ) = b.free;
+                b.free = frame;
+                return;
+            }
+        }
+        if( bins.size() < max_bins )
+        {
+            *static_cast< void** >( frame ) = nullptr;
+            bins.push_back( bin{ size, frame } );
+            return;
+        }
+        ::operator delete( frame );
+    }
+
+    frame_pool() = default;
+    frame_pool( const frame_pool& ) = delete;
+    frame_pool& operator=( const frame_pool& ) = delete;
+
+    ~frame_pool()
+    {
+        for( bin& b : bins_ )
+        {
+            while( b.free )
+            {
+                void* frame = b.free;
+                b.free = *static_cast< void** >( frame );
+                ::operator delete( frame );
+            }
+        }
+    }
+
+private:
+    // One per index type and key type in use.
+    static const size_t max_bins = 16;
+
+    struct bin
+    {
+        size_t size;
+        void* free;
+    };
+
+    std::vector< bin > bins_;
+
+    static frame_pool& instance()
+    {
+        thread_local frame_pool pool;
+        return pool;
+    }
+};
+
+} // namespace detail
+
+// A lookup coroutine, returning T. It starts suspended; resume() runs it to
+// its next prefetch, get() to the end.
+template< typename T >
+class lookup
+{
+public:
+    struct promise_type
+    {
+        T value{};
+
+        lookup get_return_object()
+        {
+            return lookup( std::coroutine_handle< promise_type >::from_promise( *this ) );
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value( T val ) { value = val; }
+        void unhandled_exception() { throw; }
+
+        static void* operator new( size_t size ) { return detail::frame_pool::allocate( size ); }
+        static void operator delete( void* frame, size_t size ) { detail::frame_pool::deallocate( frame, size ); }
+    };
+
+    lookup( lookup&& other ) noexcept : handle_( std::exchange( other.handle_, nullptr ) ) {}
+
+    lookup& operator=( lookup&& other ) noexcept
+    {
+        if( this != &other )
+        {
+            reset();
+            handle_ = std::exchange( other.handle_, nullptr );
+        }
+        return *this;
+    }
+
+    ~lookup()
+    {
+        reset();
+    }
+
+    bool done() const
+    {
+        return handle_.done();
+    }
+
+    void resume()
+    {
+        handle_.resume();
+    }
+
+    T result() const
+    {
+        return handle_.promise().value;
+    }
+
+    // Runs the rest of the lookup without interleaving.
+    T get()
+    {
+        while( !handle_.done() )
+        {
+            handle_.resume();
+        }
+        return result();
+    }
+
+private:
+    std::coroutine_handle< promise_type > handle_;
+
+    explicit lookup( std::coroutine_handle< promise_type > handle ) : handle_( handle ) {}
+
+    void reset()
+    {
+        if( handle_ )
+        {
+            handle_.destroy();
+            handle_ = nullptr;
+        }
+    }
+};
+
+// Interleaves up to width find_coro() lookups of one index. submit() starts
+// a lookup and, with width of them in flight, first resumes the others in
+// turn until one ends; done( tag, result ) gets every result, from inside
+// submit(), step() or drain(), in the order the lookups end. Not thread
+// safe, one scheduler per thread:
+//
+//     vecidx::lookup_scheduler sched( index, [&]( size_t row, auto it ){ ... } );
+//     for( size_t row = 0; row < probe.size(); ++row )
+//     {
+//         sched.submit( probe[ row ], row );
+//     }
+//     sched.drain();
+template< typename Index_T, typename Done_T >
+class lookup_scheduler
+{
+public:
+    using index_type  = Index_T;
+    using result_type = typename Index_T::const_iterator;
+    using key_type    = typename std::iterator_traits< result_type >::value_type;
+
+    // Enough misses in flight to cover DRAM latency, like the batches.
+    static const size_t default_width = 2 * batch_group_size;
+
+    lookup_scheduler( const Index_T& index, Done_T done, size_t width = default_width )
+        : index_( index ), done_( std::move( done ) ), width_( width ? width : 1 )
+    {
+        slots_.reserve( width_ );
+    }
+
+    lookup_scheduler( const lookup_scheduler& ) = delete;
+    lookup_scheduler& operator=( const lookup_scheduler& ) = delete;
+
+    // Finishes the lookups still in flight.
+    ~lookup_scheduler()
+    {
+        drain();
+    }
+
+    void submit( const key_type& key, size_t tag )
+    {
+        while( slots_.size() >= width_ )
+        {
+            advance();
+        }
+        lookup< result_type > task = index_.find_coro( key );
+        // Up to its first prefetch.
+        task.resume();
+        if( task.done() )
+        {
+            done_( tag, task.result() );
+            return;
+        }
+        slots_.push_back( slot{ std::move( task ), tag } );
+    }
+
+    // Resumes every lookup in flight once.
+    void step()
+    {
+        for( size_t n = slots_.size(); n > 0 && !slots_.empty(); --n )
+        {
+            advance();
+        }
+    }
+
+    // Runs every lookup in flight to its end.
+    void drain()
+    {
+        while( !slots_.empty() )
+        {
+            advance();
+        }
+    }
+
+    size_t in_flight() const
+    {
+        return slots_.size();
+    }
+
+private:
+    struct slot
+    {
+        lookup< result_type > task;
+        size_t tag;
+    };
+
+    const Index_T& index_;
+    Done_T done_;
+    size_t width_;
+    std::vector< slot > slots_;
+    size_t next_ = 0;
+
+    // Resumes the next lookup in turn, delivering it if it ends.
+    void advance()
+    {
+        if( next_ >= slots_.size() )
+        {
+            next_ = 0;
+        }
+        slot& s = slots_[ next_ ];
+        s.task.resume();
+        if( !s.task.done() )
+        {
+            ++next_;
+            return;
+        }
+        result_type ret = s.task.result();
+        size_t tag = s.tag;
+        // The last one takes its place and is resumed next.
+        if( next_ + 1 != slots_.size() )
+        {
+            s = std::move( slots_.back() );
+        }
+        slots_.pop_back();
+        done_( tag, ret );
+    }
+};
+
+template< typename Index_T, typename Done_T >
+const size_t lookup_scheduler< Index_T, Done_T >::default_width;
+
+namespace detail {
+
+// Prefetches addr and suspends the lookup, co_await'ed right before the
+// read that would miss.
+inline std::suspend_always prefetch_and_suspend( const void* addr )
+{
+    prefetch( addr );
+    return {};
+}
+
+} // namespace detail
+
+} // namespace vecidx
+
+#endif // VECIDX_COROUTINES
+
+#endif // VECIDX_CORO_H
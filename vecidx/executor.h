@@ -0,0 +1,431 @@
+#ifndef VECIDX_EXECUTOR_H
+#define VECIDX_EXECUTOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined( __linux__ )
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace vecidx {
+
+struct numa_node
+{
+    int id;
+    std::vector< int > cpus;
+};
+
+// NUMA nodes with CPUs, from sysfs. Where there is no topology to read, one
+// node -1 without CPUs, whose threads are left unpinned.
+inline std::vector< numa_node > numa_nodes()
+{
+    std::vector< numa_node > nodes;
+#if defined( __linux__ )
+    for( int node = 0; ; ++node )
+    {
+        std::ifstream in( "/sys/devices/system/node/node" + std::to_string( node ) + "/cpulist" );
+        if( !in )
+        {
+            break;
+        }
+        // "0-15,32-47"
+        std::vector< int > cpus;
+        std::string range;
+        while( std::getline( in, range, ',' ) )
+        {
+            int first = 0;
+            int last = 0;
+            char dash = 0;
+            std::istringstream parse( range );
+            if( !( parse >> first ) )
+            {
+                continue;
+            }
+            last = parse >> dash >> last ? last : first;
+            for( int cpu = first; cpu <= last; ++cpu )
+            {
+                cpus.push_back( cpu );
+            }
+        }
+        // Memory only nodes run no threads.
+        if( !cpus.empty() )
+        {
+            nodes.push_back( numa_node{ node, cpus } );
+        }
+    }
+#endif
+    if( nodes.empty() )
+    {
+        nodes.push_back( numa_node{ -1, std::vector< int >() } );
+    }
+    return nodes;
+}
+
+namespace detail {
+
+// Best effort, a thread that can not be pinned runs anywhere.
+inline void pin_thread( const std::vector< int >& cpus )
+{
+#if defined( __linux__ )
+    if( cpus.empty() )
+    {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    for( int cpu : cpus )
+    {
+        if( cpu < CPU_SETSIZE )
+        {
+            CPU_SET( cpu, &set );
+        }
+    }
+    pthread_setaffinity_np( pthread_self(), sizeof( set ), &set );
+#else
+    (void)cpus;
+#endif
+}
+
+} // namespace detail
+
+// Thread pool that runs key batches against an index, with one replica of
+// the index layout per NUMA node.
+//
+// Workers are pinned to the CPUs of their node. With replication every
+// node builds its own Index_T over the shared key vector on a thread pinned
+// there, so the layout pages are first touched, and placed, there; pass
+// a make that takes an arena_allocator on the node to bind them outright.
+// find_batch() cuts the batch into chunks of grain keys, deals them out
+// to the workers and waits; a worker searches its chunks in its node's
+// replica and, once out of work, steals from the other workers, those of
+// its own node first.
+template< typename Index_T >
+class query_executor
+{
+public:
+    using index_type     = Index_T;
+    using value_type     = typename std::iterator_traits< typename Index_T::const_iterator >::value_type;
+    using container_type = std::vector< value_type >;
+    using const_iterator = typename container_type::const_iterator;
+    using make_type      = std::function< std::unique_ptr< index_type >( const container_type&, int node ) >;
+
+    static const size_t default_grain = 4096;
+
+    struct options
+    {
+        // Workers, 0 for one per CPU.
+        size_t threads = 0;
+        // A replica per node, or one index shared by every worker.
+        bool replicate = true;
+        size_t grain = default_grain;
+    };
+
+    query_executor( const container_type& data, options opt = options(), make_type make = make_type() )
+        : data_( data ), grain_( std::max< size_t >( opt.grain, 1 ) ), nodes_( numa_nodes() )
+    {
+        if( !make )
+        {
+            make = []( const container_type& keys, int ) { return std::unique_ptr< index_type >( new index_type( keys ) ); };
+        }
+        size_t threads = opt.threads;
+        if( 0 == threads )
+        {
+            threads = std::max< unsigned >( std::thread::hardware_concurrency(), 1 );
+        }
+        if( !opt.replicate )
+        {
+            replicas_.push_back( make( data_, -1 ) );
+            replicas_.back()->build_index();
+        }
+        else
+        {
+            replicas_.resize( nodes_.size() );
+        }
+
+        // Workers go round the nodes, so every node gets its share.
+        workers_.reserve( threads );
+        for( size_t i = 0; i < threads; ++i )
+        {
+            workers_.emplace_back( new worker( i % nodes_.size() ) );
+        }
+        if( opt.replicate )
+        {
+            build_replicas( make );
+        }
+        for( size_t i = 0; i < threads; ++i )
+        {
+            workers_[ i ]->thread = std::thread( [this, i]{ run( i ); } );
+        }
+    }
+
+    query_executor( const query_executor& ) = delete;
+    query_executor& operator=( const query_executor& ) = delete;
+
+    ~query_executor()
+    {
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for( auto& w : workers_ )
+        {
+            w->thread.join();
+        }
+    }
+
+    // out[ i ] = the index's find( first[ i ] ), over the whole batch.
+    // Returns out + ( last - first ). Safe to call from many threads. An
+    // exception of a chunk is rethrown here once every chunk has run.
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out )
+    {
+        size_t count = static_cast< size_t >( std::distance( first, last ) );
+        execute( count, [first, out]( const index_type& index, size_t begin, size_t end )
+                        {
+                            index.find_batch( first + begin, first + end, out + begin );
+                        });
+        return out + count;
+    }
+
+    // f( index, begin, end ) for every chunk of [0, count), on the workers.
+    // For searches find_batch() does not cover, exceptions as there.
+    template< typename Func_T >
+    void for_each_chunk( size_t count, Func_T f )
+    {
+        execute( count, f );
+    }
+
+    size_t threads() const
+    {
+        return workers_.size();
+    }
+
+    size_t nodes() const
+    {
+        return nodes_.size();
+    }
+
+    // Replica of the node-th entry of numa_nodes(), the shared index
+    // without replication.
+    const index_type& replica( size_t node ) const
+    {
+        return *replicas_[ std::min( node, replicas_.size() - 1 ) ];
+    }
+
+    // Chunks run by a worker other than the one they were dealt to.
+    uint64_t steals() const
+    {
+        return steals_.load( std::memory_order_relaxed );
+    }
+
+private:
+    struct batch
+    {
+        std::function< void( const index_type&, size_t, size_t ) > func;
+        size_t left;
+        // The first exception of a chunk, rethrown to the caller.
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+
+    struct task
+    {
+        batch* owner;
+        size_t begin;
+        size_t end;
+    };
+
+    struct worker
+    {
+        explicit worker( size_t n ) : node( n ) {}
+
+        size_t node;
+        std::thread thread;
+        std::mutex mutex;
+        // The worker pops the back, thieves take the front.
+        std::deque< task > tasks;
+    };
+
+    const container_type& data_;
+    size_t grain_;
+    std::vector< numa_node > nodes_;
+    std::vector< std::unique_ptr< index_type > > replicas_;
+    std::vector< std::unique_ptr< worker > > workers_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    // Dealt tasks not yet taken, guards the workers' sleep.
+    std::atomic< size_t > queued_{ 0 };
+    bool stop_ = false;
+    std::atomic< size_t > next_{ 0 };
+    std::atomic< uint64_t > steals_{ 0 };
+
+    // Every replica is built on a thread pinned to its node; nodes build
+    // in parallel.
+    void build_replicas( const make_type& make )
+    {
+        std::vector< std::thread > builders;
+        for( size_t node = 0; node < nodes_.size(); ++node )
+        {
+            builders.emplace_back( [this, &make, node]
+                                   {
+                                       detail::pin_thread( nodes_[ node ].cpus );
+                                       std::unique_ptr< index_type > index = make( data_, nodes_[ node ].id );
+                                       index->build_index();
+                                       replicas_[ node ] = std::move( index );
+                                   });
+        }
+        for( auto& b : builders )
+        {
+            b.join();
+        }
+    }
+
+    template< typename Func_T >
+    void execute( size_t count, Func_T f )
+    {
+        if( 0 == count )
+        {
+            return;
+        }
+        batch b;
+        b.func = f;
+        size_t chunks = ( count + grain_ - 1 ) / grain_;
+        b.left = chunks;
+
+        // Dealt round robin from a rotating start, so small batches do not
+        // all land on worker 0. A task is counted under the lock it is
+        // pushed under, before any worker can pop it and count it off.
+        size_t start = next_.fetch_add( 1, std::memory_order_relaxed );
+        for( size_t c = 0; c < chunks; ++c )
+        {
+            worker& w = *workers_[ ( start + c ) % workers_.size() ];
+            std::lock_guard< std::mutex > lock( w.mutex );
+            w.tasks.push_back( task{ &b, c * grain_, std::min( count, ( c + 1 ) * grain_ ) } );
+            queued_.fetch_add( 1 );
+        }
+        {
+            // A worker between its check of queued_ and its wait holds
+            // mutex_, the notify can not slip in between.
+            std::lock_guard< std::mutex > lock( mutex_ );
+        }
+        wake_.notify_all();
+
+        std::unique_lock< std::mutex > lock( b.mutex );
+        b.done.wait( lock, [&]{ return 0 == b.left; } );
+        if( b.error )
+        {
+            std::rethrow_exception( b.error );
+        }
+    }
+
+    bool pop( worker& w, task& t )
+    {
+        std::lock_guard< std::mutex > lock( w.mutex );
+        if( w.tasks.empty() )
+        {
+            return false;
+        }
+        t = w.tasks.back();
+        w.tasks.pop_back();
+        return true;
+    }
+
+    bool steal( worker& w, task& t )
+    {
+        std::lock_guard< std::mutex > lock( w.mutex );
+        if( w.tasks.empty() )
+        {
+            return false;
+        }
+        t = w.tasks.front();
+        w.tasks.pop_front();
+        return true;
+    }
+
+    // Victims on the thief's node first, then the rest.
+    bool steal_any( size_t self, task& t )
+    {
+        size_t node = workers_[ self ]->node;
+        for( int pass = 0; pass < 2; ++pass )
+        {
+            for( size_t i = 1; i < workers_.size(); ++i )
+            {
+                worker& victim = *workers_[ ( self + i ) % workers_.size() ];
+                if( ( victim.node == node ) == ( 0 == pass ) && steal( victim, t ) )
+                {
+                    steals_.fetch_add( 1, std::memory_order_relaxed );
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void run( size_t self )
+    {
+        worker& w = *workers_[ self ];
+        detail::pin_thread( nodes_[ w.node ].cpus );
+        const index_type& index = replica( w.node );
+        for( ;; )
+        {
+            task t;
+            if( pop( w, t ) || steal_any( self, t ) )
+            {
+                queued_.fetch_sub( 1 );
+                std::exception_ptr error;
+                try
+                {
+                    t.owner->func( index, t.begin, t.end );
+                }
+                catch( ... )
+                {
+                    error = std::current_exception();
+                }
+                // Under the batch lock: the waiter frees the batch as soon
+                // as it sees the count drop to 0.
+                std::lock_guard< std::mutex > lock( t.owner->mutex );
+                if( error && !t.owner->error )
+                {
+                    t.owner->error = error;
+                }
+                if( 0 == --t.owner->left )
+                {
+                    t.owner->done.notify_one();
+                }
+                continue;
+            }
+            std::unique_lock< std::mutex > lock( mutex_ );
+            wake_.wait( lock, [&]{ return stop_ || 0 != queued_.load(); } );
+            if( stop_ && 0 == queued_.load() )
+            {
+                return;
+            }
+        }
+    }
+};
+
+template< typename Index_T >
+const size_t query_executor< Index_T >::default_grain;
+
+} // namespace vecidx
+
+#endif // VECIDX_EXECUTOR_H
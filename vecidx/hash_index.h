@@ -0,0 +1,282 @@
+#ifndef VECIDX_HASH_INDEX_H
+#define VECIDX_HASH_INDEX_H
+
+#include <emmintrin.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <iterator>
+#include <utility>
+#include <type_traits>
+
+#include "allocator.h"
+
+namespace vecidx {
+
+namespace detail {
+
+// Keys equal under the indexes' order hash alike: 0.0 and -0.0, and every
+// NaN, which key_less sorts together after the numbers.
+template< typename Key_T >
+uint64_t hash_bits( Key_T key, std::true_type )
+{
+    if( std::isnan( key ) )
+    {
+        return ~uint64_t( 0 );
+    }
+    if( 0 == key )
+    {
+        return 0;
+    }
+    uint64_t bits = 0;
+    std::memcpy( &bits, &key, sizeof( key ) );
+    return bits;
+}
+
+template< typename Key_T >
+uint64_t hash_bits( Key_T key, std::false_type )
+{
+    return static_cast< uint64_t >( key );
+}
+
+template< typename Key_T >
+uint64_t hash_key( Key_T key )
+{
+    // murmur3's finaliser, every input bit reaches the low 7 and the high ones.
+    uint64_t h = hash_bits( key, std::is_floating_point< Key_T >() );
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+template< typename Key_T >
+bool hash_equal( Key_T lhs, Key_T rhs, std::true_type )
+{
+    return lhs == rhs || ( std::isnan( lhs ) && std::isnan( rhs ) );
+}
+
+template< typename Key_T >
+bool hash_equal( Key_T lhs, Key_T rhs, std::false_type )
+{
+    return lhs == rhs;
+}
+
+inline unsigned lowest_bit( unsigned mask )
+{
+#if defined( _MSC_VER )
+    unsigned long bit;
+    _BitScanForward( &bit, mask );
+    return bit;
+#else
+    return __builtin_ctz( mask );
+#endif
+}
+
+} // namespace detail
+
+// An ordered index with a hash table beside it for find().
+//
+// build_index() builds Index_T and then an open addressing table from every
+// distinct key to its first position in ref_, Swiss table style: slots come
+// in groups of 16 with a control byte each, empty or 7 bits of the hash,
+// and a probe matches all 16 with one SSE2 compare before it reads the key
+// and position of the matching slots. find() is then a control line and a
+// slot line; everything else, equal_range() and the sorted ranges, goes
+// through index(). Of duplicate keys find() returns the first in ref_,
+// tree_index may find another.
+//
+// The table takes about 1 + sizeof( key ) + sizeof( Size_T ) bytes per key
+// over a load of at most 7/8. Past max_table_bytes no table is built and
+// find() is the index's; 0 turns it off.
+template< typename Index_T, typename Size_T = uint32_t >
+class hash_accelerated
+{
+public:
+    using index_type      = Index_T;
+    using size_type       = Size_T;
+    using value_type      = typename std::iterator_traits< typename Index_T::const_iterator >::value_type;
+    using const_iterator  = typename std::vector< value_type >::const_iterator;
+    using sorted_iterator = typename Index_T::sorted_iterator;
+
+    static_assert( std::is_arithmetic< value_type >::value, "hash_accelerated takes integer and floating point keys" );
+
+    static const size_t unlimited = ~size_t( 0 );
+
+    // Further arguments go to the Index_T constructor.
+    template< typename... Args_T >
+    hash_accelerated( const std::vector< value_type >& ref, size_t max_table_bytes = unlimited, Args_T&&... args )
+        : ref_( ref ), index_( ref, std::forward< Args_T >( args )... ), max_table_bytes_( max_table_bytes ) {}
+
+    void build_index()
+    {
+        index_.build_index();
+
+        ctrl_.clear();
+        slots_.clear();
+        group_mask_ = 0;
+        size_t groups = 1;
+        while( groups * group_size * 7 / 8 < ref_.size() )
+        {
+            groups *= 2;
+        }
+        if( ref_.size() > std::numeric_limits< size_type >::max() ||
+            groups * group_size * ( 1 + sizeof( slot ) ) > max_table_bytes_ )
+        {
+            return;
+        }
+
+        ctrl_.assign( groups * group_size, empty );
+        slots_.resize( groups * group_size );
+        group_mask_ = groups - 1;
+        for( size_t pos = 0; pos < ref_.size(); ++pos )
+        {
+            insert( ref_[ pos ], pos );
+        }
+    }
+
+    const_iterator find( const value_type& key ) const
+    {
+        if( ctrl_.empty() )
+        {
+            return index_.find( key );
+        }
+        uint64_t h = detail::hash_key( key );
+        const __m128i tag = _mm_set1_epi8( static_cast< char >( h & 0x7f ) );
+        const __m128i none = _mm_set1_epi8( static_cast< char >( empty ) );
+        size_t group = ( h >> 7 ) & group_mask_;
+        for( size_t step = 1; ; ++step )
+        {
+            size_t first = group * group_size;
+            __m128i ctrl = _mm_load_si128( reinterpret_cast< const __m128i* >( &ctrl_[ first ] ) );
+            for( unsigned match = _mm_movemask_epi8( _mm_cmpeq_epi8( ctrl, tag ) ); match; match &= match - 1 )
+            {
+                const slot& s = slots_[ first + detail::lowest_bit( match ) ];
+                if( detail::hash_equal( s.key, key, std::is_floating_point< value_type >() ) )
+                {
+                    return ref_.begin() + s.pos;
+                }
+            }
+            // A key would be in the first group with room for it.
+            if( _mm_movemask_epi8( _mm_cmpeq_epi8( ctrl, none ) ) )
+            {
+                return ref_.end();
+            }
+            group = ( group + step ) & group_mask_;
+        }
+    }
+
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        if( ctrl_.empty() )
+        {
+            return index_.find_batch( first, last, out );
+        }
+        for( ; first != last; ++first )
+        {
+            *out++ = find( *first );
+        }
+        return out;
+    }
+
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const value_type& key ) const
+    {
+        return index_.equal_range( key );
+    }
+
+    sorted_iterator sorted_begin() const
+    {
+        return index_.sorted_begin();
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        return index_.sorted_end();
+    }
+
+    // The ordered index, for lower bounds and ranges.
+    const index_type& index() const
+    {
+        return index_;
+    }
+
+    // Whether find() goes through the table.
+    bool accelerated() const
+    {
+        return !ctrl_.empty();
+    }
+
+    size_t table_bytes() const
+    {
+        return ctrl_.capacity() + slots_.capacity() * sizeof( slot );
+    }
+
+    // Bytes of the index and the table, without the vector.
+    size_t memory_usage() const
+    {
+        return index_.memory_usage() + table_bytes();
+    }
+
+private:
+    static const size_t group_size = 16;
+    static const uint8_t empty = 0x80;
+
+    struct slot
+    {
+        value_type key;
+        size_type pos;
+    };
+
+    const std::vector< value_type >& ref_;
+    index_type index_;
+    size_t max_table_bytes_;
+    std::vector< uint8_t, aligned_allocator< uint8_t > > ctrl_;
+    std::vector< slot, aligned_allocator< slot > > slots_;
+    size_t group_mask_ = 0;
+
+    // Keeps the first position of every key.
+    void insert( const value_type& key, size_t pos )
+    {
+        uint64_t h = detail::hash_key( key );
+        uint8_t tag = static_cast< uint8_t >( h & 0x7f );
+        size_t group = ( h >> 7 ) & group_mask_;
+        for( size_t step = 1; ; ++step )
+        {
+            size_t first = group * group_size;
+            for( size_t i = first; i < first + group_size; ++i )
+            {
+                if( empty == ctrl_[ i ] )
+                {
+                    ctrl_[ i ] = tag;
+                    slots_[ i ].key = key;
+                    slots_[ i ].pos = static_cast< size_type >( pos );
+                    return;
+                }
+                if( tag == ctrl_[ i ] && detail::hash_equal( slots_[ i ].key, key, std::is_floating_point< value_type >() ) )
+                {
+                    return;
+                }
+            }
+            group = ( group + step ) & group_mask_;
+        }
+    }
+};
+
+template< typename Index_T, typename Size_T >
+const size_t hash_accelerated< Index_T, Size_T >::unlimited;
+
+template< typename Index_T, typename Size_T >
+const size_t hash_accelerated< Index_T, Size_T >::group_size;
+
+template< typename Index_T, typename Size_T >
+const uint8_t hash_accelerated< Index_T, Size_T >::empty;
+
+} // namespace vecidx
+
+#endif // VECIDX_HASH_INDEX_H
@@ -0,0 +1,510 @@
+#ifndef VECIDX_IMAGE_H
+#define VECIDX_IMAGE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined( _MSC_VER )
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "allocator.h"
+
+namespace vecidx {
+
+// An index image that can not be written, read or used with this data.
+class image_error : public std::runtime_error
+{
+public:
+    explicit image_error( const std::string& what ) : std::runtime_error( "vecidx: " + what ) {}
+};
+
+// Read-only mapping of a whole file.
+class mapped_file
+{
+public:
+    explicit mapped_file( const std::string& path )
+    {
+#if defined( _MSC_VER )
+        file_ = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+        LARGE_INTEGER size;
+        if( INVALID_HANDLE_VALUE == file_ || !GetFileSizeEx( file_, &size ) )
+        {
+            close();
+            throw image_error( "can not open " + path );
+        }
+        size_ = static_cast< size_t >( size.QuadPart );
+        if( 0 != size_ )
+        {
+            mapping_ = CreateFileMappingA( file_, nullptr, PAGE_READONLY, 0, 0, nullptr );
+            data_ = nullptr == mapping_ ? nullptr : MapViewOfFile( mapping_, FILE_MAP_READ, 0, 0, 0 );
+        }
+#else
+        int fd = open( path.c_str(), O_RDONLY );
+        struct stat st;
+        if( fd < 0 || 0 != fstat( fd, &st ) )
+        {
+            if( fd >= 0 )
+            {
+                ::close( fd );
+            }
+            throw image_error( "can not open " + path );
+        }
+        size_ = static_cast< size_t >( st.st_size );
+        if( 0 != size_ )
+        {
+            data_ = mmap( nullptr, size_, PROT_READ, MAP_SHARED, fd, 0 );
+            if( MAP_FAILED == data_ )
+            {
+                data_ = nullptr;
+            }
+        }
+        ::close( fd );
+#endif
+        if( 0 != size_ && nullptr == data_ )
+        {
+            close();
+            throw image_error( "can not map " + path );
+        }
+    }
+
+    mapped_file( const mapped_file& ) = delete;
+    mapped_file& operator=( const mapped_file& ) = delete;
+
+    ~mapped_file()
+    {
+        close();
+    }
+
+    const void* data() const
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+#if defined( _MSC_VER )
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#endif
+
+    void close()
+    {
+#if defined( _MSC_VER )
+        if( nullptr != data_ )
+        {
+            UnmapViewOfFile( data_ );
+        }
+        if( nullptr != mapping_ )
+        {
+            CloseHandle( mapping_ );
+        }
+        if( INVALID_HANDLE_VALUE != file_ )
+        {
+            CloseHandle( file_ );
+        }
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if( nullptr != data_ )
+        {
+            munmap( data_, size_ );
+        }
+#endif
+        data_ = nullptr;
+    }
+};
+
+// Layout array of an index: owned and aligned while it is built, or a view
+// into a mapped image after load(), which the buffer keeps mapped. Reads go
+// through data() either way; the writing members are for the build and
+// only touch the owned memory, which comes from Alloc_T.
+template< typename T, typename Alloc_T = aligned_allocator< T > >
+class buffer
+{
+public:
+    using value_type     = T;
+    using allocator_type = Alloc_T;
+    using const_iterator = const T*;
+
+    buffer() = default;
+    explicit buffer( const Alloc_T& alloc ) : owned_( alloc ) {}
+
+    buffer( const buffer& other ) : owned_( other.owned_ ), file_( other.file_ )
+    {
+        sync( other );
+    }
+
+    buffer& operator=( const buffer& other )
+    {
+        owned_ = other.owned_;
+        file_ = other.file_;
+        sync( other );
+        return *this;
+    }
+
+    template< typename InputIt >
+    void assign( InputIt first, InputIt last )
+    {
+        owned_.assign( first, last );
+        own();
+    }
+
+    void assign( size_t count, const T& value )
+    {
+        owned_.assign( count, value );
+        own();
+    }
+
+    void resize( size_t count )
+    {
+        owned_.resize( count );
+        own();
+    }
+
+    // Uses count elements at data, kept alive by file.
+    void view( std::shared_ptr< const mapped_file > file, const T* data, size_t count )
+    {
+        owned_.clear();
+        owned_.shrink_to_fit();
+        file_ = std::move( file );
+        data_ = data;
+        size_ = count;
+    }
+
+    size_t size() const { return size_; }
+    bool empty() const { return 0 == size_; }
+
+    // Bytes of memory held, or of the image used by a view.
+    size_t memory_usage() const
+    {
+        return ( file_ ? size_ : owned_.capacity() ) * sizeof( T );
+    }
+
+    const T* data() const { return data_; }
+    const T& operator[]( size_t i ) const { return data_[ i ]; }
+    const_iterator begin() const { return data_; }
+    const_iterator end() const { return data_ + size_; }
+
+    T* data() { return owned_.data(); }
+    T& operator[]( size_t i ) { return owned_[ i ]; }
+
+private:
+    std::vector< T, Alloc_T > owned_;
+    std::shared_ptr< const mapped_file > file_;
+    const T* data_ = nullptr;
+    size_t size_ = 0;
+
+    void own()
+    {
+        file_.reset();
+        data_ = owned_.data();
+        size_ = owned_.size();
+    }
+
+    void sync( const buffer& other )
+    {
+        data_ = file_ ? other.data_ : owned_.data();
+        size_ = other.size_;
+    }
+};
+
+// On-disk image of a built index:
+//
+//   image_header | section 0 | section 1 | ...
+//
+// Every section starts on a cache line of the file, so it is line aligned
+// in the mapping too and the index uses it in place. The checksum covers
+// everything after the header, the fingerprint the source vector: an image
+// of other data, or of the same vector since modified, is rejected.
+static const uint32_t image_version = 1;
+static const size_t image_max_sections = 8;
+static const size_t image_max_params = 8;
+
+struct image_header
+{
+    char magic[ 8 ];
+    uint32_t version;
+    uint32_t key_code;
+    uint32_t size_size;
+    uint32_t sections;
+    char kind[ 16 ];
+    uint64_t count;
+    uint64_t fingerprint;
+    uint64_t checksum;
+    uint64_t bytes;
+    uint64_t params[ image_max_params ];
+    uint64_t section_offset[ image_max_sections ];
+    uint64_t section_bytes[ image_max_sections ];
+};
+
+namespace detail {
+
+static const char image_magic[ 8 ] = { 'v', 'e', 'c', 'i', 'd', 'x', 0, 0 };
+
+// Width, signedness and floatness of a key type.
+template< typename VecType_T >
+uint32_t key_code()
+{
+    return static_cast< uint32_t >( sizeof( VecType_T ) ) |
+           ( std::is_floating_point< VecType_T >::value ? 0x100 : 0 ) |
+           ( std::is_signed< VecType_T >::value ? 0x200 : 0 );
+}
+
+// 64-bit multiply-xor hash, four lanes wide so it runs near memory speed.
+inline uint64_t hash_bytes( const void* data, size_t bytes, uint64_t seed )
+{
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t lane[ 4 ] = { seed ^ 0xcbf29ce484222325ULL, seed + 1, seed + 2, seed + 3 };
+    const unsigned char* ptr = static_cast< const unsigned char* >( data );
+    size_t i = 0;
+    for( ; i + 32 <= bytes; i += 32 )
+    {
+        for( size_t l = 0; l < 4; ++l )
+        {
+            uint64_t word;
+            std::memcpy( &word, ptr + i + 8 * l, 8 );
+            lane[ l ] = ( lane[ l ] ^ word ) * prime;
+            lane[ l ] ^= lane[ l ] >> 29;
+        }
+    }
+    uint64_t ret = bytes;
+    for( size_t l = 0; l < 4; ++l )
+    {
+        ret = ( ret ^ lane[ l ] ) * prime;
+    }
+    for( ; i < bytes; ++i )
+    {
+        ret = ( ret ^ ptr[ i ] ) * prime;
+    }
+    return ret ^ ( ret >> 32 );
+}
+
+} // namespace detail
+
+// Fingerprint of the data an index is built on.
+template< typename VecType_T >
+uint64_t fingerprint( const std::vector< VecType_T >& vec )
+{
+    static_assert( std::is_trivially_copyable< VecType_T >::value, "index images hold raw bytes, the key type must be trivially copyable" );
+    return detail::hash_bytes( vec.data(), vec.size() * sizeof( VecType_T ), vec.size() );
+}
+
+// Collects the header fields and sections of an image and writes it.
+class image_writer
+{
+public:
+    template< typename Size_T, typename VecType_T >
+    image_writer( const char* kind, const std::vector< VecType_T >& vec, Size_T )
+    {
+        static_assert( std::is_trivially_copyable< VecType_T >::value, "index images hold raw bytes, the key type must be trivially copyable" );
+        std::memset( &header_, 0, sizeof( header_ ) );
+        std::memcpy( header_.magic, detail::image_magic, sizeof( header_.magic ) );
+        std::strncpy( header_.kind, kind, sizeof( header_.kind ) - 1 );
+        header_.version = image_version;
+        header_.key_code = detail::key_code< VecType_T >();
+        header_.size_size = sizeof( Size_T );
+        header_.count = vec.size();
+        header_.fingerprint = fingerprint( vec );
+    }
+
+    void param( size_t i, uint64_t value )
+    {
+        header_.params[ i ] = value;
+    }
+
+    template< typename T >
+    void section( const T* data, size_t count )
+    {
+        static_assert( std::is_trivially_copyable< T >::value, "image sections hold raw bytes" );
+        if( header_.sections == image_max_sections )
+        {
+            throw image_error( "too many image sections" );
+        }
+        data_[ header_.sections ] = data;
+        header_.section_bytes[ header_.sections++ ] = count * sizeof( T );
+    }
+
+    void save( const std::string& path )
+    {
+        uint64_t offset = sizeof( image_header );
+        for( size_t s = 0; s < header_.sections; ++s )
+        {
+            offset = align( offset );
+            header_.section_offset[ s ] = offset;
+            offset += header_.section_bytes[ s ];
+        }
+        header_.bytes = offset;
+
+        uint64_t sum = 0;
+        for( size_t s = 0; s < header_.sections; ++s )
+        {
+            sum = detail::hash_bytes( data_[ s ], header_.section_bytes[ s ], sum );
+        }
+        header_.checksum = sum;
+
+        std::FILE* file = std::fopen( path.c_str(), "wb" );
+        if( nullptr == file )
+        {
+            throw image_error( "can not create " + path );
+        }
+        bool ok = 1 == std::fwrite( &header_, sizeof( header_ ), 1, file );
+        offset = sizeof( image_header );
+        static const char zero[ cache_line_size ] = {};
+        for( size_t s = 0; ok && s < header_.sections; ++s )
+        {
+            size_t pad = header_.section_offset[ s ] - offset;
+            ok = pad == std::fwrite( zero, 1, pad, file );
+            size_t bytes = header_.section_bytes[ s ];
+            ok = ok && ( 0 == bytes || bytes == std::fwrite( data_[ s ], 1, bytes, file ) );
+            offset = header_.section_offset[ s ] + bytes;
+        }
+        ok = 0 == std::fclose( file ) && ok;
+        if( !ok )
+        {
+            throw image_error( "can not write " + path );
+        }
+    }
+
+private:
+    image_header header_;
+    const void* data_[ image_max_sections ];
+
+    static uint64_t align( uint64_t offset )
+    {
+        return ( offset + cache_line_size - 1 ) / cache_line_size * cache_line_size;
+    }
+};
+
+// Maps an image and checks it against the index loading it and its data.
+class image_reader
+{
+public:
+    template< typename Size_T, typename VecType_T >
+    image_reader( const std::string& path, const char* kind, const std::vector< VecType_T >& vec, Size_T )
+        : file_( std::make_shared< mapped_file >( path ) )
+    {
+        static_assert( std::is_trivially_copyable< VecType_T >::value, "index images hold raw bytes, the key type must be trivially copyable" );
+        if( file_->size() < sizeof( image_header ) )
+        {
+            throw image_error( path + " is not an index image" );
+        }
+        header_ = static_cast< const image_header* >( file_->data() );
+        if( 0 != std::memcmp( header_->magic, detail::image_magic, sizeof( header_->magic ) ) )
+        {
+            throw image_error( path + " is not an index image" );
+        }
+        if( image_version != header_->version )
+        {
+            throw image_error( path + " has image version " + std::to_string( header_->version ) );
+        }
+        if( 0 != std::strncmp( header_->kind, kind, sizeof( header_->kind ) ) ||
+            detail::key_code< VecType_T >() != header_->key_code ||
+            sizeof( Size_T ) != header_->size_size )
+        {
+            throw image_error( path + " is an image of another index type" );
+        }
+        if( file_->size() != header_->bytes || header_->sections > image_max_sections )
+        {
+            throw image_error( path + " is truncated" );
+        }
+
+        uint64_t sum = 0;
+        for( size_t s = 0; s < header_->sections; ++s )
+        {
+            if( header_->section_offset[ s ] + header_->section_bytes[ s ] > header_->bytes )
+            {
+                throw image_error( path + " is truncated" );
+            }
+            sum = detail::hash_bytes( section_data( s ), header_->section_bytes[ s ], sum );
+        }
+        if( sum != header_->checksum )
+        {
+            throw image_error( path + " is corrupt" );
+        }
+        if( vec.size() != header_->count || fingerprint( vec ) != header_->fingerprint )
+        {
+            throw image_error( path + " was built from other data" );
+        }
+    }
+
+    uint64_t param( size_t i ) const
+    {
+        return header_->params[ i ];
+    }
+
+    size_t sections() const
+    {
+        return header_->sections;
+    }
+
+    // Points out section s in place.
+    template< typename T, typename Alloc_T >
+    void section( size_t s, buffer< T, Alloc_T >& out ) const
+    {
+        static_assert( std::is_trivially_copyable< T >::value, "image sections hold raw bytes" );
+        check( s, sizeof( T ) );
+        out.view( file_, static_cast< const T* >( section_data( s ) ),
+                  header_->section_bytes[ s ] / sizeof( T ) );
+    }
+
+    // Copies section s, for the small tables an index keeps in std
+    // containers.
+    template< typename T, typename OutputIt >
+    void copy( size_t s, OutputIt out ) const
+    {
+        static_assert( std::is_trivially_copyable< T >::value, "image sections hold raw bytes" );
+        check( s, sizeof( T ) );
+        const T* data = static_cast< const T* >( section_data( s ) );
+        std::copy( data, data + header_->section_bytes[ s ] / sizeof( T ), out );
+    }
+
+    size_t count( size_t s, size_t size ) const
+    {
+        check( s, size );
+        return header_->section_bytes[ s ] / size;
+    }
+
+private:
+    std::shared_ptr< const mapped_file > file_;
+    const image_header* header_;
+
+    const void* section_data( size_t s ) const
+    {
+        return static_cast< const char* >( file_->data() ) + header_->section_offset[ s ];
+    }
+
+    void check( size_t s, size_t size ) const
+    {
+        if( s >= header_->sections || 0 != header_->section_bytes[ s ] % size )
+        {
+            throw image_error( "index image does not match the index layout" );
+        }
+    }
+};
+
+} // namespace vecidx
+
+#endif // VECIDX_IMAGE_H
@@ -0,0 +1,197 @@
+#ifndef VECIDX_ISA_H
+#define VECIDX_ISA_H
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+
+// Kernels for each instruction set are compiled with a target attribute, so
+// the library is built for the baseline x86-64 and the widest kernel the CPU
+// supports is picked at runtime. isa::dispatch() calls the search code
+// through a flattened trampoline with the same target, so the kernels are
+// still inlined into the whole lookup.
+#if defined( _MSC_VER )
+#define VECIDX_TARGET_SSE
+#define VECIDX_TARGET_AVX2
+#define VECIDX_TARGET_AVX512
+#define VECIDX_FLATTEN
+#else
+#define VECIDX_TARGET_SSE    __attribute__(( target( "sse4.2,popcnt" ) ))
+#define VECIDX_TARGET_AVX2   __attribute__(( target( "avx2,bmi,bmi2,popcnt" ) ))
+#define VECIDX_TARGET_AVX512 __attribute__(( target( "avx512f,avx512bw,avx512vl,avx512dq,avx2,bmi,bmi2,popcnt" ) ))
+#define VECIDX_FLATTEN       __attribute__(( flatten ))
+#endif
+
+namespace vecidx {
+namespace isa {
+
+struct sse {};    // SSE4.2 + POPCNT
+struct avx2 {};   // AVX2 + BMI2
+struct avx512 {}; // AVX-512 F/BW/VL/DQ
+
+enum class level { sse, avx2, avx512 };
+
+inline const char* name( level lvl )
+{
+    switch( lvl )
+    {
+    case level::avx512: return "avx512";
+    case level::avx2:   return "avx2";
+    default:            return "sse";
+    }
+}
+
+namespace detail {
+
+// Below the sse kernels' SSE4.2 and POPCNT there is nothing to run: better
+// an exception than SIGILL in the first lookup.
+inline void no_sse()
+{
+    throw std::runtime_error( "vecidx needs a CPU with SSE4.2 and POPCNT" );
+}
+
+#if defined( _MSC_VER )
+inline level cpu_level()
+{
+    int info[ 4 ];
+    __cpuid( info, 0 );
+    int max_leaf = info[ 0 ];
+
+    __cpuid( info, 1 );
+    bool sse42 = 0 != ( info[ 2 ] & ( 1 << 20 ) );
+    bool popcnt = 0 != ( info[ 2 ] & ( 1 << 23 ) );
+    if( !sse42 || !popcnt )
+    {
+        no_sse();
+    }
+    bool osxsave = 0 != ( info[ 2 ] & ( 1 << 27 ) );
+    bool avx = 0 != ( info[ 2 ] & ( 1 << 28 ) );
+    if( max_leaf < 7 || !osxsave || !avx )
+    {
+        return level::sse;
+    }
+
+    // The same features the target attributes compile the kernels for.
+    unsigned long long xcr0 = _xgetbv( 0 );
+    __cpuidex( info, 7, 0 );
+    unsigned ebx = static_cast< unsigned >( info[ 1 ] );
+    bool avx2 = 0 != ( ebx & ( 1u << 5 ) ) &&   // avx2
+                0 != ( ebx & ( 1u << 3 ) ) &&   // bmi
+                0 != ( ebx & ( 1u << 8 ) ) &&   // bmi2
+                0x6 == ( xcr0 & 0x6 );
+    bool avx512 = avx2 &&
+                  0 != ( ebx & ( 1u << 16 ) ) &&  // avx512f
+                  0 != ( ebx & ( 1u << 17 ) ) &&  // avx512dq
+                  0 != ( ebx & ( 1u << 30 ) ) &&  // avx512bw
+                  0 != ( ebx & ( 1u << 31 ) ) &&  // avx512vl
+                  0xe6 == ( xcr0 & 0xe6 );
+    return avx512 ? level::avx512 : avx2 ? level::avx2 : level::sse;
+}
+#else
+inline level cpu_level()
+{
+    __builtin_cpu_init();
+    if( !__builtin_cpu_supports( "sse4.2" ) ||
+        !__builtin_cpu_supports( "popcnt" ) )
+    {
+        no_sse();
+    }
+    bool avx2 = __builtin_cpu_supports( "avx2" ) &&
+                __builtin_cpu_supports( "bmi" ) &&
+                __builtin_cpu_supports( "bmi2" );
+    if( avx2 &&
+        __builtin_cpu_supports( "avx512f" ) &&
+        __builtin_cpu_supports( "avx512bw" ) &&
+        __builtin_cpu_supports( "avx512vl" ) &&
+        __builtin_cpu_supports( "avx512dq" ) )
+    {
+        return level::avx512;
+    }
+    return avx2 ? level::avx2 : level::sse;
+}
+#endif
+
+// VECIDX_ISA=sse|avx2 caps the detected level, to compare kernels on one
+// machine or to work around a misbehaving node.
+inline level env_cap( level lvl )
+{
+    const char* env = std::getenv( "VECIDX_ISA" );
+    if( nullptr == env )
+    {
+        return lvl;
+    }
+    level cap = level::avx512;
+    if( 0 == std::strcmp( env, "sse" ) )
+    {
+        cap = level::sse;
+    }
+    else if( 0 == std::strcmp( env, "avx2" ) )
+    {
+        cap = level::avx2;
+    }
+    return ( static_cast< int >( cap ) < static_cast< int >( lvl ) ) ? cap : lvl;
+}
+
+} // namespace detail
+
+// Widest instruction set supported by the running CPU. Throws
+// std::runtime_error on one without SSE4.2 and POPCNT.
+inline level detect()
+{
+    static const level lvl = detail::env_cap( detail::cpu_level() );
+    return lvl;
+}
+
+template< typename Isa_T > struct invoke;
+
+template<> struct invoke< sse >
+{
+    template< typename Func_T >
+    VECIDX_TARGET_SSE VECIDX_FLATTEN
+    static auto run( Func_T&& func ) -> decltype( func( sse() ) )
+    {
+        return func( sse() );
+    }
+};
+
+template<> struct invoke< avx2 >
+{
+    template< typename Func_T >
+    VECIDX_TARGET_AVX2 VECIDX_FLATTEN
+    static auto run( Func_T&& func ) -> decltype( func( avx2() ) )
+    {
+        return func( avx2() );
+    }
+};
+
+template<> struct invoke< avx512 >
+{
+    template< typename Func_T >
+    VECIDX_TARGET_AVX512 VECIDX_FLATTEN
+    static auto run( Func_T&& func ) -> decltype( func( avx512() ) )
+    {
+        return func( avx512() );
+    }
+};
+
+// Calls func( isa_tag ) for the given level. func is a generic lambda, so
+// the code it instantiates sees the kernels of that level as constexpr.
+template< typename Func_T >
+auto dispatch( level lvl, Func_T&& func ) -> decltype( func( sse() ) )
+{
+    switch( lvl )
+    {
+    case level::avx512: return invoke< avx512 >::run( func );
+    case level::avx2:   return invoke< avx2 >::run( func );
+    default:            return invoke< sse >::run( func );
+    }
+}
+
+} // namespace isa
+} // namespace vecidx
+
+#endif // VECIDX_ISA_H
@@ -0,0 +1,391 @@
+#ifndef VECIDX_LEARNED_INDEX_H
+#define VECIDX_LEARNED_INDEX_H
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <limits>
+#include <iterator>
+#include <utility>
+#include <algorithm>
+
+#include "isa.h"
+#include "allocator.h"
+#include "image.h"
+#include "smart_step.h"
+
+namespace vecidx {
+
+// Learned index over sorted data (PGM style). Each level is a piecewise
+// linear model of the positions of the keys below it: a segment starting at
+// key k predicts intercept + slope * (key - k), within epsilon of the real
+// position. The bottom level models ref_, every level above models the
+// first keys of the segments of the level below, up to a single segment.
+//
+// A lookup walks down the levels and at each one counts, with the SIMD
+// kernels, the keys less than key in the epsilon window around the
+// prediction. Keys are ordered by key_less; ref_ must be sorted by it.
+template< typename DUMMY_T, typename VecType_T, typename Alloc_T = aligned_allocator< VecType_T > >
+class learned_index
+{
+public:
+    using value_type     = VecType_T;
+    using allocator_type = Alloc_T;
+    using const_iterator = typename std::vector< value_type >::const_iterator;
+
+    // Error of the upper levels, which are small and cache resident.
+    static const size_t inner_epsilon = 8;
+
+    learned_index( const std::vector< value_type >& ref, size_t epsilon = 32,
+                   isa::level lvl = isa::detect(), const Alloc_T& alloc = Alloc_T() )
+        : ref_( ref ), isa_( lvl ), epsilon_( std::max< size_t >( epsilon, 1 ) ), alloc_( alloc ) {}
+
+    void build_index()
+    {
+        // NaNs sort last and have no position to model.
+        size_ = ref_.size();
+        while( size_ > 0 && is_nan( ref_[ size_ - 1 ] ) )
+        {
+            --size_;
+        }
+
+        levels_.clear();
+        levels_.emplace_back( alloc_ );
+        fit( ref_.data(), size_, epsilon_, levels_.back() );
+        while( levels_.back().keys.size() > 1 )
+        {
+            level up( alloc_ );
+            fit( levels_.back().keys.data(), levels_.back().keys.size(), inner_epsilon, up );
+            levels_.push_back( std::move( up ) );
+        }
+    }
+
+    // First element not less than key.
+    const_iterator lower_bound( const value_type& key ) const
+    {
+        return position( isa::dispatch( isa_, [&]( auto tag ){ return rank( key, tag ); } ) );
+    }
+
+    const_iterator find( const value_type& key ) const
+    {
+        size_t pos = isa::dispatch( isa_, [&]( auto tag ){ return rank( key, tag ); } );
+        key_less< value_type > less;
+        if( pos < ref_.size() && !less( key, ref_[ pos ] ) )
+        {
+            return position( pos );
+        }
+        return ref_.end();
+    }
+
+    template< typename InputIt, typename OutputIt >
+    OutputIt lower_bound_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return std::transform( first, last, out, [&]( const value_type& key ){ return lower_bound( key ); } );
+    }
+
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return std::transform( first, last, out, [&]( const value_type& key ){ return find( key ); } );
+    }
+
+    // ref_ is sorted, so its own order is the sorted order.
+    using sorted_iterator = const_iterator;
+
+    sorted_iterator sorted_begin() const
+    {
+        return ref_.begin();
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        return ref_.end();
+    }
+
+    // Elements equal to key.
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const value_type& key ) const
+    {
+        size_t first = isa::dispatch( isa_, [&]( auto tag ){ return rank( key, tag ); } );
+        size_t last = detail::gallop_upper_bound( key, ref_.data(), first, ref_.size() );
+        return std::make_pair( position( first ), position( last ) );
+    }
+
+    // Elements in [lo, hi).
+    std::pair< sorted_iterator, sorted_iterator > sorted_range( const value_type& lo, const value_type& hi ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag )
+        {
+            size_t first = rank( lo, tag );
+            size_t last = std::max( first, rank( hi, tag ) );
+            return std::make_pair( position( first ), position( last ) );
+        });
+    }
+
+    // Number of elements in [lo, hi).
+    size_t count( const value_type& lo, const value_type& hi ) const
+    {
+        auto r = sorted_range( lo, hi );
+        return r.second - r.first;
+    }
+
+    // Number of model levels and segments in the bottom one.
+    size_t levels() const
+    {
+        return levels_.size();
+    }
+
+    size_t segments() const
+    {
+        return levels_.empty() ? 0 : levels_.front().keys.size();
+    }
+
+    // Bytes of model.
+    size_t model_size() const
+    {
+        size_t ret = 0;
+        for( const level& lv : levels_ )
+        {
+            ret += lv.keys.size() * ( sizeof( value_type ) + 2 * sizeof( double ) );
+        }
+        return ret;
+    }
+
+    // Bytes of the index, without the vector: the model as allocated.
+    size_t memory_usage() const
+    {
+        size_t ret = levels_.capacity() * sizeof( level );
+        for( const level& lv : levels_ )
+        {
+            ret += lv.keys.capacity() * sizeof( value_type ) +
+                   ( lv.slope.capacity() + lv.intercept.capacity() ) * sizeof( double );
+        }
+        return ret;
+    }
+
+    // Writes the built index to path, for load() to read it back instead of
+    // building. The model is small, so load() copies it.
+    void save( const std::string& path ) const
+    {
+        std::vector< uint64_t > sizes;
+        std::vector< value_type > keys;
+        std::vector< double > slope;
+        std::vector< double > intercept;
+        for( const level& lv : levels_ )
+        {
+            sizes.push_back( lv.keys.size() );
+            keys.insert( keys.end(), lv.keys.begin(), lv.keys.end() );
+            slope.insert( slope.end(), lv.slope.begin(), lv.slope.end() );
+            intercept.insert( intercept.end(), lv.intercept.begin(), lv.intercept.end() );
+        }
+
+        image_writer image( "learned_index", ref_, size_t() );
+        image.param( 0, epsilon_ );
+        image.param( 1, size_ );
+        image.section( sizes.data(), sizes.size() );
+        image.section( keys.data(), keys.size() );
+        image.section( slope.data(), slope.size() );
+        image.section( intercept.data(), intercept.size() );
+        image.save( path );
+    }
+
+    // Uses the image at path in place of build_index(). Throws image_error
+    // unless it is an image of this index type built from the same data.
+    void load( const std::string& path )
+    {
+        image_reader image( path, "learned_index", ref_, size_t() );
+        std::vector< uint64_t > sizes;
+        std::vector< value_type > keys;
+        std::vector< double > slope;
+        std::vector< double > intercept;
+        image.copy< uint64_t >( 0, std::back_inserter( sizes ) );
+        image.copy< value_type >( 1, std::back_inserter( keys ) );
+        image.copy< double >( 2, std::back_inserter( slope ) );
+        image.copy< double >( 3, std::back_inserter( intercept ) );
+
+        size_t total = 0;
+        for( uint64_t size : sizes )
+        {
+            total += size;
+        }
+        if( sizes.empty() || 1 != sizes.back() || total != keys.size() ||
+            total != slope.size() || total != intercept.size() || image.param( 1 ) > ref_.size() )
+        {
+            throw image_error( path + " does not match the index layout" );
+        }
+
+        levels_.assign( sizes.size(), level( alloc_ ) );
+        size_t first = 0;
+        for( size_t l = 0; l < sizes.size(); ++l )
+        {
+            size_t last = first + sizes[ l ];
+            levels_[ l ].keys.assign( keys.begin() + first, keys.begin() + last );
+            levels_[ l ].slope.assign( slope.begin() + first, slope.begin() + last );
+            levels_[ l ].intercept.assign( intercept.begin() + first, intercept.begin() + last );
+            first = last;
+        }
+        epsilon_ = image.param( 0 );
+        size_ = image.param( 1 );
+    }
+
+    isa::level simd_level() const
+    {
+        return isa_;
+    }
+
+private:
+    // Segments of one model level, by their first key.
+    struct level
+    {
+        explicit level( const allocator_type& alloc ) : keys( alloc ), slope( alloc ), intercept( alloc ) {}
+
+        std::vector< value_type, allocator_type > keys;
+        std::vector< double, detail::rebind_alloc< allocator_type, double > > slope;
+        std::vector< double, detail::rebind_alloc< allocator_type, double > > intercept;
+    };
+
+    const std::vector< value_type >& ref_;
+    isa::level isa_;
+    size_t epsilon_;
+    allocator_type alloc_;
+    // Elements of ref_ before the NaNs.
+    size_t size_ = 0;
+    // Bottom level first.
+    std::vector< level > levels_;
+
+    static bool is_nan( const value_type& val )
+    {
+        return val != val;
+    }
+
+    static double predict( const level& lv, size_t seg, const value_type& key )
+    {
+        return lv.intercept[ seg ] +
+               lv.slope[ seg ] * ( static_cast< double >( key ) - static_cast< double >( lv.keys[ seg ] ) );
+    }
+
+    // Greedy shrinking cone: a segment is anchored on its first key and
+    // keeps the range of slopes that predict every key since within epsilon
+    // of its position (the first of its duplicates). The first key that no
+    // slope fits starts the next segment.
+    static void fit( const value_type* data, size_t size, size_t epsilon, level& out )
+    {
+        double lo = 0;
+        double hi = 0;
+        size_t first = 0;
+        auto close = [&]()
+        {
+            out.slope.push_back( std::numeric_limits< double >::infinity() == hi ? 0 : ( lo + hi ) / 2 );
+        };
+
+        for( size_t i = 0; i < size; ++i )
+        {
+            if( i > 0 && !( data[ i - 1 ] < data[ i ] ) )
+            {
+                continue;
+            }
+            if( !out.keys.empty() )
+            {
+                double dx = static_cast< double >( data[ i ] ) - static_cast< double >( data[ first ] );
+                double rise = static_cast< double >( i ) - static_cast< double >( first );
+                double min = ( rise - epsilon ) / dx;
+                double max = ( rise + epsilon ) / dx;
+                if( dx > 0 && min <= hi && max >= lo )
+                {
+                    lo = std::max( lo, min );
+                    hi = std::min( hi, max );
+                    continue;
+                }
+                close();
+            }
+            out.keys.push_back( data[ i ] );
+            out.intercept.push_back( static_cast< double >( i ) );
+            first = i;
+            lo = 0;
+            hi = std::numeric_limits< double >::infinity();
+        }
+        if( !out.keys.empty() )
+        {
+            close();
+        }
+        else
+        {
+            // Empty data still gets a segment, a lookup always has one.
+            out.keys.push_back( value_type() );
+            out.slope.push_back( 0 );
+            out.intercept.push_back( 0 );
+        }
+    }
+
+    // lower_bound position of key in data, predicted at about pos. Counts
+    // the keys less than key in the window around pos. The model is only
+    // off by more than epsilon around duplicates or after rounding: then
+    // the count hits the window edge and a plain lower_bound finishes.
+    template< typename Isa_T >
+    static size_t search( const value_type& key, const value_type* data, size_t size,
+                          double pos, size_t epsilon )
+    {
+        using index = smart_index< value_type, Isa_T >;
+        key_less< value_type > less;
+
+        double first = pos - static_cast< double >( epsilon );
+        double last = pos + static_cast< double >( epsilon ) + 2;
+        size_t lo = first > 0 ? std::min( size, static_cast< size_t >( std::min( first, 1e18 ) ) ) : 0;
+        size_t hi = last > 0 ? std::min( size, static_cast< size_t >( std::min( last, 1e18 ) ) ) : 0;
+
+        size_t ret = lo;
+        size_t i = lo;
+        for( ; i + index::array_size <= hi; i += index::array_size )
+        {
+            ret += index::compare( key, data + i );
+        }
+        for( ; i < hi; ++i )
+        {
+            ret += less( data[ i ], key );
+        }
+
+        if( ret == hi && hi < size && less( data[ hi ], key ) )
+        {
+            return std::lower_bound( data + hi, data + size, key, less ) - data;
+        }
+        if( ret == lo && lo > 0 && !less( data[ lo - 1 ], key ) )
+        {
+            return std::lower_bound( data, data + lo, key, less ) - data;
+        }
+        return ret;
+    }
+
+    // Sorted position of lower_bound( key ).
+    template< typename Isa_T >
+    size_t rank( const value_type& key, Isa_T ) const
+    {
+        if( is_nan( key ) || 0 == size_ )
+        {
+            return size_;
+        }
+
+        key_less< value_type > less;
+        size_t seg = 0;
+        for( size_t l = levels_.size() - 1; l > 0; --l )
+        {
+            const level& below = levels_[ l - 1 ];
+            size_t size = below.keys.size();
+            size_t pos = search< Isa_T >( key, below.keys.data(), size,
+                                          predict( levels_[ l ], seg, key ), inner_epsilon );
+            // Segment of the level below covering key: the last one
+            // starting at or before it.
+            seg = ( pos < size && !less( key, below.keys[ pos ] ) ) ? pos : ( pos > 0 ? pos - 1 : 0 );
+        }
+        return search< Isa_T >( key, ref_.data(), size_, predict( levels_[ 0 ], seg, key ), epsilon_ );
+    }
+
+    const_iterator position( size_t pos ) const
+    {
+        auto ret = ref_.begin();
+        std::advance( ret, pos );
+        return ret;
+    }
+};
+
+} // namespace vecidx
+
+#endif // VECIDX_LEARNED_INDEX_H
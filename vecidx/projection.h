@@ -0,0 +1,197 @@
+#ifndef VECIDX_PROJECTION_H
+#define VECIDX_PROJECTION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <tuple>
+#include <iterator>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+#include "smart_step.h"
+
+namespace vecidx {
+
+// Projections of a record to its key, for projected_index.
+
+// One member: member< trade, uint64_t, &trade::time >.
+template< typename Record_T, typename Field_T, Field_T Record_T::*Member_V >
+struct member
+{
+    const Field_T& operator()( const Record_T& record ) const
+    {
+        return record.*Member_V;
+    }
+};
+
+// Several, compared in order: members< member< ... >, member< ... > >.
+template< typename... Proj_T >
+struct members
+{
+    template< typename Record_T >
+    auto operator()( const Record_T& record ) const
+        -> std::tuple< typename std::decay< decltype( Proj_T()( record ) ) >::type... >
+    {
+        return std::make_tuple( Proj_T()( record )... );
+    }
+};
+
+namespace detail {
+
+// The first column of a key, the one the SIMD index searches.
+template< typename Key_T >
+struct leading_column
+{
+    using type = Key_T;
+    static const Key_T& get( const Key_T& key ) { return key; }
+};
+
+template< typename Lead_T, typename... Rest_T >
+struct leading_column< std::tuple< Lead_T, Rest_T... > >
+{
+    using type = Lead_T;
+    static const Lead_T& get( const std::tuple< Lead_T, Rest_T... >& key ) { return std::get< 0 >( key ); }
+};
+
+template< typename Record_T, typename Proj_T >
+using projected_key = typename std::decay< decltype( std::declval< const Proj_T& >()( std::declval< const Record_T& >() ) ) >::type;
+
+template< typename Record_T, typename Proj_T >
+using leading_key = typename leading_column< projected_key< Record_T, Proj_T > >::type;
+
+} // namespace detail
+
+// Index over a vector of records, by the key Proj_T projects them to: a
+// member, or a tuple of members. The leading column of every record is
+// copied into a dense key vector, which Index_T, a smart_step by default,
+// searches with its SIMD kernels; the records with an equal leading key
+// are then told apart by the rest of the key. ref_ must be sorted by the
+// key, and the leading column be one of the types smart_index covers.
+//
+//     struct trade { uint64_t time; uint32_t id; double price; };
+//     using by_time_id = vecidx::members< vecidx::member< trade, uint64_t, &trade::time >,
+//                                         vecidx::member< trade, uint32_t, &trade::id > >;
+//     vecidx::projected_index< trade, by_time_id > index( trades );
+//     index.build_index();
+//     auto it = index.find( std::make_tuple( time, id ) );
+template< typename Record_T, typename Proj_T,
+          typename Index_T = smart_step_auto< uint32_t, detail::leading_key< Record_T, Proj_T > > >
+class projected_index
+{
+public:
+    using record_type     = Record_T;
+    using key_type        = detail::projected_key< Record_T, Proj_T >;
+    using leading_type    = detail::leading_key< Record_T, Proj_T >;
+    using index_type      = Index_T;
+    using const_iterator  = typename std::vector< record_type >::const_iterator;
+    using sorted_iterator = const_iterator;
+
+    static_assert( std::is_arithmetic< leading_type >::value, "the leading key column must be an integer or floating point type" );
+
+    projected_index( const std::vector< record_type >& ref, Proj_T proj = Proj_T() )
+        : ref_( ref ), proj_( proj ), index_( column_ ) {}
+
+    projected_index( const projected_index& ) = delete;
+    projected_index& operator=( const projected_index& ) = delete;
+
+    void build_index()
+    {
+        column_.resize( ref_.size() );
+        for( size_t i = 0; i < ref_.size(); ++i )
+        {
+            column_[ i ] = leading( proj_( ref_[ i ] ) );
+        }
+        index_.build_index();
+    }
+
+    const_iterator find( const key_type& key ) const
+    {
+        auto r = equal_range( key );
+        return r.first != r.second ? r.first : ref_.end();
+    }
+
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        for( ; first != last; ++first )
+        {
+            *out++ = find( *first );
+        }
+        return out;
+    }
+
+    sorted_iterator sorted_begin() const
+    {
+        return ref_.begin();
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        return ref_.end();
+    }
+
+    // Records whose key equals key: the run of the leading column from the
+    // index, narrowed by the other columns.
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const key_type& key ) const
+    {
+        auto lead = index_.equal_range( leading( key ) );
+        const_iterator first = ref_.begin() + std::distance( index_.sorted_begin(), lead.first );
+        const_iterator last = ref_.begin() + std::distance( index_.sorted_begin(), lead.second );
+        return tie_break( first, last, key, std::integral_constant< bool, !std::is_same< key_type, leading_type >::value >() );
+    }
+
+    size_t count( const key_type& key ) const
+    {
+        auto r = equal_range( key );
+        return r.second - r.first;
+    }
+
+    // The leading column the index searches.
+    const std::vector< leading_type >& column() const
+    {
+        return column_;
+    }
+
+    const index_type& index() const
+    {
+        return index_;
+    }
+
+    // Bytes of the column and the index over it, without the records.
+    size_t memory_usage() const
+    {
+        return column_.capacity() * sizeof( leading_type ) + index_.memory_usage();
+    }
+
+private:
+    const std::vector< record_type >& ref_;
+    Proj_T proj_;
+    std::vector< leading_type > column_;
+    index_type index_;
+
+    static const leading_type& leading( const key_type& key )
+    {
+        return detail::leading_column< key_type >::get( key );
+    }
+
+    // A key of one column is all leading column.
+    std::pair< const_iterator, const_iterator > tie_break( const_iterator first, const_iterator last,
+                                                           const key_type&, std::false_type ) const
+    {
+        return std::make_pair( first, last );
+    }
+
+    std::pair< const_iterator, const_iterator > tie_break( const_iterator first, const_iterator last,
+                                                           const key_type& key, std::true_type ) const
+    {
+        first = std::partition_point( first, last, [&]( const record_type& r ){ return proj_( r ) < key; } );
+        last = std::partition_point( first, last, [&]( const record_type& r ){ return !( key < proj_( r ) ); } );
+        return std::make_pair( first, last );
+    }
+};
+
+} // namespace vecidx
+
+#endif // VECIDX_PROJECTION_H
@@ -0,0 +1,62 @@
+#ifndef VECIDX_RANK_ITERATOR_H
+#define VECIDX_RANK_ITERATOR_H
+
+#include <cstddef>
+#include <iterator>
+
+namespace vecidx {
+
+// Random access iterator over the elements of an index in sorted order,
+// the rank-th being index->nth( rank ). It dereferences to the key; base()
+// is the element's iterator in the indexed vector.
+template< typename Index_T >
+class rank_iterator
+{
+public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type        = typename Index_T::vector_type;
+    using difference_type   = std::ptrdiff_t;
+    using pointer           = const value_type*;
+    using reference         = const value_type&;
+    using base_type         = typename Index_T::const_iterator;
+
+    rank_iterator() = default;
+    rank_iterator( const Index_T* index, size_t rank ) : index_( index ), rank_( rank ) {}
+
+    base_type base() const { return index_->nth( rank_ ); }
+    size_t rank() const { return rank_; }
+
+    reference operator*() const { return *base(); }
+    pointer operator->() const { return &*base(); }
+    reference operator[]( difference_type n ) const { return *( *this + n ); }
+
+    rank_iterator& operator++() { ++rank_; return *this; }
+    rank_iterator& operator--() { --rank_; return *this; }
+    rank_iterator operator++( int ) { rank_iterator ret = *this; ++rank_; return ret; }
+    rank_iterator operator--( int ) { rank_iterator ret = *this; --rank_; return ret; }
+    rank_iterator& operator+=( difference_type n ) { rank_ += n; return *this; }
+    rank_iterator& operator-=( difference_type n ) { rank_ -= n; return *this; }
+
+    friend rank_iterator operator+( rank_iterator it, difference_type n ) { return it += n; }
+    friend rank_iterator operator+( difference_type n, rank_iterator it ) { return it += n; }
+    friend rank_iterator operator-( rank_iterator it, difference_type n ) { return it -= n; }
+    friend difference_type operator-( const rank_iterator& lhs, const rank_iterator& rhs )
+    {
+        return static_cast< difference_type >( lhs.rank_ ) - static_cast< difference_type >( rhs.rank_ );
+    }
+
+    friend bool operator==( const rank_iterator& lhs, const rank_iterator& rhs ) { return lhs.rank_ == rhs.rank_; }
+    friend bool operator!=( const rank_iterator& lhs, const rank_iterator& rhs ) { return lhs.rank_ != rhs.rank_; }
+    friend bool operator<( const rank_iterator& lhs, const rank_iterator& rhs ) { return lhs.rank_ < rhs.rank_; }
+    friend bool operator>( const rank_iterator& lhs, const rank_iterator& rhs ) { return lhs.rank_ > rhs.rank_; }
+    friend bool operator<=( const rank_iterator& lhs, const rank_iterator& rhs ) { return lhs.rank_ <= rhs.rank_; }
+    friend bool operator>=( const rank_iterator& lhs, const rank_iterator& rhs ) { return lhs.rank_ >= rhs.rank_; }
+
+private:
+    const Index_T* index_ = nullptr;
+    size_t rank_ = 0;
+};
+
+} // namespace vecidx
+
+#endif // VECIDX_RANK_ITERATOR_H
@@ -3,166 +3,453 @@
 
 #include <cstdint>
 #include <vector>
-#include <iostream>
 #include <functional>
 #include <algorithm>
 #include <numeric>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+
+#include "allocator.h"
+#include "batch.h"
+#include "build.h"
+#include "coro.h"
+#include "rank_iterator.h"
+#include "storage.h"
 
 namespace vecidx {
 
+// Eytzinger (BFS) layout: node k has children 2k and 2k+1, node 1 is the
+// root. By default the keys themselves live in the layout, next to their
+// positions in vector_, so a search only touches vector_ once for the
+// result; position_only trades that for a smaller index.
 template< typename Size_T,
           typename VecType_T,
-          typename VecComp_T = std::less<VecType_T> >
+          typename VecComp_T = std::less<VecType_T>,
+          typename Storage_T = key_inline,
+          typename Alloc_T = aligned_allocator< VecType_T > >
 class search_index
 {
 public:
     using size_type      = Size_T;
     using vector_type    = VecType_T;
     using compare_type   = VecComp_T;
+    using storage_type   = Storage_T;
+    using allocator_type = Alloc_T;
     using const_iterator = typename std::vector< vector_type >::const_iterator;
+    using sorted_iterator = rank_iterator< search_index >;
+
+    // Packed blocks hold sorted runs; the Eytzinger order spreads a block's
+    // slots over the whole key range, so there is nothing to compress.
+    static_assert( !std::is_same< Storage_T, packed >::value,
+                   "search_index takes position_only or key_inline storage, packed is for vector_index and tree_index" );
 
-    search_index( const std::vector<VecType_T>& vec ) : vector_(vec) {}
+    search_index( const std::vector<VecType_T>& vec, const Alloc_T& alloc = Alloc_T() )
+        : vector_(vec), index_(vec, alloc) {}
 
     void build_index()
     {
-        std::vector< size_type > idx;
-        idx.resize( vector_.size() );
-        std::iota( idx.begin(), idx.end(), 0 );
-
-        compare_type comp;
-        std::sort( idx.begin(), idx.end(),
-                   [&]( const size_type& lhs, const size_type& rhs )
-                   {
-                       return comp( vector_[lhs], vector_[rhs] );
-                   });
+        std::vector< size_type > idx = detail::sorted_permutation< size_type >( vector_, compare_type() );
 
-        index_.clear();
-        index_.reserve( idx.size() );
-        
-
-        size_t pos = 0;
-        size_type size = static_cast<size_type>( idx.size() );
-        index_.push_back( static_cast<size_type>( idx.size() / 2 ) );
-
-        size >>= 1;
-        size_t much = 1;
-        while( size )
+        // Slot 0 is never used, it makes the root start at 1.
+        std::vector< size_type > layout( idx.empty() ? 0 : idx.size() + 1, 0 );
+#if defined( VECIDX_OMP_TASKS )
+        int threads = build_threads( idx.size() );
+        if( threads > 1 )
         {
-            for( size_t i = 0; i < much; ++i )
+            // A task per subtree down to a few per thread.
+            size_t depth = 2;
+            for( int t = 1; t < threads; t *= 2 )
             {
-                //std::cout << (int)size << ", " << (int)size/2 << "\n";
-                index_.push_back( static_cast<size_type>( index_[ pos ] - size/2 - 1 ) );
-                index_.push_back( static_cast<size_type>( index_[ pos ] + size/2 + 1 ) );
-                ++pos;
+                ++depth;
             }
-            size >>= 1;
-            much <<= 1;
+            VECIDX_OMP( parallel num_threads( threads ) )
+            VECIDX_OMP( single )
+            build_index( idx, layout, 0, 1, depth );
+        }
+        else
+#endif
+        {
+            size_t pos = 0;
+            build_index( idx, layout, pos, 1 );
         }
+        index_.assign( layout );
+    }
 
-        std::transform( index_.begin(), index_.end(), index_.begin(), [ & ]( size_type val ) { return idx[ val ]; } );
+    // Writes the built index to path, for load() to map it back instead of
+    // building.
+    void save( const std::string& path ) const
+    {
+        image_writer image( "search_index", vector_, size_type() );
+        index_.save( image );
+        image.save( path );
+    }
 
-        //std::for_each( index_.begin(), index_.end(), []( size_type val ) { std::cout << static_cast<int>( val ) << ", "; } );
-        //std::cout << "\n\n";
-        //std::for_each( index_.begin(), index_.end(), [&]( size_type val ) { std::cout << static_cast<int>( vector_[val] ) << ", "; } );
-        //std::cout << "\n\n";
+    // Uses the image at path in place of build_index(), mapped and not
+    // copied. Throws image_error unless it is an image of this index type
+    // built from the same data.
+    void load( const std::string& path )
+    {
+        image_reader image( path, "search_index", vector_, size_type() );
+        index_.load( image, 0 );
+    }
+
+    // Bytes of the index, without the vector.
+    size_t memory_usage() const
+    {
+        return index_.memory_usage();
     }
 
     const vector_type& at( size_t num )
     {
-        return vector_[ index_[num] ];
+        return index_.key( num + 1 );
     }
 
+    // First element not less than key.
     const_iterator lower_bound( const vector_type& key ) const
     {
-        size_t pos = 0;
-        while( pos < index_.size() )
+        return position( lower_bound_slot( key ) );
+    }
+
+    // First element greater than key.
+    const_iterator upper_bound( const vector_type& key ) const
+    {
+        return position( upper_bound_slot( key ) );
+    }
+
+    const_iterator find( const vector_type& key ) const
+    {
+        compare_type comp;
+        size_t k = 1;
+        while( k < index_.size() )
         {
-            int retComp = comp( vector_[ index_[ pos ] ], key );
-            if( 0 == retComp )
-            {
-                auto ret = vector_.cbegin();
-                std::advance( ret, index_[ pos ] );
-                return ret;
-            }
+            prefetch_block( k );
+            k = 2 * k + comp( index_.key( k ), key );
+        }
+        k >>= ffs( ~k );
 
-            if( retComp < 0 )
+        if( 0 != k && !comp( key, index_.key( k ) ) )
+        {
+            return position( k );
+        }
+        return vector_.cend();
+    }
+
+#if defined( VECIDX_COROUTINES )
+    // find() as a coroutine for a lookup_scheduler: below the top levels,
+    // which stay cached, it prefetches every node before reading it and
+    // suspends in between; with position_only the slot and then its key.
+    lookup< const_iterator > find_coro( vector_type key ) const
+    {
+        compare_type comp;
+        size_t k = 1;
+        while( k < index_.size() )
+        {
+            if( k >= hot_slots )
             {
-                pos += pos + 1;
+                if( index_.indirect_keys )
+                {
+                    index_.touch_slot( k );
+                    co_await std::suspend_always();
+                }
+                index_.touch( k );
+                co_await std::suspend_always();
             }
-            else
+            k = 2 * k + comp( index_.key( k ), key );
+        }
+        k >>= ffs( ~k );
+
+        if( 0 != k && !comp( key, index_.key( k ) ) )
+        {
+            co_return position( k );
+        }
+        co_return vector_.cend();
+    }
+#endif
+
+    // Element at sorted position rank. The walk down to its slot costs a
+    // search, sorted order is not what this layout is for.
+    const_iterator nth( size_t rank ) const
+    {
+        if( rank >= size() )
+        {
+            return vector_.cend();
+        }
+        size_t k = 1;
+        for( ;; )
+        {
+            size_t left = subtree_size( 2 * k, index_.size() );
+            if( rank == left )
             {
-                pos += pos + 2;
+                return position( k );
             }
+            k = 2 * k + ( rank > left );
+            rank -= ( rank > left ) ? left + 1 : 0;
         }
-        return vector_.cend();
+    }
+
+    sorted_iterator sorted_begin() const
+    {
+        return sorted_iterator( this, 0 );
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        return sorted_iterator( this, size() );
+    }
 
+    // Elements equal to key.
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const vector_type& key ) const
+    {
+        return std::make_pair( sorted_iterator( this, slot_rank( lower_bound_slot( key ) ) ),
+                               sorted_iterator( this, slot_rank( upper_bound_slot( key ) ) ) );
+    }
 
-        //for( size_type pos : index_ )
-        //{
-        //    if( 0 == comp( vector_[ pos ], key ) )
-        //    {
-        //        auto ret = vector_.cbegin();
-        //        std::advance( ret, pos );
-        //        return ret;
-        //    }
-        //}
-        //return vector_.cend();
+    // Elements in [lo, hi).
+    std::pair< sorted_iterator, sorted_iterator > sorted_range( const vector_type& lo, const vector_type& hi ) const
+    {
+        size_t first = slot_rank( lower_bound_slot( lo ) );
+        size_t last = std::max( first, slot_rank( lower_bound_slot( hi ) ) );
+        return std::make_pair( sorted_iterator( this, first ), sorted_iterator( this, last ) );
+    }
 
+    // Number of elements in [lo, hi).
+    size_t count( const vector_type& lo, const vector_type& hi ) const
+    {
+        auto r = sorted_range( lo, hi );
+        return r.second - r.first;
     }
 
-    const_iterator find( const vector_type& key ) const
+    // Writes lower_bound( key ) of every key in [first, last) to out.
+    template< typename InputIt, typename OutputIt >
+    OutputIt lower_bound_batch( InputIt first, InputIt last, OutputIt out ) const
     {
-        compare_type comp;
-        size_t pos = 0;
-        while( pos < index_.size() )
-        {
-            if( comp( key, vector_[ index_[ pos ] ] ) )
+        detail::for_each_group< vector_type >( first, last,
+            [&]( const vector_type* keys, size_t count )
             {
-                // key < vector_[ index_[ pos ] ]
-                pos += pos + 1;
-            }
-            else if( comp( vector_[ index_[ pos ] ], key ) )
-            {
-                // vector_[ index_[ pos ] ] < key
-                pos += pos + 2;
-            }
-            else
+                size_t k[ batch_group_size ];
+                lower_bound_group( keys, count, k );
+                for( size_t g = 0; g < count; ++g )
+                {
+                    *out++ = position( k[ g ] );
+                }
+            });
+        return out;
+    }
+
+    // Writes find( key ) of every key in [first, last) to out.
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        compare_type comp;
+        detail::for_each_group< vector_type >( first, last,
+            [&]( const vector_type* keys, size_t count )
             {
-                // vector_[ index_[ pos ] ] == key
-                auto ret = vector_.cbegin();
-                std::advance( ret, index_[ pos ] );
-                return ret;
-            }
-        }
-        return vector_.cend();
-        //auto pos = lower_bound( key );
-        //if( vector_.cend() != pos &&
-        //    key == *pos )
-        //{
-        //    return pos;
-        //}
-        //return vector_.cend();
+                size_t k[ batch_group_size ];
+                lower_bound_group( keys, count, k );
+                for( size_t g = 0; g < count; ++g )
+                {
+                    bool found = 0 != k[ g ] && !comp( keys[ g ], index_.key( k[ g ] ) );
+                    *out++ = found ? position( k[ g ] ) : vector_.cend();
+                }
+            });
+        return out;
     }
 
 private:
+    // The 16 descendants four levels below node k are slots 16k..16k+15:
+    // contiguous, and line aligned for keys of 4 bytes or more.
+    static const size_t prefetch_block_size = 16;
+    // Slots of the top ten levels, which find_coro() reads without a
+    // suspend: every lookup passes them.
+    static const size_t hot_slots = 1024;
+
     const std::vector< vector_type >& vector_;
-    std::vector< size_type > index_;
+    index_storage< storage_type, size_type, vector_type, allocator_type > index_;
 
-    void sort_index( const std::vector< size_type >& idx, size_t first, size_t last )
+    // In-order walk of the layout hands out the sorted elements.
+    static void build_index( const std::vector< size_type >& idx, std::vector< size_type >& layout,
+                             size_t& pos, size_t k )
     {
-        size_t size = last - first;
-        if( size < 2 )
+        if( k < layout.size() )
+        {
+            build_index( idx, layout, pos, 2 * k );
+            layout[ k ] = idx[ pos++ ];
+            build_index( idx, layout, pos, 2 * k + 1 );
+        }
+    }
+
+    // Slots of the subtree of k in a layout of size slots: full levels down
+    // to the one above the last, then whatever the last level has of it.
+    static size_t subtree_size( size_t k, size_t size )
+    {
+        if( k >= size )
+        {
+            return 0;
+        }
+        size_t below = depth( size - 1 ) - depth( k );
+        size_t first = k << below;
+        size_t last = std::min( ( k + 1 ) << below, size );
+        return ( size_t( 1 ) << below ) - 1 + ( last > first ? last - first : 0 );
+    }
+
+#if defined( VECIDX_OMP_TASKS )
+    // The same walk with the top depth levels split into tasks, each told
+    // where its subtree starts in idx.
+    static void build_index( const std::vector< size_type >& idx, std::vector< size_type >& layout,
+                             size_t first, size_t k, size_t depth )
+    {
+        if( 0 == depth )
+        {
+            build_index( idx, layout, first, k );
             return;
+        }
+        if( k < layout.size() )
+        {
+            size_t left = subtree_size( 2 * k, layout.size() );
+            layout[ k ] = idx[ first + left ];
+            VECIDX_OMP( task shared( idx, layout ) )
+            build_index( idx, layout, first, 2 * k, depth - 1 );
+            build_index( idx, layout, first + left + 1, 2 * k + 1, depth - 1 );
+            VECIDX_OMP( taskwait )
+        }
+    }
+#endif
+
+    // With position_only only the positions are prefetched, the keys they
+    // point to are scattered.
+    void prefetch_block( size_t k ) const
+    {
+        // Integer arithmetic: the block may be past the end of the layout,
+        // which is harmless for a prefetch but not for a pointer.
+        const size_t slot_size = decltype( index_ )::slot_size;
+        uintptr_t addr = reinterpret_cast< uintptr_t >( index_.data() ) +
+                         k * prefetch_block_size * slot_size;
+        for( size_t line = 0; line < prefetch_block_size * slot_size; line += cache_line_size )
+        {
+            prefetch( reinterpret_cast< const void* >( addr + line ) );
+        }
+    }
+
+    // The search leaves k as the path taken, one bit per level, with a 1 for
+    // every step right. The answer is the last node where it went left:
+    // drop the trailing ones and that left step.
+    static size_t ffs( size_t val )
+    {
+#if defined( _MSC_VER )
+        unsigned long bit;
+        return _BitScanForward64( &bit, val ) ? bit + 1 : 0;
+#else
+        return __builtin_ffsll( static_cast< long long >( val ) );
+#endif
+    }
+
+    // Level of slot k, the root being level 0.
+    static size_t depth( size_t k )
+    {
+#if defined( _MSC_VER )
+        unsigned long bit;
+        _BitScanReverse64( &bit, k );
+        return bit;
+#else
+        return 63 - __builtin_clzll( static_cast< unsigned long long >( k ) );
+#endif
+    }
+
+    size_t size() const
+    {
+        return index_.size() > 0 ? index_.size() - 1 : 0;
+    }
+
+    // Slot of lower_bound( key ) and of upper_bound( key ), 0 for none.
+    size_t lower_bound_slot( const vector_type& key ) const
+    {
+        compare_type comp;
+        size_t k = 1;
+        while( k < index_.size() )
+        {
+            prefetch_block( k );
+            k = 2 * k + comp( index_.key( k ), key );
+        }
+        return k >> ffs( ~k );
+    }
 
-        size_t middle = size/2;
-        index_.push_back( idx[ (middle - first)/2 ] );
-        index_.push_back( idx[ (last - middle)/2 ] );
+    size_t upper_bound_slot( const vector_type& key ) const
+    {
+        compare_type comp;
+        size_t k = 1;
+        while( k < index_.size() )
+        {
+            prefetch_block( k );
+            k = 2 * k + !comp( key, index_.key( k ) );
+        }
+        return k >> ffs( ~k );
+    }
+
+    // Sorted position of slot k, size() for slot 0: its left subtree, plus
+    // every ancestor it is right of and that ancestor's left subtree.
+    size_t slot_rank( size_t k ) const
+    {
+        if( 0 == k )
+        {
+            return size();
+        }
+        size_t ret = subtree_size( 2 * k, index_.size() );
+        for( ; k > 1; k /= 2 )
+        {
+            if( k & 1 )
+            {
+                ret += subtree_size( k - 1, index_.size() ) + 1;
+            }
+        }
+        return ret;
+    }
 
-        sort_index( idx, first, middle );
-        sort_index( idx, middle, last );
+    const_iterator position( size_t k ) const
+    {
+        if( 0 == k )
+        {
+            return vector_.cend();
+        }
+        auto ret = vector_.cbegin();
+        std::advance( ret, index_.position( k ) );
+        return ret;
     }
 
-    const_iterator lower_bound(  );
+    // lower_bound() of count keys in lock-step, leaving the layout slot of
+    // each answer (0 for none) in k.
+    void lower_bound_group( const vector_type* keys, size_t count, size_t* k ) const
+    {
+        compare_type comp;
+        for( size_t g = 0; g < count; ++g )
+        {
+            k[ g ] = 1;
+        }
+
+        bool more = index_.size() > 1;
+        while( more )
+        {
+            more = false;
+            for( size_t g = 0; g < count; ++g )
+            {
+                if( k[ g ] < index_.size() )
+                {
+                    prefetch_block( k[ g ] );
+                    k[ g ] = 2 * k[ g ] + comp( index_.key( k[ g ] ), keys[ g ] );
+                    more = true;
+                }
+            }
+        }
+
+        for( size_t g = 0; g < count; ++g )
+        {
+            k[ g ] >>= ffs( ~k[ g ] );
+        }
+    }
 };
 
 } // namespace vecidx
@@ -3,8 +3,26 @@
 
 #include <immintrin.h>
 #include <x86intrin.h>
+#include <cstdint>
+#include <cmath>
+#include <array>
+#include <vector>
+#include <iterator>
+#include <utility>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <string>
 
-std::ostream& operator<<( std::ostream& out, const __m256i& val )
+#include "isa.h"
+#include "allocator.h"
+#include "batch.h"
+#include "build.h"
+#include "coro.h"
+#include "image.h"
+#include "stats.h"
+
+inline std::ostream& operator<<( std::ostream& out, const __m256i& val )
 {
     const uint32_t* v = reinterpret_cast<const uint32_t*>( &val );
     out << std::hex << "(";
@@ -18,284 +36,1623 @@ std::ostream& operator<<( std::ostream& out, const __m256i& val )
 
 namespace vecidx {
 
-template< typename VecType_T > struct smart_index { };
+// compare() returns how many splitters in cmp are less than key, which is
+// the bucket of key when the splitters are sorted. SSE and AVX2 only have
+// signed integer compares, so unsigned keys are biased by the sign bit
+// first. Floating point keys follow key_less: NaN sorts after every number.
+template< typename VecType_T, typename Isa_T = isa::sse > struct smart_index { };
+
+// Strict weak order of the kernels, for the scalar part of the lookups.
+template< typename VecType_T >
+struct key_less
+{
+    bool operator()( const VecType_T& lhs, const VecType_T& rhs ) const
+    {
+        return lhs < rhs;
+    }
+};
+
+template< typename VecType_T >
+struct nan_last_less
+{
+    bool operator()( const VecType_T& lhs, const VecType_T& rhs ) const
+    {
+        return !std::isnan( lhs ) && ( std::isnan( rhs ) || lhs < rhs );
+    }
+};
+
+template<> struct key_less< float > : nan_last_less< float > {};
+template<> struct key_less< double > : nan_last_less< double > {};
 
-template<> struct smart_index< uint8_t >
+namespace detail {
+// key_less is the plain < of integer keys, their builds may radix sort.
+template< typename VecType_T > struct is_ascending< key_less< VecType_T > > : std::true_type {};
+}
+
+// SSE4.2
+template<> struct smart_index< int8_t, isa::sse >
 {
     using inner_type = __m128i;
-    constexpr static size_t array_size = 16/sizeof(uint8_t);
-    static inline size_t compare( uint8_t key, __m128i cmp ) {
+    constexpr static size_t array_size = 16/sizeof(int8_t);
+    VECIDX_TARGET_SSE static inline size_t compare( int8_t key, __m128i cmp ) {
         uint32_t mask = _mm_movemask_epi8( _mm_cmpgt_epi8( _mm_set1_epi8( key ), cmp ) );
-        return _bit_scan_reverse( mask + 1 );
+        return _mm_popcnt_u32( mask );
+    }
+    VECIDX_TARGET_SSE static inline size_t compare( int8_t key, const int8_t* cmp ) {
+        return compare( key, _mm_loadu_si128( reinterpret_cast< const __m128i* >( cmp ) ) );
     }
 };
 
-template<> struct smart_index< uint16_t >
+template<> struct smart_index< uint8_t, isa::sse >
 {
     using inner_type = __m128i;
-    constexpr static size_t array_size = 16/sizeof(uint16_t);
-    static inline size_t compare( uint16_t key, __m128i cmp ) {
+    constexpr static size_t array_size = 16/sizeof(uint8_t);
+    VECIDX_TARGET_SSE static inline size_t compare( uint8_t key, __m128i cmp ) {
+        const __m128i bias = _mm_set1_epi8( INT8_MIN );
+        __m128i lhs = _mm_xor_si128( _mm_set1_epi8( key ), bias );
+        uint32_t mask = _mm_movemask_epi8( _mm_cmpgt_epi8( lhs, _mm_xor_si128( cmp, bias ) ) );
+        return _mm_popcnt_u32( mask );
+    }
+    VECIDX_TARGET_SSE static inline size_t compare( uint8_t key, const uint8_t* cmp ) {
+        return compare( key, _mm_loadu_si128( reinterpret_cast< const __m128i* >( cmp ) ) );
+    }
+};
+
+template<> struct smart_index< int16_t, isa::sse >
+{
+    using inner_type = __m128i;
+    constexpr static size_t array_size = 16/sizeof(int16_t);
+    VECIDX_TARGET_SSE static inline size_t compare( int16_t key, __m128i cmp ) {
         uint32_t mask = _mm_movemask_epi8( _mm_cmpgt_epi16( _mm_set1_epi16( key ), cmp ) );
-        return _bit_scan_reverse( mask + 1 ) >> 1;
+        return _mm_popcnt_u32( mask ) >> 1;
+    }
+    VECIDX_TARGET_SSE static inline size_t compare( int16_t key, const int16_t* cmp ) {
+        return compare( key, _mm_loadu_si128( reinterpret_cast< const __m128i* >( cmp ) ) );
     }
 };
 
-template<> struct smart_index< uint32_t >
+template<> struct smart_index< uint16_t, isa::sse >
 {
     using inner_type = __m128i;
-    constexpr static size_t array_size = 16/sizeof(uint32_t);
-    static inline size_t compare( uint32_t key, __m128i cmp ) {
+    constexpr static size_t array_size = 16/sizeof(uint16_t);
+    VECIDX_TARGET_SSE static inline size_t compare( uint16_t key, __m128i cmp ) {
+        const __m128i bias = _mm_set1_epi16( INT16_MIN );
+        __m128i lhs = _mm_xor_si128( _mm_set1_epi16( key ), bias );
+        uint32_t mask = _mm_movemask_epi8( _mm_cmpgt_epi16( lhs, _mm_xor_si128( cmp, bias ) ) );
+        return _mm_popcnt_u32( mask ) >> 1;
+    }
+    VECIDX_TARGET_SSE static inline size_t compare( uint16_t key, const uint16_t* cmp ) {
+        return compare( key, _mm_loadu_si128( reinterpret_cast< const __m128i* >( cmp ) ) );
+    }
+};
+
+template<> struct smart_index< int32_t, isa::sse >
+{
+    using inner_type = __m128i;
+    constexpr static size_t array_size = 16/sizeof(int32_t);
+    VECIDX_TARGET_SSE static inline size_t compare( int32_t key, __m128i cmp ) {
         uint32_t mask = _mm_movemask_epi8( _mm_cmpgt_epi32( _mm_set1_epi32( key ), cmp ) );
-        return _bit_scan_reverse( mask + 1 ) >> 2;
+        return _mm_popcnt_u32( mask ) >> 2;
+    }
+    VECIDX_TARGET_SSE static inline size_t compare( int32_t key, const int32_t* cmp ) {
+        return compare( key, _mm_loadu_si128( reinterpret_cast< const __m128i* >( cmp ) ) );
     }
 };
 
-template<> struct smart_index< uint64_t >
+template<> struct smart_index< uint32_t, isa::sse >
 {
     using inner_type = __m128i;
-    constexpr static size_t array_size = 16/sizeof(uint64_t);
-    static inline size_t compare( uint64_t key, __m128i cmp ) {
+    constexpr static size_t array_size = 16/sizeof(uint32_t);
+    VECIDX_TARGET_SSE static inline size_t compare( uint32_t key, __m128i cmp ) {
+        const __m128i bias = _mm_set1_epi32( INT32_MIN );
+        __m128i lhs = _mm_xor_si128( _mm_set1_epi32( key ), bias );
+        uint32_t mask = _mm_movemask_epi8( _mm_cmpgt_epi32( lhs, _mm_xor_si128( cmp, bias ) ) );
+        return _mm_popcnt_u32( mask ) >> 2;
+    }
+    VECIDX_TARGET_SSE static inline size_t compare( uint32_t key, const uint32_t* cmp ) {
+        return compare( key, _mm_loadu_si128( reinterpret_cast< const __m128i* >( cmp ) ) );
+    }
+};
+
+template<> struct smart_index< int64_t, isa::sse >
+{
+    using inner_type = __m128i;
+    constexpr static size_t array_size = 16/sizeof(int64_t);
+    VECIDX_TARGET_SSE static inline size_t compare( int64_t key, __m128i cmp ) {
         uint32_t mask = _mm_movemask_epi8( _mm_cmpgt_epi64( _mm_set1_epi64x( key ), cmp ) );
-        return _bit_scan_reverse( mask + 1 ) >> 3;
+        return _mm_popcnt_u32( mask ) >> 3;
+    }
+    VECIDX_TARGET_SSE static inline size_t compare( int64_t key, const int64_t* cmp ) {
+        return compare( key, _mm_loadu_si128( reinterpret_cast< const __m128i* >( cmp ) ) );
     }
 };
 
-template< typename DUMMY_T, typename VecType_T >
-class smart_step
+template<> struct smart_index< uint64_t, isa::sse >
 {
-public:
-    using value_type    = VecType_T;
-    using const_iterator = typename std::vector< value_type >::const_iterator;
+    using inner_type = __m128i;
+    constexpr static size_t array_size = 16/sizeof(uint64_t);
+    VECIDX_TARGET_SSE static inline size_t compare( uint64_t key, __m128i cmp ) {
+        const __m128i bias = _mm_set1_epi64x( INT64_MIN );
+        __m128i lhs = _mm_xor_si128( _mm_set1_epi64x( key ), bias );
+        uint32_t mask = _mm_movemask_epi8( _mm_cmpgt_epi64( lhs, _mm_xor_si128( cmp, bias ) ) );
+        return _mm_popcnt_u32( mask ) >> 3;
+    }
+    VECIDX_TARGET_SSE static inline size_t compare( uint64_t key, const uint64_t* cmp ) {
+        return compare( key, _mm_loadu_si128( reinterpret_cast< const __m128i* >( cmp ) ) );
+    }
+};
 
-    smart_step( const std::vector< value_type >& ref )
-        : ref_( ref ){}
+template<> struct smart_index< float, isa::sse >
+{
+    using inner_type = __m128;
+    constexpr static size_t array_size = 16/sizeof(float);
+    VECIDX_TARGET_SSE static inline size_t compare( float key, __m128 cmp ) {
+        __m128 k = _mm_set1_ps( key );
+        __m128 nan = _mm_and_ps( _mm_cmpunord_ps( k, k ), _mm_cmpord_ps( cmp, cmp ) );
+        return _mm_popcnt_u32( _mm_movemask_ps( _mm_or_ps( _mm_cmplt_ps( cmp, k ), nan ) ) );
+    }
+    VECIDX_TARGET_SSE static inline size_t compare( float key, const float* cmp ) {
+        return compare( key, _mm_loadu_ps( cmp ) );
+    }
+};
 
-    void build_index()
-    {
-        size_t step = ref_.size() / (array_size + 1);
+template<> struct smart_index< double, isa::sse >
+{
+    using inner_type = __m128d;
+    constexpr static size_t array_size = 16/sizeof(double);
+    VECIDX_TARGET_SSE static inline size_t compare( double key, __m128d cmp ) {
+        __m128d k = _mm_set1_pd( key );
+        __m128d nan = _mm_and_pd( _mm_cmpunord_pd( k, k ), _mm_cmpord_pd( cmp, cmp ) );
+        return _mm_popcnt_u32( _mm_movemask_pd( _mm_or_pd( _mm_cmplt_pd( cmp, k ), nan ) ) );
+    }
+    VECIDX_TARGET_SSE static inline size_t compare( double key, const double* cmp ) {
+        return compare( key, _mm_loadu_pd( cmp ) );
+    }
+};
 
-        const_iterator end = ref_.begin();
-        value_type* pCmp = reinterpret_cast< value_type* >( &cmp_ );
-        for( size_t i = 0; i < array_size; ++i )
-        {
-            std::advance( end, step );
-            *pCmp = *end;
-            ++pCmp;
-        }
-        //std::cout << "Cmp: " << cmp_ << std::endl;
+// AVX2
+template<> struct smart_index< int8_t, isa::avx2 >
+{
+    using inner_type = __m256i;
+    constexpr static size_t array_size = 32/sizeof(int8_t);
+    VECIDX_TARGET_AVX2 static inline size_t compare( int8_t key, __m256i cmp ) {
+        uint32_t mask = _mm256_movemask_epi8( _mm256_cmpgt_epi8( _mm256_set1_epi8( key ), cmp ) );
+        return _mm_popcnt_u32( mask );
     }
+    VECIDX_TARGET_AVX2 static inline size_t compare( int8_t key, const int8_t* cmp ) {
+        return compare( key, _mm256_loadu_si256( reinterpret_cast< const __m256i* >( cmp ) ) );
+    }
+};
 
-    const_iterator find( const value_type& key ) const
-    {
-        size_t i = smart_index< value_type >::compare( key, cmp_ );
-        size_t step = ref_.size() / (array_size + 1);
+template<> struct smart_index< uint8_t, isa::avx2 >
+{
+    using inner_type = __m256i;
+    constexpr static size_t array_size = 32/sizeof(uint8_t);
+    VECIDX_TARGET_AVX2 static inline size_t compare( uint8_t key, __m256i cmp ) {
+        const __m256i bias = _mm256_set1_epi8( INT8_MIN );
+        __m256i lhs = _mm256_xor_si256( _mm256_set1_epi8( key ), bias );
+        uint32_t mask = _mm256_movemask_epi8( _mm256_cmpgt_epi8( lhs, _mm256_xor_si256( cmp, bias ) ) );
+        return _mm_popcnt_u32( mask );
+    }
+    VECIDX_TARGET_AVX2 static inline size_t compare( uint8_t key, const uint8_t* cmp ) {
+        return compare( key, _mm256_loadu_si256( reinterpret_cast< const __m256i* >( cmp ) ) );
+    }
+};
 
-        const_iterator beg = ref_.begin();
-        std::advance( beg, i * step );
-        const_iterator end;
-        if( i == array_size )
-        {
-            end = ref_.end();
-        }
-        else
-        {
-            end = beg;
-            std::advance( end, step );
-            ++end;
-        }
+template<> struct smart_index< int16_t, isa::avx2 >
+{
+    using inner_type = __m256i;
+    constexpr static size_t array_size = 32/sizeof(int16_t);
+    VECIDX_TARGET_AVX2 static inline size_t compare( int16_t key, __m256i cmp ) {
+        uint32_t mask = _mm256_movemask_epi8( _mm256_cmpgt_epi16( _mm256_set1_epi16( key ), cmp ) );
+        return _mm_popcnt_u32( mask ) >> 1;
+    }
+    VECIDX_TARGET_AVX2 static inline size_t compare( int16_t key, const int16_t* cmp ) {
+        return compare( key, _mm256_loadu_si256( reinterpret_cast< const __m256i* >( cmp ) ) );
+    }
+};
 
-        auto first = std::lower_bound( beg, end, key );
-        return (first!=end && !(key<*first)) ? first : ref_.end();
+template<> struct smart_index< uint16_t, isa::avx2 >
+{
+    using inner_type = __m256i;
+    constexpr static size_t array_size = 32/sizeof(uint16_t);
+    VECIDX_TARGET_AVX2 static inline size_t compare( uint16_t key, __m256i cmp ) {
+        const __m256i bias = _mm256_set1_epi16( INT16_MIN );
+        __m256i lhs = _mm256_xor_si256( _mm256_set1_epi16( key ), bias );
+        uint32_t mask = _mm256_movemask_epi8( _mm256_cmpgt_epi16( lhs, _mm256_xor_si256( cmp, bias ) ) );
+        return _mm_popcnt_u32( mask ) >> 1;
     }
+    VECIDX_TARGET_AVX2 static inline size_t compare( uint16_t key, const uint16_t* cmp ) {
+        return compare( key, _mm256_loadu_si256( reinterpret_cast< const __m256i* >( cmp ) ) );
+    }
+};
 
-private:
-    const std::vector< value_type >& ref_;
-    typename smart_index< value_type >::inner_type cmp_;
-    constexpr static size_t array_size = smart_index< value_type >::array_size;
+template<> struct smart_index< int32_t, isa::avx2 >
+{
+    using inner_type = __m256i;
+    constexpr static size_t array_size = 32/sizeof(int32_t);
+    VECIDX_TARGET_AVX2 static inline size_t compare( int32_t key, __m256i cmp ) {
+        uint32_t mask = _mm256_movemask_epi8( _mm256_cmpgt_epi32( _mm256_set1_epi32( key ), cmp ) );
+        return _mm_popcnt_u32( mask ) >> 2;
+    }
+    VECIDX_TARGET_AVX2 static inline size_t compare( int32_t key, const int32_t* cmp ) {
+        return compare( key, _mm256_loadu_si256( reinterpret_cast< const __m256i* >( cmp ) ) );
+    }
 };
 
-//Two-level smart_step
-template< typename DUMMY_T, typename VecType_T >
-class smart_step2
+template<> struct smart_index< uint32_t, isa::avx2 >
 {
-public:
-    using value_type    = VecType_T;
-    using const_iterator = typename std::vector< value_type >::const_iterator;
+    using inner_type = __m256i;
+    constexpr static size_t array_size = 32/sizeof(uint32_t);
+    VECIDX_TARGET_AVX2 static inline size_t compare( uint32_t key, __m256i cmp ) {
+        const __m256i bias = _mm256_set1_epi32( INT32_MIN );
+        __m256i lhs = _mm256_xor_si256( _mm256_set1_epi32( key ), bias );
+        uint32_t mask = _mm256_movemask_epi8( _mm256_cmpgt_epi32( lhs, _mm256_xor_si256( cmp, bias ) ) );
+        return _mm_popcnt_u32( mask ) >> 2;
+    }
+    VECIDX_TARGET_AVX2 static inline size_t compare( uint32_t key, const uint32_t* cmp ) {
+        return compare( key, _mm256_loadu_si256( reinterpret_cast< const __m256i* >( cmp ) ) );
+    }
+};
 
-    smart_step2( const std::vector< value_type >& ref )
-        : ref_( ref ){}
+template<> struct smart_index< int64_t, isa::avx2 >
+{
+    using inner_type = __m256i;
+    constexpr static size_t array_size = 32/sizeof(int64_t);
+    VECIDX_TARGET_AVX2 static inline size_t compare( int64_t key, __m256i cmp ) {
+        uint32_t mask = _mm256_movemask_epi8( _mm256_cmpgt_epi64( _mm256_set1_epi64x( key ), cmp ) );
+        return _mm_popcnt_u32( mask ) >> 3;
+    }
+    VECIDX_TARGET_AVX2 static inline size_t compare( int64_t key, const int64_t* cmp ) {
+        return compare( key, _mm256_loadu_si256( reinterpret_cast< const __m256i* >( cmp ) ) );
+    }
+};
 
-    void build_index()
-    {
-        size_t step = ref_.size() / (array_size + 1);
+template<> struct smart_index< uint64_t, isa::avx2 >
+{
+    using inner_type = __m256i;
+    constexpr static size_t array_size = 32/sizeof(uint64_t);
+    VECIDX_TARGET_AVX2 static inline size_t compare( uint64_t key, __m256i cmp ) {
+        const __m256i bias = _mm256_set1_epi64x( INT64_MIN );
+        __m256i lhs = _mm256_xor_si256( _mm256_set1_epi64x( key ), bias );
+        uint32_t mask = _mm256_movemask_epi8( _mm256_cmpgt_epi64( lhs, _mm256_xor_si256( cmp, bias ) ) );
+        return _mm_popcnt_u32( mask ) >> 3;
+    }
+    VECIDX_TARGET_AVX2 static inline size_t compare( uint64_t key, const uint64_t* cmp ) {
+        return compare( key, _mm256_loadu_si256( reinterpret_cast< const __m256i* >( cmp ) ) );
+    }
+};
 
-        const_iterator end = ref_.begin();
-        value_type* pCmp = reinterpret_cast< value_type* >( cmp_.data() );
-        for( size_t i = 0; i < array_size; ++i )
-        {
-            const_iterator beg = end;
-            std::advance( end, step );
-            cmp_[ i+1 ] = build_index( beg, end+1 );
+template<> struct smart_index< float, isa::avx2 >
+{
+    using inner_type = __m256;
+    constexpr static size_t array_size = 32/sizeof(float);
+    VECIDX_TARGET_AVX2 static inline size_t compare( float key, __m256 cmp ) {
+        __m256 k = _mm256_set1_ps( key );
+        __m256 nan = _mm256_and_ps( _mm256_cmp_ps( k, k, _CMP_UNORD_Q ), _mm256_cmp_ps( cmp, cmp, _CMP_ORD_Q ) );
+        __m256 lt = _mm256_cmp_ps( cmp, k, _CMP_LT_OQ );
+        return _mm_popcnt_u32( _mm256_movemask_ps( _mm256_or_ps( lt, nan ) ) );
+    }
+    VECIDX_TARGET_AVX2 static inline size_t compare( float key, const float* cmp ) {
+        return compare( key, _mm256_loadu_ps( cmp ) );
+    }
+};
 
-            *pCmp = *end;
-            ++pCmp;
-        }
-        cmp_[ array_size +1 ] = build_index( end, ref_.end() );
-        //std::cout << "Cmp: " << cmp_[0] << std::endl;
+template<> struct smart_index< double, isa::avx2 >
+{
+    using inner_type = __m256d;
+    constexpr static size_t array_size = 32/sizeof(double);
+    VECIDX_TARGET_AVX2 static inline size_t compare( double key, __m256d cmp ) {
+        __m256d k = _mm256_set1_pd( key );
+        __m256d nan = _mm256_and_pd( _mm256_cmp_pd( k, k, _CMP_UNORD_Q ), _mm256_cmp_pd( cmp, cmp, _CMP_ORD_Q ) );
+        __m256d lt = _mm256_cmp_pd( cmp, k, _CMP_LT_OQ );
+        return _mm_popcnt_u32( _mm256_movemask_pd( _mm256_or_pd( lt, nan ) ) );
     }
+    VECIDX_TARGET_AVX2 static inline size_t compare( double key, const double* cmp ) {
+        return compare( key, _mm256_loadu_pd( cmp ) );
+    }
+};
 
-    const_iterator find( const value_type& key ) const
-    {
-        size_t i = smart_index< value_type >::compare( key, cmp_[0] );
-        size_t j = smart_index< value_type >::compare( key, cmp_[i+1] );
-        size_t step = ref_.size() / (array_size + 1);
+// AVX-512
+template<> struct smart_index< int8_t, isa::avx512 >
+{
+    using inner_type = __m512i;
+    constexpr static size_t array_size = 64/sizeof(int8_t);
+    VECIDX_TARGET_AVX512 static inline size_t compare( int8_t key, __m512i cmp ) {
+        return _mm_popcnt_u64( _mm512_cmpgt_epi8_mask( _mm512_set1_epi8( key ), cmp ) );
+    }
+    VECIDX_TARGET_AVX512 static inline size_t compare( int8_t key, const int8_t* cmp ) {
+        return compare( key, _mm512_loadu_si512( cmp ) );
+    }
+};
+
+template<> struct smart_index< uint8_t, isa::avx512 >
+{
+    using inner_type = __m512i;
+    constexpr static size_t array_size = 64/sizeof(uint8_t);
+    VECIDX_TARGET_AVX512 static inline size_t compare( uint8_t key, __m512i cmp ) {
+        return _mm_popcnt_u64( _mm512_cmpgt_epu8_mask( _mm512_set1_epi8( key ), cmp ) );
+    }
+    VECIDX_TARGET_AVX512 static inline size_t compare( uint8_t key, const uint8_t* cmp ) {
+        return compare( key, _mm512_loadu_si512( cmp ) );
+    }
+};
+
+template<> struct smart_index< int16_t, isa::avx512 >
+{
+    using inner_type = __m512i;
+    constexpr static size_t array_size = 64/sizeof(int16_t);
+    VECIDX_TARGET_AVX512 static inline size_t compare( int16_t key, __m512i cmp ) {
+        return _mm_popcnt_u32( _mm512_cmpgt_epi16_mask( _mm512_set1_epi16( key ), cmp ) );
+    }
+    VECIDX_TARGET_AVX512 static inline size_t compare( int16_t key, const int16_t* cmp ) {
+        return compare( key, _mm512_loadu_si512( cmp ) );
+    }
+};
+
+template<> struct smart_index< uint16_t, isa::avx512 >
+{
+    using inner_type = __m512i;
+    constexpr static size_t array_size = 64/sizeof(uint16_t);
+    VECIDX_TARGET_AVX512 static inline size_t compare( uint16_t key, __m512i cmp ) {
+        return _mm_popcnt_u32( _mm512_cmpgt_epu16_mask( _mm512_set1_epi16( key ), cmp ) );
+    }
+    VECIDX_TARGET_AVX512 static inline size_t compare( uint16_t key, const uint16_t* cmp ) {
+        return compare( key, _mm512_loadu_si512( cmp ) );
+    }
+};
+
+template<> struct smart_index< int32_t, isa::avx512 >
+{
+    using inner_type = __m512i;
+    constexpr static size_t array_size = 64/sizeof(int32_t);
+    VECIDX_TARGET_AVX512 static inline size_t compare( int32_t key, __m512i cmp ) {
+        return _mm_popcnt_u32( _mm512_cmpgt_epi32_mask( _mm512_set1_epi32( key ), cmp ) );
+    }
+    VECIDX_TARGET_AVX512 static inline size_t compare( int32_t key, const int32_t* cmp ) {
+        return compare( key, _mm512_loadu_si512( cmp ) );
+    }
+};
+
+template<> struct smart_index< uint32_t, isa::avx512 >
+{
+    using inner_type = __m512i;
+    constexpr static size_t array_size = 64/sizeof(uint32_t);
+    VECIDX_TARGET_AVX512 static inline size_t compare( uint32_t key, __m512i cmp ) {
+        return _mm_popcnt_u32( _mm512_cmpgt_epu32_mask( _mm512_set1_epi32( key ), cmp ) );
+    }
+    VECIDX_TARGET_AVX512 static inline size_t compare( uint32_t key, const uint32_t* cmp ) {
+        return compare( key, _mm512_loadu_si512( cmp ) );
+    }
+};
+
+template<> struct smart_index< int64_t, isa::avx512 >
+{
+    using inner_type = __m512i;
+    constexpr static size_t array_size = 64/sizeof(int64_t);
+    VECIDX_TARGET_AVX512 static inline size_t compare( int64_t key, __m512i cmp ) {
+        return _mm_popcnt_u32( _mm512_cmpgt_epi64_mask( _mm512_set1_epi64( key ), cmp ) );
+    }
+    VECIDX_TARGET_AVX512 static inline size_t compare( int64_t key, const int64_t* cmp ) {
+        return compare( key, _mm512_loadu_si512( cmp ) );
+    }
+};
+
+template<> struct smart_index< uint64_t, isa::avx512 >
+{
+    using inner_type = __m512i;
+    constexpr static size_t array_size = 64/sizeof(uint64_t);
+    VECIDX_TARGET_AVX512 static inline size_t compare( uint64_t key, __m512i cmp ) {
+        return _mm_popcnt_u32( _mm512_cmpgt_epu64_mask( _mm512_set1_epi64( key ), cmp ) );
+    }
+    VECIDX_TARGET_AVX512 static inline size_t compare( uint64_t key, const uint64_t* cmp ) {
+        return compare( key, _mm512_loadu_si512( cmp ) );
+    }
+};
 
-        const_iterator beg = ref_.begin();
-        std::advance( beg, i * step );
+template<> struct smart_index< float, isa::avx512 >
+{
+    using inner_type = __m512;
+    constexpr static size_t array_size = 64/sizeof(float);
+    VECIDX_TARGET_AVX512 static inline size_t compare( float key, __m512 cmp ) {
+        __m512 k = _mm512_set1_ps( key );
+        uint32_t nan = _mm512_cmp_ps_mask( k, k, _CMP_UNORD_Q ) & _mm512_cmp_ps_mask( cmp, cmp, _CMP_ORD_Q );
+        return _mm_popcnt_u32( _mm512_cmp_ps_mask( cmp, k, _CMP_LT_OQ ) | nan );
+    }
+    VECIDX_TARGET_AVX512 static inline size_t compare( float key, const float* cmp ) {
+        return compare( key, _mm512_loadu_ps( cmp ) );
+    }
+};
+
+template<> struct smart_index< double, isa::avx512 >
+{
+    using inner_type = __m512d;
+    constexpr static size_t array_size = 64/sizeof(double);
+    VECIDX_TARGET_AVX512 static inline size_t compare( double key, __m512d cmp ) {
+        __m512d k = _mm512_set1_pd( key );
+        uint32_t nan = _mm512_cmp_pd_mask( k, k, _CMP_UNORD_Q ) & _mm512_cmp_pd_mask( cmp, cmp, _CMP_ORD_Q );
+        return _mm_popcnt_u32( _mm512_cmp_pd_mask( cmp, k, _CMP_LT_OQ ) | nan );
+    }
+    VECIDX_TARGET_AVX512 static inline size_t compare( double key, const double* cmp ) {
+        return compare( key, _mm512_loadu_pd( cmp ) );
+    }
+};
+
+// Splitter storage is sized for the widest kernel, the kernel actually used
+// is picked when the index is built.
+template< typename VecType_T >
+constexpr size_t max_array_size()
+{
+    return 64/sizeof(VecType_T);
+}
+
+namespace detail {
+
+// Batch lookups of the smart_step classes. ranges( keys, count, first, size )
+// narrows every key to the part of ref that holds its lower_bound, with the
+// SIMD levels of all keys in lock-step, then the group finishes with a
+// lock-step lower_bound over ref. find selects find() over lower_bound()
+// results.
+template< typename VecType_T, typename InputIt, typename OutputIt, typename Ranges_T >
+OutputIt smart_batch( const std::vector< VecType_T >& ref, bool find,
+                      InputIt first, InputIt last, OutputIt out, Ranges_T ranges )
+{
+    key_less< VecType_T > less;
+    for_each_group< VecType_T >( first, last,
+        [&]( const VecType_T* keys, size_t count )
+        {
+            size_t pos[ batch_group_size ];
+            size_t size[ batch_group_size ];
+            ranges( keys, count, pos, size );
+            lower_bound_group( keys, count, pos, size,
+                [&]( size_t, size_t i ) -> const VecType_T& { return ref[ i ]; },
+                [&]( size_t, size_t i ) { prefetch( &ref[ i ] ); },
+                less );
 
-        const_iterator end = beg;
-        std::advance( end, step );
-        ++end;
+            for( size_t g = 0; g < count; ++g )
+            {
+                auto it = ref.begin() + pos[ g ];
+                if( find && ( ref.size() == pos[ g ] || less( keys[ g ], *it ) ) )
+                {
+                    it = ref.end();
+                }
+                *out++ = it;
+            }
+        });
+    return out;
+}
 
-        step = step / (array_size +1);
-        std::advance( beg, j * step );
+// lower_bound of key in the sorted [data + first, data + last): a binary
+// search down to a few cache lines, which the kernels then count in one
+// pass instead of a chain of dependent compares.
+template< typename Isa_T, typename VecType_T >
+size_t simd_lower_bound( const VecType_T& key, const VecType_T* data, size_t first, size_t last )
+{
+    using index = smart_index< VecType_T, Isa_T >;
+    constexpr size_t span = 4 * cache_line_size / sizeof( VecType_T );
 
-        if( i == array_size && j == array_size )
+    key_less< VecType_T > less;
+    while( last - first > span )
+    {
+        size_t middle = first + ( last - first ) / 2;
+        if( less( data[ middle ], key ) )
         {
-            end = ref_.end();
+            first = middle + 1;
         }
-        else if( j != array_size )
+        else
         {
-            end = beg;
-            std::advance( end, step );
-            ++end;
+            last = middle;
         }
-
-        auto first = std::lower_bound( beg, end, key );
-        return (first!=end && !(key<*first)) ? first : ref_.end();
     }
 
-private:
-    constexpr static size_t array_size = smart_index< value_type >::array_size;
-
-    const std::vector< value_type >& ref_;
-    std::array< typename smart_index< value_type >::inner_type, array_size +2 > cmp_;
+    size_t ret = first;
+    size_t i = first;
+    for( ; i + index::array_size <= last; i += index::array_size )
+    {
+        ret += index::compare( key, data + i );
+    }
+    for( ; i < last; ++i )
+    {
+        ret += less( data[ i ], key );
+    }
+    return ret;
+}
 
-    typename smart_index< value_type >::inner_type build_index( const_iterator begin, const_iterator end )
+// upper_bound of key in the sorted [data + first, data + last), with no key
+// less than key from first on. Gallops over the duplicates of key, so a run
+// of them costs the log of its length.
+template< typename VecType_T >
+size_t gallop_upper_bound( const VecType_T& key, const VecType_T* data, size_t first, size_t last )
+{
+    key_less< VecType_T > less;
+    size_t hi = first;
+    for( size_t step = 1; hi < last && !less( key, data[ hi ] ); step *= 2 )
     {
-        size_t size = std::distance( begin, end );
-        size_t step = size / (array_size + 1);
+        first = hi + 1;
+        hi += step;
+    }
+    return std::upper_bound( data + first, data + std::min( hi, last ), key, less ) - data;
+}
 
-        typename smart_index< value_type >::inner_type ret;
-        value_type* pRet = reinterpret_cast< value_type* >( &ret );
+} // namespace detail
 
-        const_iterator it = begin;
-        for( size_t i = 0; i < array_size; ++i )
-        {
-            std::advance( it, step );
-            *pRet = *it;
-            ++pRet;
-        }
-        //std::cout << "Cmp: " << ret << " - beg, end, size: " << *begin << ", " << *end << ", " << size << std::endl;
-        return ret;
+namespace detail {
+
+// Splitters are laid out for the kernel width they were built with, so an
+// image keeps its instruction set level in param 0 and loads only where the
+// CPU has it.
+inline isa::level image_level( const image_reader& image )
+{
+    uint64_t lvl = image.param( 0 );
+    if( lvl > static_cast< uint64_t >( isa::level::avx512 ) ||
+        static_cast< isa::level >( lvl ) > isa::detect() )
+    {
+        throw image_error( "index image needs a wider instruction set than this CPU has" );
     }
-};
+    return static_cast< isa::level >( lvl );
+}
 
-//any container smart_step
-template< class Cont_T >
-class any_smart_step
+} // namespace detail
+
+template< typename DUMMY_T, typename VecType_T, typename Stats_T = no_stats >
+class smart_step
 {
 public:
-	using container_type = Cont_T;
-    using value_type     = typename container_type::value_type;
-    using const_iterator = typename container_type::const_iterator;
+    using value_type    = VecType_T;
+    using stats_type    = Stats_T;
+    using const_iterator = typename std::vector< value_type >::const_iterator;
 
-    any_smart_step( const container_type& ref )
-        : ref_( ref ){}
+    smart_step( const std::vector< value_type >& ref, isa::level lvl = isa::detect() )
+        : ref_( ref ), isa_( lvl ){}
 
     void build_index()
     {
-        size_t step = ref_.size() / (array_size + 1);
-
-        value_type* pCmp = reinterpret_cast< value_type* >( &cmp_ );
-        const_iterator it = ref_.begin();
-        ranges_[ 0 ] = it;
-        for( size_t i = 1; i <= array_size; ++i )
-        {
-            std::advance( it, step );
-            ranges_[ i ] = it;
-            *pCmp = *it;
-            ++pCmp;
-        }
-        ranges_[ array_size+1 ] = std::prev(ref_.end());
+        isa::dispatch( isa_, [&]( auto tag ){ build_index( tag ); } );
+        //std::cout << "Cmp: " << cmp_ << std::endl;
     }
 
     const_iterator find( const value_type& key ) const
     {
-        size_t i = smart_index< value_type >::compare( key, cmp_ );
-        auto beg = ranges_[ i ];
-        auto end = std::next( ranges_[ i + 1 ] );
-        auto first = std::lower_bound( beg, end, key );
-        return (first!=end && !(key<*first)) ? first : ref_.end();
+        return isa::dispatch( isa_, [&]( auto tag ){ return find( key, tag ); } );
     }
 
-private:
-    constexpr static size_t array_size = smart_index< value_type >::array_size;
+    template< typename InputIt, typename OutputIt >
+    OutputIt lower_bound_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return batch( false, first, last, out, tag ); } );
+    }
 
-    const container_type& ref_;
-    typename smart_index< value_type >::inner_type cmp_;
-    std::array< const_iterator, array_size + 2 > ranges_;
-};
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return batch( true, first, last, out, tag ); } );
+    }
 
-//n-level smart_step
-//template< typename DUMMY_T, typename VecType_T >
-//class smart_stepN
-//{
-//public:
-//    using value_type    = VecType_T;
-//    using const_iterator = typename std::vector< value_type >::const_iterator;
-//
-//    smart_stepN( const std::vector< value_type >& ref )
-//        : ref_( ref ), range_( std::make_pair( ref.begin(), ref.end() ) ) {}
-//
-//    void build_index()
-//    {
-//        size_t size = std::distance( range_.first, range_.second );
-//        size_t step = size / (array_size + 1);
-//
-//        value_type* pCmp = reinterpret_cast< value_type* >( &cmp_ );
-//
-//        const_iterator it = range_.first;
-//        for( size_t i = 0; i < array_size; ++i )
-//        {
-//            const_iterator beg = it;
-//            std::advance( it, step );
-//
-//            *pCmp = *it;
-//            ++pCmp;
-//            std::advance( end, step );
-//            cmp_[ i+1 ] = build_index( beg, end+1 );
-//
-//            *pCmp = *end;
-//            ++pCmp;
-//        }
-//        //std::cout << "Cmp: " << cmp_ << " - beg, end, size: " << *range_.first << ", " << *range_.second << ", " << size << std::endl;
-//    }
-//
-//    const_iterator find( const value_type& key ) const
-//    {
-//    }
-//
-//private:
-//    constexpr static size_t array_size = 32/sizeof(value_type);
+    // ref_ is sorted, so its own order is the sorted order.
+    using sorted_iterator = const_iterator;
+
+    sorted_iterator sorted_begin() const
+    {
+        return ref_.begin();
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        return ref_.end();
+    }
+
+    // Elements equal to key.
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const value_type& key ) const
+    {
+        size_t first = isa::dispatch( isa_, [&]( auto tag ){ return rank( key, tag ); } );
+        size_t last = detail::gallop_upper_bound( key, ref_.data(), first, ref_.size() );
+        return std::make_pair( ref_.begin() + first, ref_.begin() + last );
+    }
+
+    // Elements in [lo, hi).
+    std::pair< sorted_iterator, sorted_iterator > sorted_range( const value_type& lo, const value_type& hi ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag )
+        {
+            size_t first = rank( lo, tag );
+            size_t last = std::max( first, rank( hi, tag ) );
+            return std::make_pair( ref_.begin() + first, ref_.begin() + last );
+        });
+    }
+
+    // Number of elements in [lo, hi).
+    size_t count( const value_type& lo, const value_type& hi ) const
+    {
+        auto r = sorted_range( lo, hi );
+        return r.second - r.first;
+    }
+
+    // Writes the built index to path, for load() to map it back instead of
+    // building.
+    void save( const std::string& path ) const
+    {
+        image_writer image( "smart_step", ref_, size_t() );
+        image.param( 0, static_cast< uint64_t >( isa_ ) );
+        image.section( cmp_.data(), cmp_.size() );
+        image.save( path );
+    }
+
+    // Uses the image at path in place of build_index(), at the instruction
+    // set level it was built for. Throws image_error unless it is an image
+    // of this index type built from the same data.
+    void load( const std::string& path )
+    {
+        image_reader image( path, "smart_step", ref_, size_t() );
+        isa::level lvl = detail::image_level( image );
+        if( cmp_.size() != image.count( 0, sizeof( value_type ) ) )
+        {
+            throw image_error( path + " does not match the index layout" );
+        }
+        image.copy< value_type >( 0, cmp_.begin() );
+        isa_ = lvl;
+    }
+
+    // Bytes of the index, without the vector. The splitters live in the
+    // object itself.
+    size_t memory_usage() const
+    {
+        return sizeof( cmp_ );
+    }
+
+    // What find() reported to the stats policy.
+    const stats_type& stats() const
+    {
+        return stats_;
+    }
+
+    void reset_stats()
+    {
+        stats_ = stats_type();
+    }
+
+    isa::level simd_level() const
+    {
+        return isa_;
+    }
+
+private:
+    const std::vector< value_type >& ref_;
+    isa::level isa_;
+    alignas( cache_line_size ) std::array< value_type, max_array_size< value_type >() > cmp_;
+    mutable stats_type stats_;
+
+    template< typename Isa_T >
+    void build_index( Isa_T )
+    {
+        constexpr size_t array_size = smart_index< value_type, Isa_T >::array_size;
+        size_t step = ref_.size() / (array_size + 1);
+
+        const_iterator end = ref_.begin();
+        value_type* pCmp = cmp_.data();
+        for( size_t i = 0; i < array_size; ++i )
+        {
+            std::advance( end, step );
+            *pCmp = *end;
+            ++pCmp;
+        }
+    }
+
+    // [first, last) of ref_ that holds lower_bound( key ).
+    template< typename Isa_T >
+    std::pair< size_t, size_t > range( const value_type& key, Isa_T ) const
+    {
+        constexpr size_t array_size = smart_index< value_type, Isa_T >::array_size;
+        size_t i = smart_index< value_type, Isa_T >::compare( key, cmp_.data() );
+        size_t step = ref_.size() / (array_size + 1);
+
+        size_t first = i * step;
+        size_t last = (i == array_size) ? ref_.size() : first + step + 1;
+        return std::make_pair( first, last );
+    }
+
+    // Sorted position of lower_bound( key ): the kernels count the end of
+    // the range once it is down to a few cache lines.
+    template< typename Isa_T >
+    size_t rank( const value_type& key, Isa_T tag ) const
+    {
+        auto r = range( key, tag );
+        size_t last = std::min( r.second, ref_.size() );
+        return detail::simd_lower_bound< Isa_T >( key, ref_.data(), std::min( r.first, last ), last );
+    }
+
+    template< typename Isa_T >
+    const_iterator find( const value_type& key, Isa_T tag ) const
+    {
+        auto r = range( key, tag );
+        stats_.lookup();
+        stats_.level( smart_index< value_type, Isa_T >::array_size );
+        stats_.window( r.second - r.first );
+        const_iterator beg = ref_.begin() + r.first;
+        const_iterator end = ref_.begin() + r.second;
+
+        auto less = detail::counted( key_less< value_type >(), stats_ );
+        auto first = std::lower_bound( beg, end, key, less );
+        return (first!=end && !less(key, *first)) ? first : ref_.end();
+    }
+
+    template< typename InputIt, typename OutputIt, typename Isa_T >
+    OutputIt batch( bool find, InputIt first, InputIt last, OutputIt out, Isa_T tag ) const
+    {
+        return detail::smart_batch( ref_, find, first, last, out,
+            [&]( const value_type* keys, size_t count, size_t* pos, size_t* size )
+            {
+                for( size_t g = 0; g < count; ++g )
+                {
+                    auto r = range( keys[ g ], tag );
+                    pos[ g ] = r.first;
+                    size[ g ] = r.second - r.first;
+                }
+            });
+    }
+};
+
+//Two-level smart_step
+template< typename DUMMY_T, typename VecType_T, typename Alloc_T = aligned_allocator< VecType_T >,
+          typename Stats_T = no_stats >
+class smart_step2
+{
+public:
+    using value_type    = VecType_T;
+    using allocator_type = Alloc_T;
+    using stats_type    = Stats_T;
+    using const_iterator = typename std::vector< value_type >::const_iterator;
+
+    smart_step2( const std::vector< value_type >& ref, isa::level lvl = isa::detect(),
+                 const Alloc_T& alloc = Alloc_T() )
+        : ref_( ref ), isa_( lvl ), cmp_( alloc ){}
+
+    void build_index()
+    {
+        isa::dispatch( isa_, [&]( auto tag ){ build_index( tag ); } );
+    }
+
+    const_iterator find( const value_type& key ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return find( key, tag ); } );
+    }
+
+#if defined( VECIDX_COROUTINES )
+    // find() as a coroutine for a lookup_scheduler: the splitters stay
+    // cached, the search of the window prefetches every probe and suspends
+    // before reading it.
+    lookup< const_iterator > find_coro( value_type key ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return find_coro( key, tag ); } );
+    }
+#endif
+
+    template< typename InputIt, typename OutputIt >
+    OutputIt lower_bound_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return batch( false, first, last, out, tag ); } );
+    }
+
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return batch( true, first, last, out, tag ); } );
+    }
+
+    // ref_ is sorted, so its own order is the sorted order.
+    using sorted_iterator = const_iterator;
+
+    sorted_iterator sorted_begin() const
+    {
+        return ref_.begin();
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        return ref_.end();
+    }
+
+    // Elements equal to key.
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const value_type& key ) const
+    {
+        size_t first = isa::dispatch( isa_, [&]( auto tag ){ return rank( key, tag ); } );
+        size_t last = detail::gallop_upper_bound( key, ref_.data(), first, ref_.size() );
+        return std::make_pair( ref_.begin() + first, ref_.begin() + last );
+    }
+
+    // Elements in [lo, hi).
+    std::pair< sorted_iterator, sorted_iterator > sorted_range( const value_type& lo, const value_type& hi ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag )
+        {
+            size_t first = rank( lo, tag );
+            size_t last = std::max( first, rank( hi, tag ) );
+            return std::make_pair( ref_.begin() + first, ref_.begin() + last );
+        });
+    }
+
+    // Number of elements in [lo, hi).
+    size_t count( const value_type& lo, const value_type& hi ) const
+    {
+        auto r = sorted_range( lo, hi );
+        return r.second - r.first;
+    }
+
+    // Writes the built index to path, for load() to map it back instead of
+    // building.
+    void save( const std::string& path ) const
+    {
+        image_writer image( "smart_step2", ref_, size_t() );
+        image.param( 0, static_cast< uint64_t >( isa_ ) );
+        image.section( cmp_.data(), cmp_.size() );
+        image.save( path );
+    }
+
+    // Uses the image at path in place of build_index(), at the instruction
+    // set level it was built for. Throws image_error unless it is an image
+    // of this index type built from the same data.
+    void load( const std::string& path )
+    {
+        image_reader image( path, "smart_step2", ref_, size_t() );
+        isa::level lvl = detail::image_level( image );
+        image.section( 0, cmp_ );
+        size_t array_size = isa::dispatch( lvl, [&]( auto tag ){ return smart_index< value_type, decltype( tag ) >::array_size; } );
+        if( cmp_.size() != ( array_size + 2 ) * array_size )
+        {
+            throw image_error( path + " does not match the index layout" );
+        }
+        isa_ = lvl;
+    }
+
+    // Bytes of the index, without the vector.
+    size_t memory_usage() const
+    {
+        return cmp_.memory_usage();
+    }
+
+    // What find() reported to the stats policy.
+    const stats_type& stats() const
+    {
+        return stats_;
+    }
+
+    void reset_stats()
+    {
+        stats_ = stats_type();
+    }
+
+    isa::level simd_level() const
+    {
+        return isa_;
+    }
+
+private:
+    const std::vector< value_type >& ref_;
+    isa::level isa_;
+    // Root vector followed by the (array_size + 1) second level vectors,
+    // one kernel width apart.
+    buffer< value_type, allocator_type > cmp_;
+    mutable stats_type stats_;
+
+    template< typename Isa_T >
+    void build_index( Isa_T )
+    {
+        constexpr size_t array_size = smart_index< value_type, Isa_T >::array_size;
+        size_t step = ref_.size() / (array_size + 1);
+
+        cmp_.assign( (array_size + 2) * array_size, value_type() );
+
+        const_iterator end = ref_.begin();
+        value_type* pCmp = cmp_.data();
+        for( size_t i = 0; i < array_size; ++i )
+        {
+            const_iterator beg = end;
+            std::advance( end, step );
+            build_index( beg, end+1, &cmp_[ (i+1) * array_size ], array_size );
+
+            *pCmp = *end;
+            ++pCmp;
+        }
+        build_index( end, ref_.end(), &cmp_[ (array_size+1) * array_size ], array_size );
+        //std::cout << "Cmp: " << cmp_[0] << std::endl;
+    }
+
+    // [first, last) of ref_ that holds lower_bound( key ).
+    template< typename Isa_T >
+    std::pair< size_t, size_t > range( const value_type& key, Isa_T ) const
+    {
+        using index = smart_index< value_type, Isa_T >;
+        constexpr size_t array_size = index::array_size;
+
+        size_t i = index::compare( key, cmp_.data() );
+        size_t j = index::compare( key, &cmp_[ (i+1) * array_size ] );
+        size_t step = ref_.size() / (array_size + 1);
+
+        // Same ranges the second level vectors were built over: step + 1
+        // elements, or the remainder for the last bucket.
+        size_t size = (i == array_size) ? ref_.size() - i * step : step + 1;
+
+        size_t first = i * step;
+        size_t last = first + size;
+
+        step = size / (array_size + 1);
+        first += j * step;
+
+        if( j != array_size )
+        {
+            last = first + step + 1;
+        }
+        return std::make_pair( first, last );
+    }
+
+    // Sorted position of lower_bound( key ): the kernels count the end of
+    // the range once it is down to a few cache lines.
+    template< typename Isa_T >
+    size_t rank( const value_type& key, Isa_T tag ) const
+    {
+        auto r = range( key, tag );
+        size_t last = std::min( r.second, ref_.size() );
+        return detail::simd_lower_bound< Isa_T >( key, ref_.data(), std::min( r.first, last ), last );
+    }
+
+    template< typename Isa_T >
+    const_iterator find( const value_type& key, Isa_T tag ) const
+    {
+        auto r = range( key, tag );
+        stats_.lookup();
+        stats_.level( smart_index< value_type, Isa_T >::array_size );
+        stats_.level( smart_index< value_type, Isa_T >::array_size );
+        stats_.window( r.second - r.first );
+        const_iterator beg = ref_.begin() + r.first;
+        const_iterator end = ref_.begin() + r.second;
+
+        auto less = detail::counted( key_less< value_type >(), stats_ );
+        auto first = std::lower_bound( beg, end, key, less );
+        return (first!=end && !less(key, *first)) ? first : ref_.end();
+    }
+
+#if defined( VECIDX_COROUTINES )
+    // Halves the window down to the few lines rank() counts with the
+    // kernels, then prefetches those at once.
+    template< typename Isa_T >
+    lookup< const_iterator > find_coro( value_type key, Isa_T tag ) const
+    {
+        constexpr size_t span = 4 * cache_line_size / sizeof( value_type );
+        constexpr size_t line = cache_line_size / sizeof( value_type );
+
+        auto r = range( key, tag );
+        size_t last = std::min( r.second, ref_.size() );
+        size_t first = std::min( r.first, last );
+
+        key_less< value_type > less;
+        while( last - first > span )
+        {
+            size_t middle = first + ( last - first ) / 2;
+            co_await detail::prefetch_and_suspend( &ref_[ middle ] );
+            if( less( ref_[ middle ], key ) )
+            {
+                first = middle + 1;
+            }
+            else
+            {
+                last = middle;
+            }
+        }
+        if( first != last )
+        {
+            for( size_t i = first; i < last; i += line )
+            {
+                prefetch( &ref_[ i ] );
+            }
+            co_await detail::prefetch_and_suspend( &ref_[ last - 1 ] );
+        }
+
+        size_t pos = detail::simd_lower_bound< Isa_T >( key, ref_.data(), first, last );
+        co_return ( ref_.size() != pos && !less( key, ref_[ pos ] ) ) ? ref_.begin() + pos : ref_.end();
+    }
+#endif
+
+    template< typename InputIt, typename OutputIt, typename Isa_T >
+    OutputIt batch( bool find, InputIt first, InputIt last, OutputIt out, Isa_T tag ) const
+    {
+        return detail::smart_batch( ref_, find, first, last, out,
+            [&]( const value_type* keys, size_t count, size_t* pos, size_t* size )
+            {
+                for( size_t g = 0; g < count; ++g )
+                {
+                    auto r = range( keys[ g ], tag );
+                    pos[ g ] = r.first;
+                    size[ g ] = r.second - r.first;
+                }
+            });
+    }
+
+    void build_index( const_iterator begin, const_iterator end, value_type* pRet, size_t array_size )
+    {
+        size_t size = std::distance( begin, end );
+        size_t step = size / (array_size + 1);
+
+        const_iterator it = begin;
+        for( size_t i = 0; i < array_size; ++i )
+        {
+            std::advance( it, step );
+            *pRet = *it;
+            ++pRet;
+        }
+        //std::cout << "Cmp: " << ret << " - beg, end, size: " << *begin << ", " << *end << ", " << size << std::endl;
+    }
+};
+
+//any container smart_step
 //
-//    const std::vector< value_type >& ref_;
-//    typename smart_index< value_type >::index_type cmp_;
-//    const std::pair< const_iterator, const_iterator > range_;
+// Sorted containers without random access, std::list, std::set or
+// std::deque, get a skip ladder: the bottom rung keeps an iterator to the
+// first element of every leaf of leaf_width elements, with its key, and
+// every rung above keeps every array_size-th key of the one below. A lookup
+// takes one SIMD compare per rung down to its leaf, then walks at most
+// leaf_width - 1 elements of the container: O(log n) compares and hops
+// where a lower_bound over bidirectional iterators walks O(n).
+template< class Cont_T, typename Stats_T = no_stats >
+class any_smart_step
+{
+public:
+	using container_type = Cont_T;
+    using value_type     = typename container_type::value_type;
+    using stats_type     = Stats_T;
+    using const_iterator = typename container_type::const_iterator;
+
+    static const size_t default_leaf_width = 8;
+
+    any_smart_step( const container_type& ref, isa::level lvl = isa::detect(),
+                    size_t leaf_width = default_leaf_width )
+        : ref_( ref ), isa_( lvl ), leaf_width_( std::max< size_t >( leaf_width, 1 ) ) {}
+
+    void build_index()
+    {
+        isa::dispatch( isa_, [&]( auto tag ){ build_index( tag ); } );
+    }
+
+    const_iterator find( const value_type& key ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return find( key, tag ); } );
+    }
+
+    // Without random access there is nothing to interleave, the batch only
+    // saves the dispatch per key.
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag )
+        {
+            for( ; first != last; ++first )
+            {
+                *out++ = find( *first, tag );
+            }
+            return out;
+        });
+    }
+
+    // The container is sorted, so its own order is the sorted order.
+    using sorted_iterator = const_iterator;
+
+    sorted_iterator sorted_begin() const
+    {
+        return ref_.begin();
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        return ref_.end();
+    }
+
+    // Elements equal to key, a walk over them from the first.
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const value_type& key ) const
+    {
+        auto first = isa::dispatch( isa_, [&]( auto tag ){ return lower_bound( key, tag ); } );
+        auto last = first;
+        while( last != ref_.end() && !key_less< value_type >()( key, *last ) )
+        {
+            ++last;
+        }
+        return std::make_pair( first, last );
+    }
+
+    // Elements in [lo, hi).
+    std::pair< sorted_iterator, sorted_iterator > sorted_range( const value_type& lo, const value_type& hi ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag )
+        {
+            auto first = lower_bound( lo, tag );
+            auto last = key_less< value_type >()( hi, lo ) ? first : lower_bound( hi, tag );
+            return std::make_pair( first, last );
+        });
+    }
+
+    // Number of elements in [lo, hi), linear without random access.
+    size_t count( const value_type& lo, const value_type& hi ) const
+    {
+        auto r = sorted_range( lo, hi );
+        return std::distance( r.first, r.second );
+    }
+
+    size_t leaf_width() const
+    {
+        return leaf_width_;
+    }
+
+    // Rungs of the ladder, one SIMD compare each.
+    size_t rungs() const
+    {
+        return rungs_.size();
+    }
+
+    // Bytes of the index, without the container.
+    size_t memory_usage() const
+    {
+        return cmp_.capacity() * sizeof( value_type ) + leaves_.capacity() * sizeof( const_iterator ) +
+               rungs_.capacity() * sizeof( rung );
+    }
+
+    // What find() reported to the stats policy.
+    const stats_type& stats() const
+    {
+        return stats_;
+    }
+
+    void reset_stats()
+    {
+        stats_ = stats_type();
+    }
+
+    isa::level simd_level() const
+    {
+        return isa_;
+    }
+
+private:
+    // Keys of a rung in cmp_, whole kernel widths of them.
+    struct rung
+    {
+        size_t offset;
+        size_t size;
+    };
+
+    const container_type& ref_;
+    isa::level isa_;
+    size_t leaf_width_;
+    size_t size_ = 0;
+    // First element of every leaf.
+    std::vector< const_iterator > leaves_;
+    // The rungs, bottom first.
+    std::vector< rung > rungs_;
+    std::vector< value_type, aligned_allocator< value_type > > cmp_;
+    mutable stats_type stats_;
+
+    template< typename Isa_T >
+    void build_index( Isa_T )
+    {
+        constexpr size_t array_size = smart_index< value_type, Isa_T >::array_size;
+
+        leaves_.clear();
+        rungs_.clear();
+        cmp_.clear();
+        size_ = 0;
+        for( auto it = ref_.begin(); it != ref_.end(); ++it, ++size_ )
+        {
+            if( 0 == size_ % leaf_width_ )
+            {
+                leaves_.push_back( it );
+                cmp_.push_back( *it );
+            }
+        }
+
+        // Up to the rung that fits one compare. The last node of a rung is
+        // padded with its last key, which lower_bound() clamps off.
+        for( size_t size = leaves_.size(); size > 0; )
+        {
+            size_t offset = rungs_.empty() ? 0 : cmp_.size();
+            if( !rungs_.empty() )
+            {
+                const rung& below = rungs_.back();
+                for( size_t j = 0; j < size; ++j )
+                {
+                    value_type key = cmp_[ below.offset + j * array_size ];
+                    cmp_.push_back( key );
+                }
+            }
+            rungs_.push_back( rung{ offset, size } );
+            while( 0 != cmp_.size() % array_size )
+            {
+                value_type last = cmp_.back();
+                cmp_.push_back( last );
+            }
+            if( size <= array_size )
+            {
+                break;
+            }
+            size = ( size + array_size - 1 ) / array_size;
+        }
+    }
+
+    // Number of leaves whose first key is less than key, a node per rung:
+    // the one under the last key less than key of the rung above.
+    template< typename Isa_T, typename S >
+    size_t leaf_rank( const value_type& key, S& stats ) const
+    {
+        using index = smart_index< value_type, Isa_T >;
+        constexpr size_t array_size = index::array_size;
+
+        size_t rank = 0;
+        for( size_t r = rungs_.size(); r-- > 0; )
+        {
+            size_t first = ( r + 1 == rungs_.size() ) ? 0 : ( rank - 1 ) * array_size;
+            size_t less = index::compare( key, &cmp_[ rungs_[ r ].offset + first ] );
+            rank = first + std::min( less, rungs_[ r ].size - first );
+            stats.level( array_size );
+            if( 0 == rank )
+            {
+                break;
+            }
+        }
+        return rank;
+    }
+
+    // Reports to stats, find() passes stats_.
+    template< typename Isa_T, typename S = no_stats >
+    const_iterator lower_bound( const value_type& key, Isa_T, S&& stats = S() ) const
+    {
+        size_t rank = leaf_rank< Isa_T >( key, stats );
+        if( 0 == rank )
+        {
+            return ref_.begin();
+        }
+        // The leaf starts less than key, lower_bound is in the rest of it or
+        // starts the next one.
+        size_t leaf = rank - 1;
+        stats.window( std::min( leaf_width_, size_ - leaf * leaf_width_ ) );
+        auto it = std::next( leaves_[ leaf ] );
+        auto end = rank < leaves_.size() ? leaves_[ rank ] : ref_.end();
+        auto less = detail::counted( key_less< value_type >(), stats );
+        while( it != end && less( *it, key ) )
+        {
+            ++it;
+        }
+        return it;
+    }
+
+    template< typename Isa_T >
+    const_iterator find( const value_type& key, Isa_T tag ) const
+    {
+        stats_.lookup();
+        auto first = lower_bound( key, tag, stats_ );
+        auto less = detail::counted( key_less< value_type >(), stats_ );
+        return (first!=ref_.end() && !less(key, *first)) ? first : ref_.end();
+    }
+};
+
+template< class Cont_T, typename Stats_T >
+const size_t any_smart_step< Cont_T, Stats_T >::default_leaf_width;
+
+//n-level smart_step
 //
-//    smart_stepN( const std::vector< value_type >& ref, const_iterator beg, const_iterator end )
-//        : ref_( ref ), range_( std::make_pair( beg, end ) ) {}
-//};
+// Every node is one kernel width of splitters and the nodes are stored level
+// by level in a single array, so each level costs one SIMD compare on one
+// cache line. The children of node n are n * fanout + 1 + i. Levels == 0
+// picks the depth from the input size, stopping when the final lower_bound
+// range fits in two cache lines.
+template< size_t Levels, typename VecType_T, typename Alloc_T = aligned_allocator< VecType_T >,
+          typename Stats_T = no_stats >
+class smart_stepN
+{
+public:
+    using value_type     = VecType_T;
+    using allocator_type = Alloc_T;
+    using stats_type     = Stats_T;
+    using const_iterator = typename std::vector< value_type >::const_iterator;
+
+    smart_stepN( const std::vector< value_type >& ref, isa::level lvl = isa::detect(),
+                 const Alloc_T& alloc = Alloc_T() )
+        : ref_( ref ), isa_( lvl ), cmp_( alloc ), levels_( Levels ) {}
+
+    void build_index()
+    {
+        isa::dispatch( isa_, [&]( auto tag ){ build_index( tag ); } );
+    }
+
+    const_iterator find( const value_type& key ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return find( key, tag ); } );
+    }
+
+    size_t levels() const
+    {
+        return levels_;
+    }
+
+    template< typename InputIt, typename OutputIt >
+    OutputIt lower_bound_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return batch( false, first, last, out, tag ); } );
+    }
+
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return batch( true, first, last, out, tag ); } );
+    }
+
+    // ref_ is sorted, so its own order is the sorted order.
+    using sorted_iterator = const_iterator;
+
+    sorted_iterator sorted_begin() const
+    {
+        return ref_.begin();
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        return ref_.end();
+    }
+
+    // Elements equal to key.
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const value_type& key ) const
+    {
+        size_t first = isa::dispatch( isa_, [&]( auto tag ){ return rank( key, tag ); } );
+        size_t last = detail::gallop_upper_bound( key, ref_.data(), first, ref_.size() );
+        return std::make_pair( ref_.begin() + first, ref_.begin() + last );
+    }
+
+    // Elements in [lo, hi).
+    std::pair< sorted_iterator, sorted_iterator > sorted_range( const value_type& lo, const value_type& hi ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag )
+        {
+            size_t first = rank( lo, tag );
+            size_t last = std::max( first, rank( hi, tag ) );
+            return std::make_pair( ref_.begin() + first, ref_.begin() + last );
+        });
+    }
+
+    // Number of elements in [lo, hi).
+    size_t count( const value_type& lo, const value_type& hi ) const
+    {
+        auto r = sorted_range( lo, hi );
+        return r.second - r.first;
+    }
+
+    // Writes the built index to path, for load() to map it back instead of
+    // building.
+    void save( const std::string& path ) const
+    {
+        image_writer image( "smart_stepN", ref_, size_t() );
+        image.param( 0, static_cast< uint64_t >( isa_ ) );
+        image.param( 1, levels_ );
+        image.section( cmp_.data(), cmp_.size() );
+        image.save( path );
+    }
+
+    // Uses the image at path in place of build_index(), at the instruction
+    // set level it was built for. Throws image_error unless it is an image
+    // of this index type built from the same data.
+    void load( const std::string& path )
+    {
+        image_reader image( path, "smart_stepN", ref_, size_t() );
+        isa::level lvl = detail::image_level( image );
+        size_t levels = image.param( 1 );
+        if( 0 != Levels && Levels != levels )
+        {
+            throw image_error( path + " has another number of levels" );
+        }
+        image.section( 0, cmp_ );
+        size_t nodes = isa::dispatch( lvl, [&]( auto tag ){ return node_count< decltype( tag ) >( levels ); } );
+        size_t array_size = isa::dispatch( lvl, [&]( auto tag ){ return smart_index< value_type, decltype( tag ) >::array_size; } );
+        if( cmp_.size() != nodes * array_size )
+        {
+            throw image_error( path + " does not match the index layout" );
+        }
+        levels_ = levels;
+        isa_ = lvl;
+    }
+
+    // Bytes of the index, without the vector.
+    size_t memory_usage() const
+    {
+        return cmp_.memory_usage();
+    }
+
+    // What find() reported to the stats policy.
+    const stats_type& stats() const
+    {
+        return stats_;
+    }
+
+    void reset_stats()
+    {
+        stats_ = stats_type();
+    }
+
+    isa::level simd_level() const
+    {
+        return isa_;
+    }
+
+private:
+    constexpr static size_t leaf_size = 2 * 64 / sizeof( value_type );
+
+    const std::vector< value_type >& ref_;
+    isa::level isa_;
+    buffer< value_type, allocator_type > cmp_;
+    size_t levels_;
+    mutable stats_type stats_;
+
+    template< typename Isa_T >
+    void build_index( Isa_T )
+    {
+        constexpr size_t array_size = smart_index< value_type, Isa_T >::array_size;
+        constexpr size_t fanout = array_size + 1;
+
+        if( 0 == Levels )
+        {
+            levels_ = 0;
+            for( size_t size = ref_.size(); size > leaf_size; size /= fanout )
+            {
+                ++levels_;
+            }
+        }
+
+        size_t nodes = node_count< Isa_T >( levels_ );
+        cmp_.assign( nodes * array_size, value_type() );
+        if( nodes > 0 )
+        {
+            build_index< array_size >( 0, 0, 0, ref_.size() );
+        }
+    }
+
+    // Nodes of a tree of the given depth.
+    template< typename Isa_T >
+    static size_t node_count( size_t levels )
+    {
+        constexpr size_t fanout = smart_index< value_type, Isa_T >::array_size + 1;
+        size_t nodes = 0;
+        size_t count = 1;
+        for( size_t level = 0; level < levels; ++level )
+        {
+            nodes += count;
+            count *= fanout;
+        }
+        return nodes;
+    }
+
+    // [first, last) of ref_ that holds lower_bound( key ).
+    template< typename Isa_T >
+    std::pair< size_t, size_t > range( const value_type& key, Isa_T ) const
+    {
+        using index = smart_index< value_type, Isa_T >;
+        constexpr size_t array_size = index::array_size;
+
+        size_t first = 0;
+        size_t last = ref_.size();
+        size_t node = 0;
+        for( size_t level = 0; level < levels_; ++level )
+        {
+            size_t i = index::compare( key, &cmp_[ node * array_size ] );
+            child_range< array_size >( i, first, last );
+            node = node * (array_size + 1) + 1 + i;
+        }
+        return std::make_pair( first, last );
+    }
+
+    // Sorted position of lower_bound( key ). The leaf range is a couple of
+    // cache lines, which the kernels count.
+    template< typename Isa_T >
+    size_t rank( const value_type& key, Isa_T tag ) const
+    {
+        auto r = range( key, tag );
+        return detail::simd_lower_bound< Isa_T >( key, ref_.data(), r.first, r.second );
+    }
+
+    template< typename Isa_T >
+    const_iterator find( const value_type& key, Isa_T tag ) const
+    {
+        auto r = range( key, tag );
+        stats_.lookup();
+        for( size_t level = 0; level < levels_; ++level )
+        {
+            stats_.level( smart_index< value_type, Isa_T >::array_size );
+        }
+        stats_.window( r.second - r.first );
+        auto beg = ref_.begin() + r.first;
+        auto end = ref_.begin() + r.second;
+        auto less = detail::counted( key_less< value_type >(), stats_ );
+        auto it = std::lower_bound( beg, end, key, less );
+        return (it!=ref_.end() && !less(key, *it)) ? it : ref_.end();
+    }
+
+    template< typename InputIt, typename OutputIt, typename Isa_T >
+    OutputIt batch( bool find, InputIt first, InputIt last, OutputIt out, Isa_T ) const
+    {
+        using index = smart_index< value_type, Isa_T >;
+        constexpr size_t array_size = index::array_size;
+
+        return detail::smart_batch( ref_, find, first, last, out,
+            [&]( const value_type* keys, size_t count, size_t* pos, size_t* size )
+            {
+                size_t node[ batch_group_size ];
+                size_t end[ batch_group_size ];
+                for( size_t g = 0; g < count; ++g )
+                {
+                    pos[ g ] = 0;
+                    end[ g ] = ref_.size();
+                    node[ g ] = 0;
+                }
+
+                for( size_t level = 0; level < levels_; ++level )
+                {
+                    for( size_t g = 0; g < count; ++g )
+                    {
+                        size_t i = index::compare( keys[ g ], &cmp_[ node[ g ] * array_size ] );
+                        child_range< array_size >( i, pos[ g ], end[ g ] );
+                        node[ g ] = node[ g ] * (array_size + 1) + 1 + i;
+                        if( level + 1 < levels_ )
+                        {
+                            prefetch( &cmp_[ node[ g ] * array_size ] );
+                        }
+                    }
+                }
+
+                for( size_t g = 0; g < count; ++g )
+                {
+                    size[ g ] = end[ g ] - pos[ g ];
+                }
+            });
+    }
+
+    // The splitters of [first, last) are the elements at
+    // first + size * (k+1) / fanout. Child i gets the elements strictly
+    // between splitters i-1 and i, and its lower_bound answer is at most
+    // splitter i, so last always stays a valid result.
+    template< size_t array_size >
+    static void child_range( size_t i, size_t& first, size_t& last )
+    {
+        constexpr size_t fanout = array_size + 1;
+        size_t size = last - first;
+        size_t beg = (0 == i) ? first : first + size * i / fanout + 1;
+        size_t end = (array_size == i) ? last : first + size * (i+1) / fanout;
+        first = std::min( beg, end );
+        last = end;
+    }
+
+    template< size_t array_size >
+    void build_index( size_t node, size_t level, size_t first, size_t last )
+    {
+        constexpr size_t fanout = array_size + 1;
+        size_t size = last - first;
+        value_type* pCmp = &cmp_[ node * array_size ];
+        for( size_t k = 0; k < array_size; ++k )
+        {
+            // Empty nodes route every key to the same empty range, so any
+            // in-range value will do for their splitters.
+            size_t pos = std::min( first + size * (k+1) / fanout, ref_.size() - 1 );
+            pCmp[ k ] = ref_.empty() ? value_type() : ref_[ pos ];
+        }
+
+        if( level + 1 == levels_ )
+        {
+            return;
+        }
+
+        for( size_t i = 0; i < fanout; ++i )
+        {
+            size_t beg = first;
+            size_t end = last;
+            child_range< array_size >( i, beg, end );
+            build_index< array_size >( node * fanout + 1 + i, level + 1, beg, end );
+        }
+    }
+};
+
+template< typename DUMMY_T, typename VecType_T, typename Alloc_T = aligned_allocator< VecType_T >,
+          typename Stats_T = no_stats >
+using smart_step_auto = smart_stepN< 0, VecType_T, Alloc_T, Stats_T >;
 
 } // namespace vecidx
 
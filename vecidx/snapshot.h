@@ -0,0 +1,278 @@
+#ifndef VECIDX_SNAPSHOT_H
+#define VECIDX_SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "allocator.h"
+
+namespace vecidx {
+
+// Any index over a key vector, rebuilt while other threads read it.
+//
+// Every version owns its keys and its index. rebuild() builds the next one
+// off to the side and publishes it with one atomic pointer exchange, so
+// find() never blocks or takes a lock. The replaced version is reclaimed
+// by epochs: a reader announces the epoch it started in before it loads
+// the version, every exchange advances the epoch, and a replaced version
+// is freed once no reader announced an epoch from before its exchange.
+//
+// Each reading thread claims a reader, up to max_readers, and searches
+// through the snapshot it pins:
+//
+//     vecidx::snapshot_index< vecidx::tree_index< uint32_t, int > > index( keys );
+//     vecidx::snapshot_index< ... >::reader reader( index );    // per thread
+//     bool hit = reader.contains( key );
+//     {
+//         auto snap = reader.pin();    // iterators stay valid while it lives
+//         auto it = snap.find( key );
+//     }
+//     index.rebuild( new_keys );    // from any thread
+//
+// Readers must be gone before the snapshot_index is destroyed.
+template< typename Index_T >
+class snapshot_index
+{
+    struct generation;
+
+public:
+    using index_type     = Index_T;
+    using value_type     = typename std::iterator_traits< typename Index_T::const_iterator >::value_type;
+    using container_type = std::vector< value_type >;
+    using const_iterator = typename container_type::const_iterator;
+
+    static const size_t default_max_readers = 64;
+
+    class reader;
+
+    // A pinned version: neither its keys nor its index are freed before the
+    // snapshot is destroyed.
+    class snapshot
+    {
+    public:
+        snapshot( snapshot&& other ) : owner_( other.owner_ ), generation_( other.generation_ )
+        {
+            other.owner_ = nullptr;
+        }
+
+        snapshot( const snapshot& ) = delete;
+        snapshot& operator=( const snapshot& ) = delete;
+
+        ~snapshot()
+        {
+            if( owner_ )
+            {
+                owner_->unpin();
+            }
+        }
+
+        const index_type& index() const { return generation_->index; }
+        const container_type& data() const { return generation_->data; }
+        uint64_t version() const { return generation_->number; }
+
+        const_iterator find( const value_type& key ) const { return generation_->index.find( key ); }
+        const_iterator end() const { return generation_->data.end(); }
+
+    private:
+        friend class reader;
+
+        snapshot( reader* owner, const generation* v ) : owner_( owner ), generation_( v ) {}
+
+        reader* owner_;
+        const generation* generation_;
+    };
+
+    // A reading thread's slot. Not shared between threads; pins nest.
+    class reader
+    {
+    public:
+        explicit reader( snapshot_index& owner ) : owner_( owner ), slot_( owner.claim() ) {}
+
+        reader( const reader& ) = delete;
+        reader& operator=( const reader& ) = delete;
+
+        ~reader()
+        {
+            owner_.slots_[ slot_ ].used.store( false );
+        }
+
+        snapshot pin()
+        {
+            if( 0 == depth_++ )
+            {
+                owner_.slots_[ slot_ ].epoch.store( owner_.epoch_.load() );
+            }
+            return snapshot( this, owner_.current_.load() );
+        }
+
+        bool contains( const value_type& key )
+        {
+            snapshot snap = pin();
+            return snap.end() != snap.find( key );
+        }
+
+    private:
+        friend class snapshot;
+
+        snapshot_index& owner_;
+        size_t slot_;
+        size_t depth_ = 0;
+
+        void unpin()
+        {
+            if( 0 == --depth_ )
+            {
+                owner_.slots_[ slot_ ].epoch.store( idle, std::memory_order_release );
+            }
+        }
+    };
+
+    explicit snapshot_index( container_type data, size_t max_readers = default_max_readers )
+        : slots_( max_readers )
+    {
+        current_.store( new generation( std::move( data ), 0 ) );
+    }
+
+    snapshot_index( const snapshot_index& ) = delete;
+    snapshot_index& operator=( const snapshot_index& ) = delete;
+
+    ~snapshot_index()
+    {
+        delete current_.load();
+        for( auto& r : retired_ )
+        {
+            delete r.first;
+        }
+    }
+
+    // Builds an index over data and publishes it, returns its version. The
+    // build runs outside the writer lock, only the exchange is serialised.
+    // Frees the versions the readers are done with before it returns.
+    uint64_t rebuild( container_type data )
+    {
+        std::unique_ptr< generation > next( new generation( std::move( data ), 0 ) );
+
+        std::lock_guard< std::mutex > lock( mutex_ );
+        next->number = current_.load()->number + 1;
+        uint64_t number = next->number;
+        generation* old = current_.exchange( next.release() );
+        // Readers that announce this epoch or a later one load the new
+        // version, the ones before it may still hold old.
+        retired_.emplace_back( old, epoch_.fetch_add( 1 ) + 1 );
+        reclaim();
+        return number;
+    }
+
+    // Frees the replaced versions no reader holds any more.
+    void collect()
+    {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        reclaim();
+    }
+
+    // Number of the published version, 0 for the one the constructor built.
+    uint64_t version() const
+    {
+        return current_.load()->number;
+    }
+
+    // Replaced versions a reader may still hold.
+    size_t retired() const
+    {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return retired_.size();
+    }
+
+    size_t max_readers() const
+    {
+        return slots_.size();
+    }
+
+private:
+    struct generation
+    {
+        container_type data;
+        index_type index;
+        uint64_t number;
+
+        generation( container_type&& keys, uint64_t n ) : data( std::move( keys ) ), index( data ), number( n )
+        {
+            index.build_index();
+        }
+    };
+
+    static const uint64_t idle = ~uint64_t( 0 );
+
+    // One cache line per reader, so announcing does not bounce the
+    // neighbours' lines.
+    struct slot
+    {
+        std::atomic< uint64_t > epoch{ idle };
+        std::atomic< bool > used{ false };
+        char pad[ cache_line_size - sizeof( std::atomic< uint64_t > ) - sizeof( std::atomic< bool > ) ];
+    };
+
+    std::atomic< generation* > current_;
+    std::atomic< uint64_t > epoch_{ 0 };
+    std::vector< slot, aligned_allocator< slot > > slots_;
+    mutable std::mutex mutex_;
+    // Replaced versions with the epoch their exchange started.
+    std::vector< std::pair< generation*, uint64_t > > retired_;
+
+    size_t claim()
+    {
+        for( size_t i = 0; i < slots_.size(); ++i )
+        {
+            bool used = false;
+            if( !slots_[ i ].used.load() && slots_[ i ].used.compare_exchange_strong( used, true ) )
+            {
+                return i;
+            }
+        }
+        throw std::runtime_error( "vecidx: more than " + std::to_string( slots_.size() ) + " snapshot readers" );
+    }
+
+    // The announce in pin() and the exchange in rebuild() are sequentially
+    // consistent, so a reader this scan sees idle or past a version's epoch
+    // loads a later version.
+    void reclaim()
+    {
+        uint64_t oldest = idle;
+        for( const slot& s : slots_ )
+        {
+            oldest = std::min( oldest, s.epoch.load() );
+        }
+        size_t kept = 0;
+        for( auto& r : retired_ )
+        {
+            if( r.second <= oldest )
+            {
+                delete r.first;
+            }
+            else
+            {
+                retired_[ kept++ ] = r;
+            }
+        }
+        retired_.resize( kept );
+    }
+};
+
+template< typename Index_T >
+const size_t snapshot_index< Index_T >::default_max_readers;
+
+template< typename Index_T >
+const uint64_t snapshot_index< Index_T >::idle;
+
+} // namespace vecidx
+
+#endif // VECIDX_SNAPSHOT_H
@@ -0,0 +1,227 @@
+#ifndef VECIDX_STATS_H
+#define VECIDX_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined( __linux__ )
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace vecidx {
+
+// Stats policies of the index templates. find() reports to the policy every
+// level it walks, with the keys compared there, every comparison of the
+// final search and the size of the range that search covers.
+//
+// no_stats, the default, has empty hooks and no state, so the compiler
+// drops them. lookup_stats sums them up; it lives in the index and is not
+// synchronised, so measure with one thread per index.
+struct no_stats
+{
+    static constexpr bool enabled = false;
+
+    void lookup() {}
+    void level( size_t ) {}
+    void compare() {}
+    void window( size_t ) {}
+};
+
+class lookup_stats
+{
+public:
+    static constexpr bool enabled = true;
+
+    void lookup() { ++lookups_; }
+    void level( size_t compares ) { ++levels_; compares_ += compares; }
+    void compare() { ++compares_; }
+    void window( size_t size ) { window_ += size; }
+
+    void reset()
+    {
+        *this = lookup_stats();
+    }
+
+    uint64_t lookups() const { return lookups_; }
+    uint64_t compares() const { return compares_; }
+    uint64_t levels() const { return levels_; }
+    uint64_t window() const { return window_; }
+
+    // Averages per lookup.
+    double compares_per_lookup() const { return average( compares_ ); }
+    double levels_per_lookup() const { return average( levels_ ); }
+    double window_per_lookup() const { return average( window_ ); }
+
+private:
+    uint64_t lookups_ = 0;
+    uint64_t compares_ = 0;
+    uint64_t levels_ = 0;
+    uint64_t window_ = 0;
+
+    double average( uint64_t sum ) const
+    {
+        return 0 == lookups_ ? 0 : static_cast< double >( sum ) / lookups_;
+    }
+};
+
+namespace detail {
+
+// Comparator that reports every call to a stats policy.
+template< typename Comp_T, typename Stats_T >
+struct counted_compare
+{
+    Comp_T comp;
+    Stats_T& stats;
+
+    template< typename Lhs_T, typename Rhs_T >
+    bool operator()( const Lhs_T& lhs, const Rhs_T& rhs ) const
+    {
+        stats.compare();
+        return comp( lhs, rhs );
+    }
+};
+
+template< typename Comp_T, typename Stats_T >
+counted_compare< Comp_T, Stats_T > counted( Comp_T comp, Stats_T& stats )
+{
+    return counted_compare< Comp_T, Stats_T >{ comp, stats };
+}
+
+} // namespace detail
+
+// Hardware counters of the calling thread around a stretch of lookups:
+// last level cache misses, branch mispredicts and data TLB misses, from
+// perf_event_open on Linux. Counters the kernel or the CPU refuses
+// (perf_event_paranoid, containers, virtual machines) are unavailable and
+// read as 0; elsewhere none are available.
+class perf_counters
+{
+public:
+    enum event { llc_misses, branch_misses, dtlb_misses, event_count };
+
+    static const char* name( event e )
+    {
+        switch( e )
+        {
+        case llc_misses:    return "llc_misses";
+        case branch_misses: return "branch_misses";
+        default:            return "dtlb_misses";
+        }
+    }
+
+    perf_counters()
+    {
+        for( int e = 0; e < event_count; ++e )
+        {
+            fd_[ e ] = -1;
+            value_[ e ] = 0;
+        }
+#if defined( __linux__ ) && defined( SYS_perf_event_open )
+        const uint64_t config[ event_count ][ 2 ] =
+        {
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                                  ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) |
+                                  ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ) },
+        };
+        // One group, so the counters run over the same instructions.
+        for( int e = 0; e < event_count; ++e )
+        {
+            perf_event_attr attr;
+            std::memset( &attr, 0, sizeof( attr ) );
+            attr.size = sizeof( attr );
+            attr.type = static_cast< uint32_t >( config[ e ][ 0 ] );
+            attr.config = config[ e ][ 1 ];
+            attr.disabled = leader() < 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd_[ e ] = static_cast< int >( syscall( SYS_perf_event_open, &attr, 0, -1, leader(), 0 ) );
+        }
+#endif
+    }
+
+    perf_counters( const perf_counters& ) = delete;
+    perf_counters& operator=( const perf_counters& ) = delete;
+
+    ~perf_counters()
+    {
+#if defined( __linux__ )
+        for( int e = 0; e < event_count; ++e )
+        {
+            if( fd_[ e ] >= 0 )
+            {
+                close( fd_[ e ] );
+            }
+        }
+#endif
+    }
+
+    bool available( event e ) const
+    {
+        return fd_[ e ] >= 0;
+    }
+
+    // Zeroes and starts the counters.
+    void start()
+    {
+#if defined( __linux__ )
+        if( leader() >= 0 )
+        {
+            ioctl( leader(), PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP );
+            ioctl( leader(), PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP );
+        }
+#endif
+    }
+
+    // Stops the counters and reads them.
+    void stop()
+    {
+#if defined( __linux__ )
+        if( leader() >= 0 )
+        {
+            ioctl( leader(), PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP );
+        }
+        for( int e = 0; e < event_count; ++e )
+        {
+            uint64_t val = 0;
+            if( fd_[ e ] < 0 || sizeof( val ) != read( fd_[ e ], &val, sizeof( val ) ) )
+            {
+                val = 0;
+            }
+            value_[ e ] = val;
+        }
+#endif
+    }
+
+    // Count of e between the last start() and stop().
+    uint64_t value( event e ) const
+    {
+        return value_[ e ];
+    }
+
+private:
+    int fd_[ event_count ];
+    uint64_t value_[ event_count ];
+
+    // First counter that opened, the others are in its group.
+    int leader() const
+    {
+        for( int e = 0; e < event_count; ++e )
+        {
+            if( fd_[ e ] >= 0 )
+            {
+                return fd_[ e ];
+            }
+        }
+        return -1;
+    }
+};
+
+} // namespace vecidx
+
+#endif // VECIDX_STATS_H
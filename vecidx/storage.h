@@ -0,0 +1,509 @@
+#ifndef VECIDX_STORAGE_H
+#define VECIDX_STORAGE_H
+
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+#include "isa.h"
+#include "allocator.h"
+#include "batch.h"
+#include "bitpack.h"
+#include "build.h"
+#include "image.h"
+
+namespace vecidx {
+
+// Storage policies for the index layouts.
+//
+// position_only keeps just the positions into vector_, every comparison
+// reads vector_[ pos ]: the smallest index, but two dependent misses per
+// probe. key_inline keeps a copy of each key in a second array laid out
+// like the positions (struct of arrays), so a search only reads the
+// index's own cache lines and touches vector_ once for the result.
+//
+// packed compresses both, for indexes too large for the cache or for RAM:
+// every block_size slots keep their keys and positions as the distance to
+// the block's smallest one, bit-packed at the width the largest distance
+// needs. An uncompressed header per block holds the bases, the widths and
+// the block's first key, so partition_point() picks its block from the
+// headers and unpacks only that one, with the SIMD kernels. It takes
+// integer keys and suits the sorted layouts, vector_index and tree_index,
+// whose blocks hold close keys.
+struct position_only {};
+struct key_inline {};
+struct packed {};
+
+// Alloc_T allocates the layout arrays, rebound to each element type.
+template< typename Storage_T, typename Size_T, typename VecType_T,
+          typename Alloc_T = aligned_allocator< VecType_T > >
+class index_storage;
+
+namespace detail {
+
+inline void check_storage( const image_reader& image, uint64_t image_id )
+{
+    if( image_id != image.param( 0 ) )
+    {
+        throw image_error( "index image was saved with another storage policy" );
+    }
+}
+
+// First i of [first, last) with !pred( storage.key( i ) ), pred being true
+// for a prefix of the range.
+template< typename Storage_T, typename Pred_T >
+size_t partition_point( const Storage_T& storage, size_t first, size_t last, Pred_T pred )
+{
+    size_t count = last - first;
+    while( count > 0 )
+    {
+        size_t step = count / 2;
+        if( pred( storage.key( first + step ) ) )
+        {
+            first += step + 1;
+            count -= step + 1;
+        }
+        else
+        {
+            count = step;
+        }
+    }
+    return first;
+}
+
+} // namespace detail
+
+template< typename Size_T, typename VecType_T, typename Alloc_T >
+class index_storage< position_only, Size_T, VecType_T, Alloc_T >
+{
+public:
+    using size_type   = Size_T;
+    using vector_type = VecType_T;
+
+    // Bytes per slot of the layout, to prefetch blocks of slots.
+    constexpr static size_t slot_size = sizeof( size_type );
+    // Tells the layouts apart in index images.
+    constexpr static uint64_t image_id = 0;
+
+    index_storage( const std::vector< vector_type >& vec, const Alloc_T& alloc = Alloc_T() )
+        : vector_( vec ), pos_( detail::rebind_alloc< Alloc_T, size_type >( alloc ) ) {}
+
+    template< typename Positions_T >
+    void assign( const Positions_T& pos )
+    {
+        pos_.assign( pos.begin(), pos.end() );
+    }
+
+    size_t size() const
+    {
+        return pos_.size();
+    }
+
+    const vector_type& key( size_t i ) const
+    {
+        return vector_[ pos_[ i ] ];
+    }
+
+    size_type position( size_t i ) const
+    {
+        return pos_[ i ];
+    }
+
+    // Bytes of the layout arrays.
+    size_t memory_usage() const
+    {
+        return pos_.memory_usage();
+    }
+
+    // Start of the layout, slot i is slot_size * i bytes further.
+    const void* data() const
+    {
+        return pos_.data();
+    }
+
+    // Prefetches what key( i ) will read.
+    void touch( size_t i ) const
+    {
+        prefetch( &vector_[ pos_[ i ] ] );
+    }
+
+    // touch() reads slot i to find the key, a coroutine that must not stall
+    // on it prefetches the slot first.
+    constexpr static bool indirect_keys = true;
+
+    void touch_slot( size_t i ) const
+    {
+        prefetch( &pos_[ i ] );
+    }
+
+    // First slot of [first, last) whose key fails pred, pred being true
+    // for a prefix of the slots.
+    template< typename Pred_T >
+    size_t partition_point( size_t first, size_t last, Pred_T pred ) const
+    {
+        return detail::partition_point( *this, first, last, pred );
+    }
+
+    // Adds the layout to an index image, with the policy in param 0.
+    void save( image_writer& image ) const
+    {
+        image.param( 0, image_id );
+        image.section( pos_.data(), pos_.size() );
+    }
+
+    // Takes the layout from section first of an image, returns the next.
+    size_t load( const image_reader& image, size_t first )
+    {
+        detail::check_storage( image, image_id );
+        image.section( first, pos_ );
+        return first + 1;
+    }
+
+private:
+    const std::vector< vector_type >& vector_;
+    buffer< size_type, detail::rebind_alloc< Alloc_T, size_type > > pos_;
+};
+
+template< typename Size_T, typename VecType_T, typename Alloc_T >
+class index_storage< key_inline, Size_T, VecType_T, Alloc_T >
+{
+public:
+    using size_type   = Size_T;
+    using vector_type = VecType_T;
+
+    constexpr static size_t slot_size = sizeof( vector_type );
+    constexpr static uint64_t image_id = 1;
+
+    index_storage( const std::vector< vector_type >& vec, const Alloc_T& alloc = Alloc_T() )
+        : vector_( vec ), keys_( alloc ), pos_( detail::rebind_alloc< Alloc_T, size_type >( alloc ) ) {}
+
+    template< typename Positions_T >
+    void assign( const Positions_T& pos )
+    {
+        pos_.assign( pos.begin(), pos.end() );
+        keys_.resize( pos_.size() );
+        VECIDX_OMP( parallel for num_threads( build_threads( pos_.size() ) ) )
+        for( ptrdiff_t i = 0; i < static_cast< ptrdiff_t >( pos_.size() ); ++i )
+        {
+            keys_[ i ] = vector_[ pos_[ i ] ];
+        }
+    }
+
+    size_t size() const
+    {
+        return pos_.size();
+    }
+
+    const vector_type& key( size_t i ) const
+    {
+        return keys_[ i ];
+    }
+
+    size_type position( size_t i ) const
+    {
+        return pos_[ i ];
+    }
+
+    size_t memory_usage() const
+    {
+        return pos_.memory_usage() + keys_.memory_usage();
+    }
+
+    const void* data() const
+    {
+        return keys_.data();
+    }
+
+    void touch( size_t i ) const
+    {
+        prefetch( &keys_[ i ] );
+    }
+
+    constexpr static bool indirect_keys = false;
+
+    void touch_slot( size_t i ) const
+    {
+        touch( i );
+    }
+
+    template< typename Pred_T >
+    size_t partition_point( size_t first, size_t last, Pred_T pred ) const
+    {
+        return detail::partition_point( *this, first, last, pred );
+    }
+
+    void save( image_writer& image ) const
+    {
+        image.param( 0, image_id );
+        image.section( pos_.data(), pos_.size() );
+        image.section( keys_.data(), keys_.size() );
+    }
+
+    size_t load( const image_reader& image, size_t first )
+    {
+        detail::check_storage( image, image_id );
+        image.section( first, pos_ );
+        image.section( first + 1, keys_ );
+        if( keys_.size() != pos_.size() )
+        {
+            throw image_error( "index image does not match the index layout" );
+        }
+        return first + 2;
+    }
+
+private:
+    const std::vector< vector_type >& vector_;
+    buffer< vector_type, Alloc_T > keys_;
+    buffer< size_type, detail::rebind_alloc< Alloc_T, size_type > > pos_;
+};
+
+template< typename Size_T, typename VecType_T, typename Alloc_T >
+class index_storage< packed, Size_T, VecType_T, Alloc_T >
+{
+    static_assert( std::is_integral< VecType_T >::value && !std::is_same< VecType_T, bool >::value,
+                   "packed storage needs integer keys" );
+
+public:
+    using size_type   = Size_T;
+    using vector_type = VecType_T;
+
+    constexpr static size_t block_size = 128;
+    constexpr static uint64_t image_id = 2;
+
+    index_storage( const std::vector< vector_type >& vec, const Alloc_T& alloc = Alloc_T() )
+        : vector_( vec ), isa_( isa::detect() ), head_( detail::rebind_alloc< Alloc_T, block >( alloc ) ),
+          first_( alloc ), words_( detail::rebind_alloc< Alloc_T, uint64_t >( alloc ) ) {}
+
+    // Widths per block, then the word offsets, then the packing: the first
+    // and last steps run a block per iteration in parallel.
+    template< typename Positions_T >
+    void assign( const Positions_T& pos )
+    {
+        size_t size = pos.size();
+        size_t blocks = ( size + block_size - 1 ) / block_size;
+        head_.assign( blocks, block() );
+        first_.resize( blocks );
+
+        VECIDX_OMP( parallel for num_threads( build_threads( size ) ) )
+        for( ptrdiff_t b = 0; b < static_cast< ptrdiff_t >( blocks ); ++b )
+        {
+            size_t first = b * block_size;
+            size_t last = std::min( first + block_size, size );
+            vector_type key_min = vector_[ pos[ first ] ];
+            vector_type key_max = key_min;
+            size_type pos_min = pos[ first ];
+            size_type pos_max = pos_min;
+            for( size_t i = first; i < last; ++i )
+            {
+                key_min = std::min( key_min, vector_[ pos[ i ] ] );
+                key_max = std::max( key_max, vector_[ pos[ i ] ] );
+                pos_min = std::min( pos_min, static_cast< size_type >( pos[ i ] ) );
+                pos_max = std::max( pos_max, static_cast< size_type >( pos[ i ] ) );
+            }
+            block& head = head_[ b ];
+            head.key_base = static_cast< key_bits_type >( key_min );
+            head.pos_base = pos_min;
+            head.key_bits = detail::bit_width( distance( key_min, key_max ) );
+            head.pos_bits = detail::bit_width( pos_max - pos_min );
+            head.count = static_cast< uint32_t >( last - first );
+            first_[ b ] = vector_[ pos[ first ] ];
+        }
+
+        size_t words = 0;
+        for( size_t b = 0; b < blocks; ++b )
+        {
+            head_[ b ].offset = words;
+            words += detail::packed_words( block_size, head_[ b ].key_bits ) +
+                     detail::packed_words( block_size, head_[ b ].pos_bits );
+        }
+        // The unpack kernels read a word past the values.
+        words_.assign( words + 1, 0 );
+
+        VECIDX_OMP( parallel for num_threads( build_threads( size ) ) )
+        for( ptrdiff_t b = 0; b < static_cast< ptrdiff_t >( blocks ); ++b )
+        {
+            const block& head = head_[ b ];
+            uint64_t* keys = &words_[ head.offset ];
+            uint64_t* positions = keys + detail::packed_words( block_size, head.key_bits );
+            for( size_t i = 0; i < head.count; ++i )
+            {
+                size_type p = pos[ b * block_size + i ];
+                detail::pack_bits( keys, i, head.key_bits,
+                                   distance( static_cast< vector_type >( head.key_base ), vector_[ p ] ) );
+                detail::pack_bits( positions, i, head.pos_bits, p - head.pos_base );
+            }
+        }
+        size_ = size;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    // Keys are decoded, so they come by value.
+    vector_type key( size_t i ) const
+    {
+        const block& head = head_[ i / block_size ];
+        return make_key( head, detail::unpack_bits( &words_[ head.offset ], i % block_size, head.key_bits ) );
+    }
+
+    size_type position( size_t i ) const
+    {
+        const block& head = head_[ i / block_size ];
+        const uint64_t* positions = &words_[ head.offset + detail::packed_words( block_size, head.key_bits ) ];
+        return static_cast< size_type >( head.pos_base + detail::unpack_bits( positions, i % block_size, head.pos_bits ) );
+    }
+
+    size_t memory_usage() const
+    {
+        return head_.memory_usage() + first_.memory_usage() + words_.memory_usage();
+    }
+
+    void touch( size_t i ) const
+    {
+        const block& head = head_[ i / block_size ];
+        prefetch( &words_[ head.offset + ( i % block_size ) * head.key_bits / 64 ] );
+    }
+
+    constexpr static bool indirect_keys = false;
+
+    void touch_slot( size_t i ) const
+    {
+        touch( i );
+    }
+
+    // The block from the first keys of the headers, then a search of that
+    // block unpacked.
+    template< typename Pred_T >
+    size_t partition_point( size_t first, size_t last, Pred_T pred ) const
+    {
+        if( first == last )
+        {
+            return first;
+        }
+
+        // Blocks after the one of first whose first key still passes.
+        size_t lo = first / block_size + 1;
+        size_t hi = ( last - 1 ) / block_size + 1;
+        while( lo < hi )
+        {
+            size_t middle = lo + ( hi - lo ) / 2;
+            if( pred( first_[ middle ] ) )
+            {
+                lo = middle + 1;
+            }
+            else
+            {
+                hi = middle;
+            }
+        }
+
+        size_t b = lo - 1;
+        first = std::max( first, b * block_size );
+        last = std::min( last, ( b + 1 ) * block_size );
+        return isa::dispatch( isa_, [&]( auto tag ){ return search_block( b, first, last, pred, tag ); } );
+    }
+
+    void save( image_writer& image ) const
+    {
+        image.param( 0, image_id );
+        image.section( head_.data(), head_.size() );
+        image.section( first_.data(), first_.size() );
+        image.section( words_.data(), words_.size() );
+    }
+
+    size_t load( const image_reader& image, size_t first )
+    {
+        detail::check_storage( image, image_id );
+        image.section( first, head_ );
+        image.section( first + 1, first_ );
+        image.section( first + 2, words_ );
+
+        // Const iteration: the buffers are views now, not owned.
+        size_t size = 0;
+        size_t words = 0;
+        bool valid = head_.size() == first_.size();
+        for( const block& head : head_ )
+        {
+            valid &= head.offset == words && head.key_bits <= 64 && head.pos_bits <= 64 &&
+                     head.count > 0 && head.count <= block_size;
+            size += head.count;
+            words += detail::packed_words( block_size, head.key_bits ) +
+                     detail::packed_words( block_size, head.pos_bits );
+        }
+        // Only the last block may be short.
+        valid &= head_.empty() || size > ( head_.size() - 1 ) * block_size;
+        if( !valid || words_.size() != words + 1 )
+        {
+            throw image_error( "index image does not match the index layout" );
+        }
+        size_ = size;
+        return first + 3;
+    }
+
+private:
+    using key_bits_type = typename std::make_unsigned< vector_type >::type;
+
+    // Uncompressed block header, no padding so images are byte exact.
+    struct block
+    {
+        uint64_t offset;    // first word of the keys, the positions follow
+        uint64_t key_base;  // smallest key, as key_bits_type
+        uint64_t pos_base;
+        uint16_t key_bits;
+        uint16_t pos_bits;
+        uint32_t count;
+    };
+
+    const std::vector< vector_type >& vector_;
+    isa::level isa_;
+    size_t size_ = 0;
+    buffer< block, detail::rebind_alloc< Alloc_T, block > > head_;
+    buffer< vector_type, Alloc_T > first_;
+    buffer< uint64_t, detail::rebind_alloc< Alloc_T, uint64_t > > words_;
+
+    // key - base, in the unsigned type so signed keys wrap around right.
+    static uint64_t distance( vector_type base, vector_type key )
+    {
+        return static_cast< key_bits_type >( static_cast< key_bits_type >( key ) -
+                                             static_cast< key_bits_type >( base ) );
+    }
+
+    static vector_type make_key( const block& head, uint64_t delta )
+    {
+        return static_cast< vector_type >( static_cast< key_bits_type >( head.key_base + delta ) );
+    }
+
+    template< typename Pred_T, typename Isa_T >
+    size_t search_block( size_t b, size_t first, size_t last, Pred_T pred, Isa_T ) const
+    {
+        const block& head = head_[ b ];
+        alignas( cache_line_size ) uint64_t delta[ block_size ];
+        detail::bit_unpacker< Isa_T >::unpack( &words_[ head.offset ], head.key_bits, block_size, delta );
+
+        size_t base = b * block_size;
+        size_t pos = first - base;
+        size_t count = last - first;
+        while( count > 0 )
+        {
+            size_t step = count / 2;
+            if( pred( make_key( head, delta[ pos + step ] ) ) )
+            {
+                pos += step + 1;
+                count -= step + 1;
+            }
+            else
+            {
+                count = step;
+            }
+        }
+        return base + pos;
+    }
+};
+
+} // namespace vecidx
+
+#endif // VECIDX_STORAGE_H
@@ -0,0 +1,316 @@
+#ifndef VECIDX_STREE_INDEX_H
+#define VECIDX_STREE_INDEX_H
+
+#include <cstdint>
+#include <vector>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <string>
+#include <iterator>
+#include <utility>
+
+#include "isa.h"
+#include "allocator.h"
+#include "batch.h"
+#include "build.h"
+#include "smart_step.h"
+#include "image.h"
+#include "rank_iterator.h"
+
+namespace vecidx {
+
+// Largest key, used to pad the tree. NaN for floating point, which sorts
+// after every number in key_less.
+template< typename VecType_T >
+inline VecType_T max_key()
+{
+    return std::numeric_limits< VecType_T >::has_quiet_NaN ?
+               std::numeric_limits< VecType_T >::quiet_NaN() :
+               std::numeric_limits< VecType_T >::max();
+}
+
+// Implicit static B+-tree (S+-tree). Every node is one cache line of keys
+// and the layers live in one aligned buffer, leaves first; the children of
+// node k in the layer above are k * (node_size + 1) + i, so there are no
+// pointers to follow. A node is searched with the smart_index kernels of
+// the CPU, one to four SIMD compares depending on the width.
+//
+// The leaves hold every key in sorted order, each inner key is the first
+// key of the subtree to its right. Keys are ordered by key_less.
+template< typename Size_T,
+          typename VecType_T,
+          typename Alloc_T = aligned_allocator< VecType_T > >
+class stree_index
+{
+public:
+    using size_type      = Size_T;
+    using vector_type    = VecType_T;
+    using allocator_type = Alloc_T;
+    using const_iterator = typename std::vector< vector_type >::const_iterator;
+
+    stree_index( const std::vector<VecType_T>& vec, isa::level lvl = isa::detect(),
+                 const Alloc_T& alloc = Alloc_T() )
+        : vector_( vec ), isa_( lvl ), tree_( alloc ),
+          index_( detail::rebind_alloc< Alloc_T, size_type >( alloc ) ), offset_( alloc ) {}
+
+    void build_index()
+    {
+        std::vector< size_type > idx = detail::sorted_permutation< size_type >( vector_, key_less< vector_type >() );
+        index_.assign( idx.begin(), idx.end() );
+
+        size_t size = vector_.size();
+        offset_.assign( 1, 0 );
+        do
+        {
+            offset_.push_back( offset_.back() + blocks( size ) * node_size );
+            size = prev_keys( size );
+        } while( offset_.back() - offset_[ offset_.size() - 2 ] > node_size );
+
+        tree_.assign( offset_.back(), max_key< vector_type >() );
+        VECIDX_OMP( parallel for num_threads( build_threads( vector_.size() ) ) )
+        for( ptrdiff_t i = 0; i < static_cast< ptrdiff_t >( vector_.size() ); ++i )
+        {
+            tree_[ i ] = vector_[ idx[ i ] ];
+        }
+
+        // Every layer reads only the leaves, so each one is a parallel loop.
+        for( size_t h = 1; h < height(); ++h )
+        {
+            VECIDX_OMP( parallel for num_threads( build_threads( vector_.size() ) ) )
+            for( ptrdiff_t i = 0; i < static_cast< ptrdiff_t >( offset_[ h + 1 ] - offset_[ h ] ); ++i )
+            {
+                // Leftmost leaf of the subtree right of key i.
+                size_t k = i / node_size;
+                k = k * (node_size + 1) + (i - k * node_size) + 1;
+                for( size_t l = 1; l < h; ++l )
+                {
+                    k *= node_size + 1;
+                }
+                if( k * node_size < vector_.size() )
+                {
+                    tree_[ offset_[ h ] + i ] = tree_[ k * node_size ];
+                }
+            }
+        }
+    }
+
+    // First element not less than key.
+    const_iterator lower_bound( const vector_type& key ) const
+    {
+        return position( isa::dispatch( isa_, [&]( auto tag ){ return rank( key, tag ); } ) );
+    }
+
+    const_iterator find( const vector_type& key ) const
+    {
+        size_t pos = isa::dispatch( isa_, [&]( auto tag ){ return rank( key, tag ); } );
+        key_less< vector_type > less;
+        if( pos < vector_.size() && !less( key, tree_[ pos ] ) )
+        {
+            return position( pos );
+        }
+        return vector_.cend();
+    }
+
+    // Writes lower_bound( key ) of every key in [first, last) to out.
+    template< typename InputIt, typename OutputIt >
+    OutputIt lower_bound_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return batch( false, first, last, out, tag ); } );
+    }
+
+    // Writes find( key ) of every key in [first, last) to out.
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag ){ return batch( true, first, last, out, tag ); } );
+    }
+
+    using sorted_iterator = rank_iterator< stree_index >;
+
+    // Element at sorted position rank.
+    const_iterator nth( size_t rank ) const
+    {
+        return position( rank );
+    }
+
+    sorted_iterator sorted_begin() const
+    {
+        return sorted_iterator( this, 0 );
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        return sorted_iterator( this, vector_.size() );
+    }
+
+    // Elements equal to key. The leaves are the keys in sorted order, the
+    // end of the run is found on them.
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const vector_type& key ) const
+    {
+        size_t first = isa::dispatch( isa_, [&]( auto tag ){ return rank( key, tag ); } );
+        size_t last = detail::gallop_upper_bound( key, tree_.data(), first, vector_.size() );
+        return std::make_pair( sorted_iterator( this, first ), sorted_iterator( this, last ) );
+    }
+
+    // Elements in [lo, hi).
+    std::pair< sorted_iterator, sorted_iterator > sorted_range( const vector_type& lo, const vector_type& hi ) const
+    {
+        return isa::dispatch( isa_, [&]( auto tag )
+        {
+            size_t first = rank( lo, tag );
+            size_t last = std::max( first, rank( hi, tag ) );
+            return std::make_pair( sorted_iterator( this, first ), sorted_iterator( this, last ) );
+        });
+    }
+
+    // Number of elements in [lo, hi).
+    size_t count( const vector_type& lo, const vector_type& hi ) const
+    {
+        auto r = sorted_range( lo, hi );
+        return r.second - r.first;
+    }
+
+    // Writes the built index to path, for load() to map it back instead of
+    // building.
+    void save( const std::string& path ) const
+    {
+        image_writer image( "stree_index", vector_, size_type() );
+        std::vector< uint64_t > offset( offset_.begin(), offset_.end() );
+        image.section( tree_.data(), tree_.size() );
+        image.section( index_.data(), index_.size() );
+        image.section( offset.data(), offset.size() );
+        image.save( path );
+    }
+
+    // Uses the image at path in place of build_index(), mapped and not
+    // copied. Throws image_error unless it is an image of this index type
+    // built from the same data.
+    void load( const std::string& path )
+    {
+        image_reader image( path, "stree_index", vector_, size_type() );
+        image.section( 0, tree_ );
+        image.section( 1, index_ );
+        offset_.clear();
+        image.copy< uint64_t >( 2, std::back_inserter( offset_ ) );
+        if( offset_.size() < 2 || offset_.back() != tree_.size() || index_.size() != vector_.size() )
+        {
+            throw image_error( path + " does not match the index layout" );
+        }
+    }
+
+    size_t height() const
+    {
+        return offset_.size() - 1;
+    }
+
+    // Bytes of the index, without the vector.
+    size_t memory_usage() const
+    {
+        return tree_.memory_usage() + index_.memory_usage() + offset_.capacity() * sizeof( size_t );
+    }
+
+    isa::level simd_level() const
+    {
+        return isa_;
+    }
+
+private:
+    constexpr static size_t node_size = cache_line_size / sizeof( vector_type );
+
+    const std::vector< vector_type >& vector_;
+    isa::level isa_;
+    buffer< vector_type, allocator_type > tree_;
+    buffer< size_type, detail::rebind_alloc< allocator_type, size_type > > index_;
+    // Start of every layer in tree_, leaves first, plus the total size.
+    std::vector< size_t, detail::rebind_alloc< allocator_type, size_t > > offset_;
+
+    // Nodes in a layer of size keys. An empty tree still gets one leaf, so
+    // a search always has a node to look at.
+    static size_t blocks( size_t size )
+    {
+        return std::max< size_t >( ( size + node_size - 1 ) / node_size, 1 );
+    }
+
+    // Keys in the layer above one of size keys.
+    static size_t prev_keys( size_t size )
+    {
+        return ( ( blocks( size ) + node_size ) / (node_size + 1) ) * node_size;
+    }
+
+    // Keys of the node less than key.
+    template< typename Isa_T >
+    static size_t node_rank( const vector_type& key, const vector_type* node )
+    {
+        using index = smart_index< vector_type, Isa_T >;
+        size_t ret = 0;
+        for( size_t i = 0; i < node_size; i += index::array_size )
+        {
+            ret += index::compare( key, node + i );
+        }
+        return ret;
+    }
+
+    // Sorted position of lower_bound( key ).
+    template< typename Isa_T >
+    size_t rank( const vector_type& key, Isa_T ) const
+    {
+        size_t k = 0;
+        for( size_t h = height() - 1; h > 0; --h )
+        {
+            size_t i = node_rank< Isa_T >( key, &tree_[ offset_[ h ] + k * node_size ] );
+            k = k * (node_size + 1) + i;
+        }
+        return k * node_size + node_rank< Isa_T >( key, &tree_[ k * node_size ] );
+    }
+
+    const_iterator position( size_t pos ) const
+    {
+        if( pos >= vector_.size() )
+        {
+            return vector_.cend();
+        }
+        auto ret = vector_.cbegin();
+        std::advance( ret, index_[ pos ] );
+        return ret;
+    }
+
+    // rank() of a group of keys in lock-step, one layer per round, with the
+    // next node of every key prefetched before the group moves on.
+    template< typename InputIt, typename OutputIt, typename Isa_T >
+    OutputIt batch( bool find, InputIt first, InputIt last, OutputIt out, Isa_T ) const
+    {
+        key_less< vector_type > less;
+        detail::for_each_group< vector_type >( first, last,
+            [&]( const vector_type* keys, size_t count )
+            {
+                size_t k[ batch_group_size ];
+                for( size_t g = 0; g < count; ++g )
+                {
+                    k[ g ] = 0;
+                }
+
+                for( size_t h = height() - 1; h > 0; --h )
+                {
+                    for( size_t g = 0; g < count; ++g )
+                    {
+                        size_t i = node_rank< Isa_T >( keys[ g ], &tree_[ offset_[ h ] + k[ g ] * node_size ] );
+                        k[ g ] = k[ g ] * (node_size + 1) + i;
+                        prefetch( &tree_[ offset_[ h - 1 ] + k[ g ] * node_size ] );
+                    }
+                }
+
+                for( size_t g = 0; g < count; ++g )
+                {
+                    size_t pos = k[ g ] * node_size + node_rank< Isa_T >( keys[ g ], &tree_[ k[ g ] * node_size ] );
+                    bool found = pos < vector_.size() && ( !find || !less( keys[ g ], tree_[ pos ] ) );
+                    *out++ = found ? position( pos ) : vector_.cend();
+                }
+            });
+        return out;
+    }
+};
+
+} // namespace vecidx
+
+#endif // VECIDX_STREE_INDEX_H
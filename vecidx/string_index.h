@@ -0,0 +1,191 @@
+#ifndef VECIDX_STRING_INDEX_H
+#define VECIDX_STRING_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iterator>
+#include <utility>
+#include <algorithm>
+
+#if defined( _MSC_VER )
+#include <stdlib.h>
+#endif
+
+#include "smart_step.h"
+
+namespace vecidx {
+
+namespace detail {
+
+// Byte order of strings: char_traits< char > compares as unsigned char.
+template< typename String_T >
+int string_compare( const String_T& lhs, const String_T& rhs )
+{
+    size_t size = std::min( lhs.size(), rhs.size() );
+    int ret = size ? std::memcmp( lhs.data(), rhs.data(), size ) : 0;
+    if( 0 != ret )
+    {
+        return ret;
+    }
+    return lhs.size() < rhs.size() ? -1 : lhs.size() > rhs.size();
+}
+
+// The 8 bytes of data from offset on, big endian, zero padded: the prefixes
+// of strings compare as unsigned integers in the order of the strings, but
+// for ties.
+inline uint64_t string_prefix( const char* data, size_t size, size_t offset )
+{
+    unsigned char bytes[ 8 ] = {};
+    // An empty string_view may have no data() at all.
+    if( nullptr != data && size > offset )
+    {
+        std::memcpy( bytes, data + offset, std::min< size_t >( size - offset, 8 ) );
+    }
+    uint64_t ret;
+    std::memcpy( &ret, bytes, 8 );
+#if defined( _MSC_VER )
+    return _byteswap_uint64( ret );
+#else
+    return __builtin_bswap64( ret );
+#endif
+}
+
+} // namespace detail
+
+// Index over a sorted vector of strings: std::string, or std::string_view
+// (C++17) into a shared buffer, anything with data() and size(). Every
+// string is cut down to a uint64_t of 8 bytes, big endian, which Index_T,
+// a smart_step by default, searches with its 64-bit kernels; full string
+// compares only break the ties between strings with equal prefixes.
+//
+// The prefix starts after the bytes every string shares, so a set of URLs
+// is told apart by what follows "https://". ref_ must be sorted in byte
+// order, the order of std::string.
+template< typename String_T = std::string,
+          typename Index_T = smart_step_auto< uint32_t, uint64_t > >
+class string_index
+{
+public:
+    using value_type      = String_T;
+    using index_type      = Index_T;
+    using const_iterator  = typename std::vector< value_type >::const_iterator;
+    using sorted_iterator = const_iterator;
+
+    string_index( const std::vector< value_type >& ref ) : ref_( ref ), index_( prefix_ ) {}
+
+    string_index( const string_index& ) = delete;
+    string_index& operator=( const string_index& ) = delete;
+
+    void build_index()
+    {
+        // ref_ is sorted, what the first and the last string share every
+        // string does.
+        offset_ = 0;
+        if( !ref_.empty() )
+        {
+            const value_type& first = ref_.front();
+            const value_type& last = ref_.back();
+            size_t size = std::min( first.size(), last.size() );
+            while( offset_ < size && first.data()[ offset_ ] == last.data()[ offset_ ] )
+            {
+                ++offset_;
+            }
+        }
+        prefix_.resize( ref_.size() );
+        for( size_t i = 0; i < ref_.size(); ++i )
+        {
+            prefix_[ i ] = detail::string_prefix( ref_[ i ].data(), ref_[ i ].size(), offset_ );
+        }
+        index_.build_index();
+    }
+
+    const_iterator find( const value_type& key ) const
+    {
+        auto r = equal_range( key );
+        return r.first != r.second ? r.first : ref_.end();
+    }
+
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        for( ; first != last; ++first )
+        {
+            *out++ = find( *first );
+        }
+        return out;
+    }
+
+    sorted_iterator sorted_begin() const
+    {
+        return ref_.begin();
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        return ref_.end();
+    }
+
+    // Strings equal to key: the run of its prefix from the index, narrowed
+    // by string compares.
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const value_type& key ) const
+    {
+        if( ref_.empty() )
+        {
+            return std::make_pair( ref_.end(), ref_.end() );
+        }
+        // Keys without the shared bytes sort before or after every string.
+        size_t size = std::min( key.size(), offset_ );
+        int shared = size ? std::memcmp( key.data(), ref_.front().data(), size ) : 0;
+        if( shared < 0 || ( 0 == shared && key.size() < offset_ ) )
+        {
+            return std::make_pair( ref_.begin(), ref_.begin() );
+        }
+        if( shared > 0 )
+        {
+            return std::make_pair( ref_.end(), ref_.end() );
+        }
+
+        auto run = index_.equal_range( detail::string_prefix( key.data(), key.size(), offset_ ) );
+        const_iterator first = ref_.begin() + std::distance( index_.sorted_begin(), run.first );
+        const_iterator last = ref_.begin() + std::distance( index_.sorted_begin(), run.second );
+        first = std::partition_point( first, last, [&]( const value_type& s ){ return detail::string_compare( s, key ) < 0; } );
+        last = std::partition_point( first, last, [&]( const value_type& s ){ return detail::string_compare( s, key ) <= 0; } );
+        return std::make_pair( first, last );
+    }
+
+    size_t count( const value_type& key ) const
+    {
+        auto r = equal_range( key );
+        return r.second - r.first;
+    }
+
+    // Bytes every string starts with, skipped by the prefixes.
+    size_t shared_bytes() const
+    {
+        return offset_;
+    }
+
+    const std::vector< uint64_t >& prefixes() const
+    {
+        return prefix_;
+    }
+
+    // Bytes of the prefixes and the index over them, without the strings.
+    size_t memory_usage() const
+    {
+        return prefix_.capacity() * sizeof( uint64_t ) + index_.memory_usage();
+    }
+
+private:
+    const std::vector< value_type >& ref_;
+    std::vector< uint64_t > prefix_;
+    index_type index_;
+    size_t offset_ = 0;
+};
+
+} // namespace vecidx
+
+#endif // VECIDX_STRING_INDEX_H
@@ -4,79 +4,329 @@
 #include <vector>
 #include <functional>
 #include <numeric>
+#include <string>
+#include <iterator>
+#include <utility>
 #include <algorithm>
 
+#include "batch.h"
+#include "build.h"
+#include "coro.h"
+#include "rank_iterator.h"
+#include "stats.h"
+#include "storage.h"
+
 namespace vecidx {
 
+// A top node of medians in preorder, searched like an implicit binary tree,
+// over get_index_size() sorted leaves. The top node and the leaves share one
+// flat layout, top node first; leaf i (1-based) is
+// [offset_[ i ], offset_[ i + 1 ]) and the top node is leaf 0. In sorted
+// order each leaf is followed by the top node key between it and the next.
 template< typename Size_T,
           typename VecType_T,
-          typename VecComp_T = std::less<VecType_T> >
+          typename VecComp_T = std::less<VecType_T>,
+          typename Storage_T = position_only,
+          typename Alloc_T = aligned_allocator< VecType_T >,
+          typename Stats_T = no_stats >
 class tree_index
 {
 public:
     typedef Size_T size_type;
     typedef VecType_T vector_type;
     typedef VecComp_T compare_type;
+    typedef Storage_T storage_type;
+    typedef Alloc_T allocator_type;
+    typedef Stats_T stats_type;
     typedef typename std::vector< vector_type >::const_iterator const_iterator;
+    typedef rank_iterator< tree_index > sorted_iterator;
 
-    tree_index( const std::vector<VecType_T>& vec ) : vector_( vec ) {}
+    tree_index( const std::vector<VecType_T>& vec, const Alloc_T& alloc = Alloc_T() )
+        : vector_( vec ), index_( vec, alloc ), offset_( alloc ), sep_( alloc ), rank_( alloc ) {}
 
     void build_index()
     {
-        std::vector< size_type > idx;
-        idx.resize( vector_.size(), 0 );
-        std::iota( idx.begin(), idx.end(), 0 );
+        std::vector< size_type > idx = detail::sorted_permutation< size_type >( vector_, compare_type() );
 
-        compare_type comp;
-        std::sort( idx.begin(), idx.end(),
-            [ & ]( const size_type& lhs, const size_type& rhs ) -> bool
-            {
-                return comp( vector_[ lhs ], vector_[ rhs ] );
-            } );
+        size_t index_size = get_index_size();
 
-        index_vector_.resize( 1 );
+        std::vector< size_type > top;
+        std::vector< std::pair< size_t, size_t > > leaves;
+        sep_.clear();
+        if( !idx.empty() )
+        {
+            fill_index( idx.begin(), idx.begin(), idx.end(), index_size, idx.front(), top, leaves, sep_ );
+        }
 
-        size_t index_size = get_index_size();
+        offset_.assign( 1, 0 );
+        offset_.push_back( top.size() );
+        for( const auto& leaf : leaves )
+        {
+            offset_.push_back( offset_.back() + leaf.second - leaf.first );
+        }
 
-        fill_index( idx.begin(), idx.end(), index_size );
+        // The leaves are most of the layout, one copy per leaf in parallel.
+        top.resize( offset_.back() );
+        VECIDX_OMP( parallel for num_threads( build_threads( idx.size() ) ) schedule( dynamic ) )
+        for( ptrdiff_t i = 0; i < static_cast< ptrdiff_t >( leaves.size() ); ++i )
+        {
+            std::copy( idx.begin() + leaves[ i ].first, idx.begin() + leaves[ i ].second,
+                       top.begin() + offset_[ i + 1 ] );
+        }
+        index_.assign( top );
+        set_ranks();
     }
     
+    // Writes the built index to path, for load() to map it back instead of
+    // building.
+    void save( const std::string& path ) const
+    {
+        image_writer image( "tree_index", vector_, size_type() );
+        index_.save( image );
+        std::vector< uint64_t > offset( offset_.begin(), offset_.end() );
+        std::vector< uint64_t > sep( sep_.begin(), sep_.end() );
+        image.section( offset.data(), offset.size() );
+        image.section( sep.data(), sep.size() );
+        image.save( path );
+    }
+
+    // Uses the image at path in place of build_index(), mapped and not
+    // copied. Throws image_error unless it is an image of this index type
+    // built from the same data.
+    void load( const std::string& path )
+    {
+        image_reader image( path, "tree_index", vector_, size_type() );
+        size_t next = index_.load( image, 0 );
+        offset_.clear();
+        sep_.clear();
+        image.copy< uint64_t >( next, std::back_inserter( offset_ ) );
+        image.copy< uint64_t >( next + 1, std::back_inserter( sep_ ) );
+        bool valid = offset_.size() >= 2 && offset_.back() == index_.size() &&
+                     sep_.size() + ( offset_.size() > 2 ? 3 : 2 ) == offset_.size();
+        for( size_t slot : sep_ )
+        {
+            valid &= no_separator == slot || slot < top_size();
+        }
+        if( !valid )
+        {
+            throw image_error( path + " does not match the index layout" );
+        }
+        set_ranks();
+    }
+
+    // Bytes of the index, without the vector.
+    size_t memory_usage() const
+    {
+        return index_.memory_usage() +
+               ( offset_.capacity() + sep_.capacity() + rank_.capacity() ) * sizeof( size_t );
+    }
+
+    // What find() reported to the stats policy: the top node levels, the
+    // comparisons of the walk and of the leaf search, and the leaf size.
+    const stats_type& stats() const
+    {
+        return stats_;
+    }
+
+    void reset_stats()
+    {
+        stats_ = stats_type();
+    }
+
+    // Element at sorted position rank.
+    const_iterator nth( size_t rank ) const
+    {
+        if( rank >= size() )
+        {
+            return vector_.cend();
+        }
+        size_t leaf = std::upper_bound( rank_.begin() + 1, rank_.end(), rank ) - rank_.begin() - 1;
+        size_t pos = offset_[ leaf ] + rank - rank_[ leaf ];
+        return position( pos < offset_[ leaf + 1 ] ? pos : sep_[ leaf - 1 ] );
+    }
+
+    sorted_iterator sorted_begin() const
+    {
+        return sorted_iterator( this, 0 );
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        return sorted_iterator( this, size() );
+    }
+
+    // Elements equal to key.
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const vector_type& key ) const
+    {
+        return std::make_pair( sorted_iterator( this, rank( key, false ) ),
+                               sorted_iterator( this, rank( key, true ) ) );
+    }
+
+    // Elements in [lo, hi).
+    std::pair< sorted_iterator, sorted_iterator > sorted_range( const vector_type& lo, const vector_type& hi ) const
+    {
+        size_t first = rank( lo, false );
+        size_t last = std::max( first, rank( hi, false ) );
+        return std::make_pair( sorted_iterator( this, first ), sorted_iterator( this, last ) );
+    }
+
+    // Number of elements in [lo, hi).
+    size_t count( const vector_type& lo, const vector_type& hi ) const
+    {
+        auto r = sorted_range( lo, hi );
+        return r.second - r.first;
+    }
+
     const_iterator find( const vector_type& key ) const
     {
+        stats_.lookup();
         auto index = find_index( key );
 
         if( 0 == index.first )
         {
             return index.second;
         }
-        
-        compare_type comp;
-        auto it = std::lower_bound( index_vector_[ index.first ].begin(),
-                                    index_vector_[ index.first ].end(), key,
-            [ & ]( const size_type& lhs, const size_type& rhs ) -> bool
-            {
-                return comp( vector_[ lhs ], vector_[ rhs ] );
-            });
+        if( index.first + 1 >= offset_.size() )
+        {
+            return vector_.cend();
+        }
+
+        auto comp = detail::counted( compare_type(), stats_ );
+        stats_.window( offset_[ index.first + 1 ] - offset_[ index.first ] );
+        size_t pos = index_.partition_point( offset_[ index.first ], offset_[ index.first + 1 ],
+                                             [&]( const vector_type& val ){ return comp( val, key ); } );
 
-        if( index_vector_[ index.first ].end() == it )
+        if( offset_[ index.first + 1 ] == pos )
         {
             return vector_.cend();
         }
 
-        if( !comp( key, vector_[ *it ] ) &&
-            !comp( vector_[ *it ], key ) )
+        if( !comp( key, index_.key( pos ) ) &&
+            !comp( index_.key( pos ), key ) )
         {
-            auto ret = vector_.cbegin();
-            std::advance( ret, *it );
-            return ret;
+            return position( pos );
         }
 
         return vector_.cend();
     }
 
+#if defined( VECIDX_COROUTINES )
+    // find() as a coroutine for a lookup_scheduler: the top node, which
+    // stays cached, is walked straight, the leaf search prefetches every
+    // probe and suspends before reading it.
+    lookup< const_iterator > find_coro( vector_type key ) const
+    {
+        stats_.lookup();
+        auto index = find_index( key );
+
+        if( 0 == index.first )
+        {
+            co_return index.second;
+        }
+        if( index.first + 1 >= offset_.size() )
+        {
+            co_return vector_.cend();
+        }
+
+        auto comp = detail::counted( compare_type(), stats_ );
+        size_t first = offset_[ index.first ];
+        size_t last = offset_[ index.first + 1 ];
+        stats_.window( last - first );
+        for( size_t count = last - first; count > 0; )
+        {
+            size_t step = count / 2;
+            // With position_only the slot, then the key it points to.
+            if( index_.indirect_keys )
+            {
+                index_.touch_slot( first + step );
+                co_await std::suspend_always();
+            }
+            index_.touch( first + step );
+            co_await std::suspend_always();
+            if( comp( index_.key( first + step ), key ) )
+            {
+                first += step + 1;
+                count -= step + 1;
+            }
+            else
+            {
+                count = step;
+            }
+        }
+
+        if( last != first &&
+            !comp( key, index_.key( first ) ) &&
+            !comp( index_.key( first ), key ) )
+        {
+            co_return position( first );
+        }
+        co_return vector_.cend();
+    }
+#endif
+
+    // Writes find( key ) of every key in [first, last) to out. The group
+    // walks the top node and then its leaves in lock-step, prefetching the
+    // next probe of every key.
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        compare_type comp;
+        detail::for_each_group< vector_type >( first, last,
+            [&]( const vector_type* keys, size_t count )
+            {
+                size_t leaf[ batch_group_size ];
+                const_iterator ret[ batch_group_size ];
+                find_index_group( keys, count, leaf, ret );
+
+                size_t pos[ batch_group_size ];
+                size_t size[ batch_group_size ];
+                for( size_t g = 0; g < count; ++g )
+                {
+                    if( 0 == leaf[ g ] || leaf[ g ] + 1 >= offset_.size() )
+                    {
+                        leaf[ g ] = 0;
+                        pos[ g ] = 0;
+                        size[ g ] = 0;
+                        continue;
+                    }
+                    pos[ g ] = offset_[ leaf[ g ] ];
+                    size[ g ] = offset_[ leaf[ g ] + 1 ] - pos[ g ];
+                }
+
+                detail::lower_bound_group( keys, count, pos, size,
+                    [&]( size_t, size_t i ) -> decltype( index_.key( i ) ) { return index_.key( i ); },
+                    [&]( size_t, size_t i ) { index_.touch( i ); },
+                    comp );
+
+                for( size_t g = 0; g < count; ++g )
+                {
+                    if( 0 != leaf[ g ] && pos[ g ] < offset_[ leaf[ g ] + 1 ] &&
+                        !comp( keys[ g ], index_.key( pos[ g ] ) ) &&
+                        !comp( index_.key( pos[ g ] ), keys[ g ] ) )
+                    {
+                        ret[ g ] = position( pos[ g ] );
+                    }
+                    *out++ = ret[ g ];
+                }
+            });
+        return out;
+    }
+
 private:
+    typedef std::vector< size_t, detail::rebind_alloc< allocator_type, size_t > > table_type;
+
     const std::vector< vector_type >& vector_;
-    std::vector< std::vector< size_type > > index_vector_;
+    index_storage< storage_type, size_type, vector_type, allocator_type > index_;
+    // Start of the top node and of every leaf in index_, plus the total.
+    table_type offset_;
+    // Top node slot of the key after leaf i + 1 in sorted order, or
+    // no_separator for padding, and the sorted position of the first
+    // element of every leaf, indexed like offset_.
+    table_type sep_;
+    table_type rank_;
+    mutable stats_type stats_;
+
+    static const size_t no_separator = static_cast< size_t >( -1 );
 
     static const size_t cache_line_size_ = 64;
 
@@ -85,60 +335,134 @@ private:
         return ( 16 * cache_line_size_ ) / sizeof( size_type );
     }
 
-    void fill_index( typename std::vector< size_type >::const_iterator begin,
-                     typename std::vector< size_type >::const_iterator end,
-                     size_t index_size )
+    const_iterator position( size_t pos ) const
+    {
+        auto ret = vector_.cbegin();
+        std::advance( ret, index_.position( pos ) );
+        return ret;
+    }
+
+    // Size of the top node.
+    size_t top_size() const
+    {
+        return offset_.size() > 1 ? offset_[ 1 ] : 0;
+    }
+
+    // Elements indexed, padding excluded.
+    size_t size() const
+    {
+        return rank_.empty() ? 0 : rank_.back();
+    }
+
+    void set_ranks()
+    {
+        rank_.assign( offset_.size(), 0 );
+        for( size_t i = 1; i + 1 < offset_.size(); ++i )
+        {
+            bool sep = i - 1 < sep_.size() && no_separator != sep_[ i - 1 ];
+            rank_[ i + 1 ] = rank_[ i ] + offset_[ i + 1 ] - offset_[ i ] + sep;
+        }
+    }
+
+    // Sorted position of lower_bound( key ), or of upper_bound( key ) when
+    // upper. The walk goes left on a match, so it always ends in a leaf.
+    size_t rank( const vector_type& key, bool upper ) const
+    {
+        if( 0 == size() )
+        {
+            return 0;
+        }
+
+        compare_type comp;
+        auto before = [&]( const vector_type& val )
+                      {
+                          return upper ? !comp( key, val ) : comp( val, key );
+                      };
+
+        size_t pos = 0;
+        size_t leaf = 1;
+        for( size_t index_size = get_index_size(); index_size > 1; index_size /= 2 )
+        {
+            if( before( index_.key( pos ) ) )
+            {
+                pos += index_size / 2;
+                leaf += index_size / 2;
+            }
+            else
+            {
+                pos++;
+            }
+        }
+
+        pos = index_.partition_point( offset_[ leaf ], offset_[ leaf + 1 ], before );
+        return rank_[ leaf ] + pos - offset_[ leaf ];
+    }
+
+    // Appends the top node to top, the [first, last) range in idx of
+    // every leaf to leaves and the top node slot between every two leaves to
+    // seps, in order. The top node always gets the full shape find_index()
+    // walks: a range that runs out early is padded with the position of a
+    // neighbour, whose key keeps the node ordered and finds that neighbour
+    // on a match.
+    static void fill_index( typename std::vector< size_type >::const_iterator idx,
+                            typename std::vector< size_type >::const_iterator begin,
+                            typename std::vector< size_type >::const_iterator end,
+                            size_t index_size,
+                            size_type pad,
+                            std::vector< size_type >& top,
+                            std::vector< std::pair< size_t, size_t > >& leaves,
+                            table_type& seps )
     {
         if( 1 == index_size )
         {
-            index_vector_.emplace_back( begin, end );
+            leaves.emplace_back( begin - idx, end - idx );
             return;
         }
         size_t diff = std::distance( begin, end );
         if( 0 == diff )
         {
-            return;
-        }
-        if( 1 == diff )
-        {
-            index_vector_[ 0 ].push_back( *begin );
+            top.push_back( pad );
+            fill_index( idx, begin, end, index_size / 2, pad, top, leaves, seps );
+            seps.push_back( no_separator );
+            fill_index( idx, begin, end, index_size / 2, pad, top, leaves, seps );
             return;
         }
         
         auto middle = begin;
         std::advance( middle, diff / 2 );
 
-        index_vector_[ 0 ].push_back( *middle );
-        fill_index( begin, middle, index_size / 2 );
-        fill_index( middle + 1, end, index_size / 2 );
+        size_t slot = top.size();
+        top.push_back( *middle );
+        fill_index( idx, begin, middle, index_size / 2, *middle, top, leaves, seps );
+        seps.push_back( slot );
+        fill_index( idx, middle + 1, end, index_size / 2, *middle, top, leaves, seps );
     }
 
     std::pair<size_t, const_iterator> find_index( const vector_type& key ) const
     {
-        compare_type comp;
+        auto comp = detail::counted( compare_type(), stats_ );
         size_t index_size = get_index_size();
 
         size_t pos = 0;
         size_t ret_index = 1;
-        while( pos < index_vector_[ 0 ].size() )
+        while( pos < top_size() )
         {
-            if( comp( key, vector_[ index_vector_[ 0 ][ pos ] ] ) )
+            stats_.level( 0 );
+            if( comp( key, index_.key( pos ) ) )
             {
-                // key < vector_[ index_vector_[ 0 ][ pos ] ]
+                // key < top[ pos ]
                 pos++;
             }
-            else if( comp( vector_[ index_vector_[ 0 ][ pos ] ], key ) )
+            else if( comp( index_.key( pos ), key ) )
             {
-                // vector_[ index_vector_[ 0 ][ pos ] ] < key
+                // top[ pos ] < key
                 pos += index_size / 2;
                 ret_index += index_size / 2;
             }
             else
             {
-                // vector_[ index_vector_[ 0 ][ pos ] ] == key
-                auto ret = vector_.cbegin();
-                std::advance( ret, index_vector_[ 0 ][ pos ] );
-                return std::make_pair( 0, ret );
+                // top[ pos ] == key
+                return std::make_pair( 0, position( pos ) );
             }
             index_size /= 2;
 
@@ -153,8 +477,83 @@ private:
         return std::make_pair( 0, vector_.cend() );
     }
 
+    // find_index() of count keys in lock-step. Keys found in the top node
+    // get leaf 0 and their result in ret, the others their leaf number.
+    void find_index_group( const vector_type* keys, size_t count, size_t* leaf, const_iterator* ret ) const
+    {
+        compare_type comp;
+        size_t top = top_size();
+
+        size_t pos[ batch_group_size ];
+        size_t index_size[ batch_group_size ];
+        bool active[ batch_group_size ];
+        bool more = false;
+        for( size_t g = 0; g < count; ++g )
+        {
+            pos[ g ] = 0;
+            index_size[ g ] = get_index_size();
+            leaf[ g ] = ( 0 == top ) ? 0 : 1;
+            ret[ g ] = vector_.cend();
+            active[ g ] = 0 != top;
+            more |= active[ g ];
+        }
+        if( more )
+        {
+            index_.touch( 0 );
+        }
+
+        while( more )
+        {
+            more = false;
+            for( size_t g = 0; g < count; ++g )
+            {
+                if( !active[ g ] )
+                {
+                    continue;
+                }
+
+                const vector_type& val = index_.key( pos[ g ] );
+                if( comp( keys[ g ], val ) )
+                {
+                    pos[ g ]++;
+                }
+                else if( comp( val, keys[ g ] ) )
+                {
+                    pos[ g ] += index_size[ g ] / 2;
+                    leaf[ g ] += index_size[ g ] / 2;
+                }
+                else
+                {
+                    ret[ g ] = position( pos[ g ] );
+                    leaf[ g ] = 0;
+                    active[ g ] = false;
+                    continue;
+                }
+                index_size[ g ] /= 2;
+
+                if( 1 == index_size[ g ] || pos[ g ] >= top )
+                {
+                    // Same as find_index(): running off the top node
+                    // without reaching a leaf means end().
+                    if( 1 != index_size[ g ] )
+                    {
+                        leaf[ g ] = 0;
+                    }
+                    active[ g ] = false;
+                    continue;
+                }
+                index_.touch( pos[ g ] );
+                more = true;
+            }
+        }
+    }
+
 };
 
+template< typename Size_T, typename VecType_T, typename VecComp_T, typename Storage_T, typename Alloc_T,
+          typename Stats_T >
+const size_t tree_index< Size_T, VecType_T, VecComp_T, Storage_T, Alloc_T, Stats_T >::no_separator;
+
 } // namespace vecidx
 
 #endif // VECIDX_MAP_INDEX_H
@@ -2,57 +2,184 @@
 #define VECIDX_VECTOR_INDEX_H
 
 #include <cstdint>
+#include <vector>
 #include <functional>
 #include <algorithm>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <stdexcept>
+
+#include "batch.h"
+#include "build.h"
+#include "rank_iterator.h"
+#include "storage.h"
 
 namespace vecidx {
 
 template< typename Size_T,
           typename VecType_T,
-          typename VecComp_T = std::less<VecType_T> >
+          typename VecComp_T = std::less<VecType_T>,
+          typename Storage_T = position_only,
+          typename Alloc_T = aligned_allocator< VecType_T > >
 class vector_index
 {
 public:
     typedef Size_T size_type;
     typedef VecType_T vector_type;
     typedef VecComp_T compare_type;
+    typedef Storage_T storage_type;
+    typedef Alloc_T allocator_type;
     typedef typename std::vector< vector_type >::const_iterator const_iterator;
+    typedef rank_iterator< vector_index > sorted_iterator;
+
+    // Pending inserts and erases past which they are merged into the index.
+    static const size_t default_merge_threshold = 4096;
 
-    vector_index( const std::vector<VecType_T>& vec ) : vector_(vec) {}
+    vector_index( const std::vector<VecType_T>& vec, const Alloc_T& alloc = Alloc_T() )
+        : vector_(vec), index_(vec, alloc), merge_threshold_( default_merge_threshold ) {}
 
     void build_index()
     {
-        index_.resize( vector_.size() );
-        std::iota( index_.begin(), index_.end(), 0 );
+        index_.assign( detail::sorted_permutation< size_type >( vector_, compare_type() ) );
+        delta_.clear();
+        erased_.clear();
+    }
+
+    const vector_type& at( size_t num )
+    {
+        merge();
+        return vector_[ index_.position( num ) ];
+    }
 
+    // Adds the element at pos, usually one just appended to the vector,
+    // without rebuilding the index. It is kept in a small sorted buffer
+    // searched together with the index until merge().
+    void insert( size_t pos )
+    {
         compare_type comp;
-        std::sort( index_.begin(), index_.end(),
-                   [&]( const size_type& lhs, const size_type& rhs )
-                   {
-                       return comp( vector_[lhs], vector_[rhs] );
-                   });
+        auto it = std::upper_bound( delta_.begin(), delta_.end(), vector_[ pos ],
+                                    [&]( const vector_type& key, const size_type& rhs )
+                                    {
+                                        return comp( key, vector_[ rhs ] );
+                                    });
+        delta_.insert( it, static_cast< size_type >( pos ) );
+        merge_if_needed();
     }
 
-    const vector_type& at( size_t num )
+    // Removes the element at pos from the index, the vector is untouched.
+    // Returns false when pos is not indexed.
+    bool erase( size_t pos )
     {
-        return vector_[ index_[num] ];
+        compare_type comp;
+        const vector_type& key = vector_[ pos ];
+
+        auto it = std::lower_bound( delta_.begin(), delta_.end(), key,
+                                    [&]( const size_type& lhs, const vector_type& key )
+                                    {
+                                        return comp( vector_[ lhs ], key );
+                                    });
+        for( ; delta_.end() != it && !comp( key, vector_[ *it ] ); ++it )
+        {
+            if( pos == *it )
+            {
+                delta_.erase( it );
+                return true;
+            }
+        }
+
+        for( size_t slot = lower_bound_slot( key );
+             slot < index_.size() && !comp( key, index_.key( slot ) ); ++slot )
+        {
+            if( pos == index_.position( slot ) && !is_erased( slot ) )
+            {
+                erased_.insert( std::upper_bound( erased_.begin(), erased_.end(), slot ), slot );
+                merge_if_needed();
+                return true;
+            }
+        }
+        return false;
     }
 
-    const_iterator lower_bound( const vector_type& key ) const
+    // Folds pending inserts and erases into the index, in one linear pass.
+    void merge()
     {
+        if( delta_.empty() && erased_.empty() )
+        {
+            return;
+        }
+
         compare_type comp;
-        auto pos = std::lower_bound( index_.begin(), index_.end(), key,
-                                     [&]( const size_type& lhs, const vector_type& key )
-                                     {
-                                         return comp( vector_[lhs], key );
-                                     });
-        if( index_.end() != pos )
+        std::vector< size_type > idx;
+        idx.reserve( index_.size() - erased_.size() + delta_.size() );
+
+        auto erased = erased_.begin();
+        auto delta = delta_.begin();
+        for( size_t slot = 0; slot < index_.size(); ++slot )
         {
-            auto ret = vector_.cbegin();
-            std::advance( ret, static_cast<size_t>(*pos) );
-            return ret;
+            if( erased_.end() != erased && slot == *erased )
+            {
+                ++erased;
+                continue;
+            }
+            for( ; delta_.end() != delta && comp( vector_[ *delta ], index_.key( slot ) ); ++delta )
+            {
+                idx.push_back( *delta );
+            }
+            idx.push_back( index_.position( slot ) );
         }
-        return vector_.cend();
+        idx.insert( idx.end(), delta, delta_.end() );
+
+        index_.assign( idx );
+        delta_.clear();
+        erased_.clear();
+    }
+
+    // Writes the built index to path, for load() to map it back instead of
+    // building. Pending inserts and erases must be merge()d first.
+    void save( const std::string& path ) const
+    {
+        if( 0 != pending() )
+        {
+            throw image_error( "merge() pending changes before save()" );
+        }
+        image_writer image( "vector_index", vector_, size_type() );
+        index_.save( image );
+        image.save( path );
+    }
+
+    // Uses the image at path in place of build_index(), mapped and not
+    // copied. Throws image_error unless it is an image of this index type
+    // built from the same data.
+    void load( const std::string& path )
+    {
+        image_reader image( path, "vector_index", vector_, size_type() );
+        index_.load( image, 0 );
+        delta_.clear();
+        erased_.clear();
+    }
+
+    size_t pending() const
+    {
+        return delta_.size() + erased_.size();
+    }
+
+    // Bytes of the index, pending changes included, without the vector.
+    size_t memory_usage() const
+    {
+        return index_.memory_usage() + delta_.capacity() * sizeof( size_type ) +
+               erased_.capacity() * sizeof( size_t );
+    }
+
+    void set_merge_threshold( size_t threshold )
+    {
+        merge_threshold_ = threshold;
+        merge_if_needed();
+    }
+
+    const_iterator lower_bound( const vector_type& key ) const
+    {
+        return resolve( lower_bound_slot( key ), key );
     }
 
     const_iterator find( const vector_type& key ) const
@@ -66,9 +193,207 @@ public:
         return vector_.cend();
     }
 
+    // Element at sorted position rank of the built index.
+    const_iterator nth( size_t rank ) const
+    {
+        if( rank >= index_.size() )
+        {
+            return vector_.cend();
+        }
+        return position( index_.position( rank ) );
+    }
+
+    // Sorted order iteration walks the built index, pending inserts and
+    // erases must be merge()d first.
+    sorted_iterator sorted_begin() const
+    {
+        check_merged();
+        return sorted_iterator( this, 0 );
+    }
+
+    sorted_iterator sorted_end() const
+    {
+        check_merged();
+        return sorted_iterator( this, index_.size() );
+    }
+
+    // Elements equal to key.
+    std::pair< sorted_iterator, sorted_iterator > equal_range( const vector_type& key ) const
+    {
+        check_merged();
+        compare_type comp;
+        size_t first = lower_bound_slot( key );
+        size_t last = partition_slot( first, [&]( const vector_type& val ){ return !comp( key, val ); } );
+        return std::make_pair( sorted_iterator( this, first ), sorted_iterator( this, last ) );
+    }
+
+    // Elements in [lo, hi).
+    std::pair< sorted_iterator, sorted_iterator > sorted_range( const vector_type& lo, const vector_type& hi ) const
+    {
+        check_merged();
+        size_t first = lower_bound_slot( lo );
+        size_t last = std::max( first, lower_bound_slot( hi ) );
+        return std::make_pair( sorted_iterator( this, first ), sorted_iterator( this, last ) );
+    }
+
+    // Number of elements in [lo, hi), pending inserts and erases included.
+    size_t count( const vector_type& lo, const vector_type& hi ) const
+    {
+        compare_type comp;
+        if( comp( hi, lo ) )
+        {
+            return 0;
+        }
+
+        size_t first = lower_bound_slot( lo );
+        size_t last = lower_bound_slot( hi );
+        size_t ret = last - first;
+        ret -= std::lower_bound( erased_.begin(), erased_.end(), last ) -
+               std::lower_bound( erased_.begin(), erased_.end(), first );
+
+        auto less = [&]( const size_type& lhs, const vector_type& key )
+                    {
+                        return comp( vector_[ lhs ], key );
+                    };
+        ret += std::lower_bound( delta_.begin(), delta_.end(), hi, less ) -
+               std::lower_bound( delta_.begin(), delta_.end(), lo, less );
+        return ret;
+    }
+
+    // Writes lower_bound( key ) of every key in [first, last) to out.
+    template< typename InputIt, typename OutputIt >
+    OutputIt lower_bound_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        detail::for_each_group< vector_type >( first, last,
+            [&]( const vector_type* keys, size_t count )
+            {
+                size_t pos[ batch_group_size ];
+                lower_bound_group( keys, count, pos );
+                for( size_t g = 0; g < count; ++g )
+                {
+                    *out++ = resolve( pos[ g ], keys[ g ] );
+                }
+            });
+        return out;
+    }
+
+    // Writes find( key ) of every key in [first, last) to out.
+    template< typename InputIt, typename OutputIt >
+    OutputIt find_batch( InputIt first, InputIt last, OutputIt out ) const
+    {
+        detail::for_each_group< vector_type >( first, last,
+            [&]( const vector_type* keys, size_t count )
+            {
+                size_t pos[ batch_group_size ];
+                lower_bound_group( keys, count, pos );
+                for( size_t g = 0; g < count; ++g )
+                {
+                    auto ret = resolve( pos[ g ], keys[ g ] );
+                    *out++ = ( vector_.cend() != ret && keys[ g ] == *ret ) ? ret : vector_.cend();
+                }
+            });
+        return out;
+    }
+
 private:
     const std::vector< vector_type >& vector_;
-    std::vector< size_type > index_;
+    index_storage< storage_type, size_type, vector_type, allocator_type > index_;
+    // Inserted positions, sorted by key, and erased slots of index_, sorted.
+    std::vector< size_type > delta_;
+    std::vector< size_t > erased_;
+    size_t merge_threshold_;
+
+    void merge_if_needed()
+    {
+        if( pending() > merge_threshold_ )
+        {
+            merge();
+        }
+    }
+
+    bool is_erased( size_t slot ) const
+    {
+        return std::binary_search( erased_.begin(), erased_.end(), slot );
+    }
+
+    void check_merged() const
+    {
+        if( 0 != pending() )
+        {
+            throw std::logic_error( "vecidx: merge() pending changes before iterating in sorted order" );
+        }
+    }
+
+    size_t lower_bound_slot( const vector_type& key ) const
+    {
+        compare_type comp;
+        return partition_slot( 0, [&]( const vector_type& val ){ return comp( val, key ); } );
+    }
+
+    // First slot from first on whose key fails pred, pred being true for a
+    // prefix of the slots.
+    template< typename Pred_T >
+    size_t partition_slot( size_t first, Pred_T pred ) const
+    {
+        return index_.partition_point( first, index_.size(), pred );
+    }
+
+    const_iterator position( size_t pos ) const
+    {
+        auto ret = vector_.cbegin();
+        std::advance( ret, pos );
+        return ret;
+    }
+
+    // lower_bound( key ) given its slot in index_: skips erased slots and
+    // takes the delta buffer's answer when it sorts first.
+    const_iterator resolve( size_t slot, const vector_type& key ) const
+    {
+        if( !erased_.empty() )
+        {
+            while( slot < index_.size() && is_erased( slot ) )
+            {
+                ++slot;
+            }
+        }
+
+        compare_type comp;
+        if( !delta_.empty() )
+        {
+            auto it = std::lower_bound( delta_.begin(), delta_.end(), key,
+                                        [&]( const size_type& lhs, const vector_type& key )
+                                        {
+                                            return comp( vector_[ lhs ], key );
+                                        });
+            if( delta_.end() != it &&
+                ( index_.size() == slot || comp( vector_[ *it ], index_.key( slot ) ) ) )
+            {
+                return position( *it );
+            }
+        }
+
+        if( index_.size() == slot )
+        {
+            return vector_.cend();
+        }
+        return position( index_.position( slot ) );
+    }
+
+    void lower_bound_group( const vector_type* keys, size_t count, size_t* pos ) const
+    {
+        size_t size[ batch_group_size ];
+        for( size_t g = 0; g < count; ++g )
+        {
+            pos[ g ] = 0;
+            size[ g ] = index_.size();
+        }
+
+        compare_type comp;
+        detail::lower_bound_group( keys, count, pos, size,
+            [&]( size_t, size_t i ) -> decltype( index_.key( i ) ) { return index_.key( i ); },
+            [&]( size_t, size_t i ) { index_.touch( i ); },
+            comp );
+    }
 };
 
 }